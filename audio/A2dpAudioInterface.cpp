@@ -321,6 +321,7 @@ ssize_t A2dpAudioInterface::A2dpAudioStreamOut::write(const void* buffer, size_t
             usleep(mBufferDurationUs - (uint32_t)ns2us(now - mLastWriteTime));
         }
         mLastWriteTime = now;
+        mErrorPacer.standby();
         return bytes;
 
     }
@@ -329,7 +330,7 @@ Error:
     standby();
 
     // Simulate audio output timing in case of error
-    usleep(mBufferDurationUs);
+    mErrorPacer.wait(bytes / frameSize(), sampleRate());
 
     return status;
 }
@@ -120,6 +120,7 @@ private:
                 bool        mSuspended;
                 nsecs_t     mLastWriteTime;
                 uint32_t    mBufferDurationUs;
+                AudioStreamPacer mErrorPacer; // write timing while the sink is unavailable
     };
 
     friend class A2dpAudioStreamOut;
@@ -8,6 +8,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
     AudioHardwareInterface.cpp \
+    audio_device_conv.cpp \
     audio_hw_hal.cpp
 
 LOCAL_MODULE := libaudiohw_legacy
@@ -62,6 +63,50 @@ LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
 
 include $(BUILD_SHARED_LIBRARY)
 
+# Host tool replaying audio policy event traces, see AudioPolicyReplay.cpp.
+# libmedia_helper is a target only library: build AudioParameter into the tool instead.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    AudioPolicyManagerBase.cpp \
+    AudioPolicyReplay.cpp \
+    ../../../frameworks/av/media/libmedia/AudioParameter.cpp
+
+LOCAL_STATIC_LIBRARIES := \
+    libutils \
+    libcutils \
+    liblog
+
+LOCAL_LDLIBS := -lpthread
+ifeq ($(HOST_OS),linux)
+LOCAL_LDLIBS += -lrt -ldl
+endif
+
+LOCAL_MODULE := audio_policy_replay
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -Wno-unused-parameter
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/../include \
+    $(TOP)/frameworks/av/include
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Host test of the legacy HAL shim device conversion, see audio_device_conv_test.cpp.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    audio_device_conv.cpp \
+    audio_device_conv_test.cpp
+
+LOCAL_MODULE := audio_device_conv_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_CFLAGS := -Wno-unused-parameter
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/../include \
+    $(TOP)/frameworks/av/include
+
+include $(BUILD_HOST_EXECUTABLE)
+
 #ifeq ($(ENABLE_AUDIO_DUMP),true)
 #  LOCAL_SRC_FILES += AudioDumpInterface.cpp
 #  LOCAL_CFLAGS += -DENABLE_AUDIO_DUMP
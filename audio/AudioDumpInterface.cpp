@@ -20,9 +20,15 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <cutils/atomic.h>
 #include <utils/Log.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "AudioDumpInterface.h"
@@ -31,6 +37,356 @@ namespace android {
 
 // ----------------------------------------------------------------------------
 
+AudioDumpRing::AudioDumpRing(size_t capacity)
+    : mBuffer(NULL), mCapacity(1), mFront(0), mRear(0)
+{
+    while (mCapacity < capacity) {
+        mCapacity <<= 1;
+    }
+    mBuffer = new uint8_t[mCapacity];
+}
+
+AudioDumpRing::~AudioDumpRing()
+{
+    delete[] mBuffer;
+}
+
+bool AudioDumpRing::push(const void *buffer, size_t bytes)
+{
+    int32_t rear = mRear;
+    uint32_t filled = (uint32_t)(rear - android_atomic_acquire_load(&mFront));
+    if (bytes > mCapacity - filled) {
+        return false;
+    }
+    size_t offset = rear & (mCapacity - 1);
+    size_t part = mCapacity - offset;
+    if (part > bytes) {
+        part = bytes;
+    }
+    memcpy(mBuffer + offset, buffer, part);
+    memcpy(mBuffer, (const uint8_t *)buffer + part, bytes - part);
+    android_atomic_release_store(rear + (int32_t)bytes, &mRear);
+    return true;
+}
+
+size_t AudioDumpRing::peek(const uint8_t **data)
+{
+    int32_t front = mFront;
+    size_t filled = (uint32_t)(android_atomic_acquire_load(&mRear) - front);
+    size_t offset = front & (mCapacity - 1);
+    *data = mBuffer + offset;
+    return (filled < mCapacity - offset) ? filled : mCapacity - offset;
+}
+
+void AudioDumpRing::consume(size_t bytes)
+{
+    android_atomic_release_store(mFront + (int32_t)bytes, &mFront);
+}
+
+size_t AudioDumpRing::available() const
+{
+    return (uint32_t)(android_atomic_acquire_load(&mRear) - android_atomic_acquire_load(&mFront));
+}
+
+// ----------------------------------------------------------------------------
+
+AudioDumpWriter::Channel::Channel(const String8& fileName, size_t ringSize)
+    : mFileName(fileName), mFile(NULL), mRing(ringSize), mDroppedBytes(0), mClosing(false)
+{
+}
+
+AudioDumpWriter::AudioDumpWriter()
+    : Thread(false), mRingSize(AUDIO_DUMP_RING_SIZE), mFlushSize(AUDIO_DUMP_FLUSH_SIZE),
+      mDroppedBytes(0)
+{
+}
+
+AudioDumpWriter::~AudioDumpWriter()
+{
+    for (size_t i = 0; i < mChannels.size(); i++) {
+        drain(mChannels[i], true);
+        if (mChannels[i]->mFile != NULL) {
+            fclose(mChannels[i]->mFile);
+        }
+        delete mChannels[i];
+    }
+}
+
+AudioDumpWriter::Channel *AudioDumpWriter::openChannel(const String8& fileName)
+{
+    Mutex::Autolock _l(mLock);
+    Channel *channel = new Channel(fileName, mRingSize);
+    mChannels.add(channel);
+    ALOGV("openChannel() %s ring %zu", fileName.string(), mRingSize);
+    return channel;
+}
+
+void AudioDumpWriter::write(Channel *channel, const void *buffer, size_t bytes)
+{
+    if (!channel->mRing.push(buffer, bytes)) {
+        channel->mDroppedBytes += bytes;
+    }
+    size_t available = channel->mRing.available();
+    size_t flushSize = (size_t)android_atomic_acquire_load(&mFlushSize);
+    // wake up the writer once per flush when the threshold is crossed
+    if (available >= flushSize && available - bytes < flushSize) {
+        mWaitWorkCV.signal();
+    }
+}
+
+void AudioDumpWriter::closeChannel(Channel *channel)
+{
+    Mutex::Autolock _l(mLock);
+    channel->mClosing = true;
+    mWaitWorkCV.signal();
+}
+
+void AudioDumpWriter::setRingSize(size_t size)
+{
+    Mutex::Autolock _l(mLock);
+    mRingSize = size;
+}
+
+void AudioDumpWriter::setFlushSize(size_t size)
+{
+    android_atomic_release_store((int32_t)size, &mFlushSize);
+}
+
+void AudioDumpWriter::exit()
+{
+    {
+        Mutex::Autolock _l(mLock);
+        requestExit();
+        mWaitWorkCV.signal();
+    }
+    requestExitAndWait();
+}
+
+void AudioDumpWriter::drain(Channel *channel, bool all)
+{
+    size_t flushSize = (size_t)android_atomic_acquire_load(&mFlushSize);
+    while (all || channel->mRing.available() >= flushSize) {
+        const uint8_t *data;
+        size_t bytes = channel->mRing.peek(&data);
+        if (bytes == 0) {
+            break;
+        }
+        if (channel->mFile == NULL) {
+            channel->mFile = fopen(channel->mFileName.string(), "wb");
+            ALOGV("drain() opening dump file %s, fh %p", channel->mFileName.string(),
+                  channel->mFile);
+        }
+        if (channel->mFile != NULL) {
+            fwrite(data, bytes, 1, channel->mFile);
+        }
+        channel->mRing.consume(bytes);
+    }
+}
+
+bool AudioDumpWriter::threadLoop()
+{
+    Mutex::Autolock _l(mLock);
+    // only this thread removes channels: indices stay valid while mLock is released
+    for (size_t i = 0; i < mChannels.size(); ) {
+        Channel *channel = mChannels[i];
+        bool closing = channel->mClosing;
+        mLock.unlock();
+        drain(channel, closing);
+        mLock.lock();
+        if (!closing) {
+            i++;
+            continue;
+        }
+        if (channel->mFile != NULL) {
+            fclose(channel->mFile);
+        }
+        if (channel->mDroppedBytes != 0) {
+            ALOGW("dump file %s: %u bytes dropped", channel->mFileName.string(),
+                  channel->mDroppedBytes);
+            mDroppedBytes += channel->mDroppedBytes;
+        }
+        mChannels.removeAt(i);
+        delete channel;
+    }
+    if (!exitPending()) {
+        mWaitWorkCV.waitRelative(mLock, milliseconds(WRITER_PERIOD_MS));
+    }
+    return !exitPending();
+}
+
+// ----------------------------------------------------------------------------
+
+static uint32_t readLe32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t readLe16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+AudioDumpWavSource::AudioDumpWavSource()
+    : mMap(NULL), mMapSize(0), mData(NULL), mFrames(0), mSampleRate(0), mChannelCount(0),
+      mBytesPerSample(0), mPosition(0)
+{
+}
+
+AudioDumpWavSource::~AudioDumpWavSource()
+{
+    close();
+}
+
+status_t AudioDumpWavSource::open(const char *path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        ALOGW("AudioDumpWavSource cannot open %s", path);
+        return NAME_NOT_FOUND;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < AUDIO_DUMP_WAVE_HDR_SIZE) {
+        ALOGW("AudioDumpWavSource %s is too short", path);
+        ::close(fd);
+        return BAD_VALUE;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        ALOGW("AudioDumpWavSource cannot map %s", path);
+        return NO_MEMORY;
+    }
+    mMap = map;
+    mMapSize = st.st_size;
+
+    // RIFF header followed by chunks: "fmt " must precede "data"
+    const uint8_t *data = (const uint8_t *)mMap;
+    if (memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        ALOGW("AudioDumpWavSource %s is not a WAV file", path);
+        close();
+        return BAD_VALUE;
+    }
+    size_t pos = 12;
+    while (pos + 8 <= mMapSize) {
+        const uint8_t *chunk = data + pos;
+        size_t chunkSize = readLe32(chunk + 4);
+        pos += 8;
+        if (chunkSize > mMapSize - pos) {
+            chunkSize = mMapSize - pos;
+        }
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16) {
+            uint16_t audioFormat = readLe16(chunk + 8);
+            mChannelCount = readLe16(chunk + 10);
+            mSampleRate = readLe32(chunk + 12);
+            mBytesPerSample = readLe16(chunk + 22) / 8;
+            if (audioFormat != 1 || mChannelCount == 0 || mSampleRate == 0 ||
+                    (mBytesPerSample != 1 && mBytesPerSample != 2)) {
+                ALOGW("AudioDumpWavSource %s unsupported format %u, %u channels, %u bytes",
+                      path, audioFormat, mChannelCount, mBytesPerSample);
+                break;
+            }
+        } else if (memcmp(chunk, "data", 4) == 0 && mSampleRate != 0) {
+            mData = chunk + 8;
+            mFrames = chunkSize / (mChannelCount * mBytesPerSample);
+            break;
+        }
+        // chunks are word aligned
+        pos += chunkSize + (chunkSize & 1);
+    }
+    if (mData == NULL || mFrames == 0) {
+        ALOGW("AudioDumpWavSource no PCM data in %s", path);
+        close();
+        return BAD_VALUE;
+    }
+    ALOGV("AudioDumpWavSource %s: %zu frames, %u Hz, %u channels, %u bytes per sample",
+          path, mFrames, mSampleRate, mChannelCount, mBytesPerSample);
+    return NO_ERROR;
+}
+
+void AudioDumpWavSource::close()
+{
+    if (mMap != NULL) {
+        munmap(mMap, mMapSize);
+    }
+    mMap = NULL;
+    mMapSize = 0;
+    mData = NULL;
+    mFrames = 0;
+    mSampleRate = 0;
+    mChannelCount = 0;
+    mBytesPerSample = 0;
+    mPosition = 0;
+}
+
+int32_t AudioDumpWavSource::sampleAt(size_t frame, uint32_t channel) const
+{
+    const uint8_t *sample = mData + (frame * mChannelCount + channel) * mBytesPerSample;
+    if (mBytesPerSample == 1) {
+        return ((int32_t)sample[0] - 128) << 8;
+    }
+    return (int16_t)readLe16(sample);
+}
+
+int32_t AudioDumpWavSource::convertedSample(uint32_t channel, uint32_t channelCount) const
+{
+    size_t frame = (size_t)(mPosition >> 32);
+    size_t next = (frame + 1 < mFrames) ? frame + 1 : 0;
+    int32_t fraction = (int32_t)((mPosition >> 17) & 0x7fff);   // 15 bit interpolation
+    int32_t s0;
+    int32_t s1;
+
+    if (channelCount == 1 && mChannelCount > 1) {
+        // downmix all source channels
+        s0 = 0;
+        s1 = 0;
+        for (uint32_t i = 0; i < mChannelCount; i++) {
+            s0 += sampleAt(frame, i);
+            s1 += sampleAt(next, i);
+        }
+        s0 /= (int32_t)mChannelCount;
+        s1 /= (int32_t)mChannelCount;
+    } else {
+        // extra output channels repeat the last source channel
+        uint32_t srcChannel = (channel < mChannelCount) ? channel : mChannelCount - 1;
+        s0 = sampleAt(frame, srcChannel);
+        s1 = sampleAt(next, srcChannel);
+    }
+    return s0 + (((s1 - s0) * fraction) >> 15);
+}
+
+void AudioDumpWavSource::read(void *buffer, size_t frames, uint32_t sampleRate, int format,
+                              uint32_t channelCount)
+{
+    if (!isOpen() || sampleRate == 0) {
+        memset(buffer, 0, frames * channelCount *
+                (format == AudioSystem::PCM_16_BIT ? sizeof(int16_t) : sizeof(uint8_t)));
+        return;
+    }
+    uint64_t step = ((uint64_t)mSampleRate << 32) / sampleRate;
+    uint64_t end = (uint64_t)mFrames << 32;
+    int16_t *dst16 = (int16_t *)buffer;
+    uint8_t *dst8 = (uint8_t *)buffer;
+
+    for (size_t i = 0; i < frames; i++) {
+        for (uint32_t c = 0; c < channelCount; c++) {
+            int32_t sample = convertedSample(c, channelCount);
+            if (format == AudioSystem::PCM_16_BIT) {
+                *dst16++ = (int16_t)sample;
+            } else {
+                *dst8++ = (uint8_t)((sample >> 8) + 128);
+            }
+        }
+        mPosition += step;
+        if (mPosition >= end) {
+            mPosition -= end;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
 AudioDumpInterface::AudioDumpInterface(AudioHardwareInterface* hw)
     : mPolicyCommands(String8("")), mFileName(String8(""))
 {
@@ -38,6 +394,8 @@ AudioDumpInterface::AudioDumpInterface(AudioHardwareInterface* hw)
         ALOGE("Dump construct hw = 0");
     }
     mFinalInterface = hw;
+    mWriter = new AudioDumpWriter();
+    mWriter->run("AudioDumpWriter", ANDROID_PRIORITY_BACKGROUND);
     ALOGV("Constructor %p, mFinalInterface %p", this, mFinalInterface);
 }
 
@@ -52,6 +410,9 @@ AudioDumpInterface::~AudioDumpInterface()
         closeInputStream((AudioStreamIn *)mInputs[i]);
     }
 
+    // flushes and closes the dump files of all streams
+    mWriter->exit();
+
     if(mFinalInterface) delete mFinalInterface;
 }
 
@@ -197,6 +558,24 @@ status_t AudioDumpInterface::setParameters(const String8& keyValuePairs)
         mFileName = value;
         param.remove(String8("test_cmd_file_name"));
     }
+    // applies to input streams leaving standby after the change
+    if (param.get(String8("test_cmd_input_file_name"), value) == NO_ERROR) {
+        mInputFileName = value;
+        param.remove(String8("test_cmd_input_file_name"));
+    }
+    // apply to files opened after the change
+    if (param.getInt(String8("test_cmd_dump_ring_size"), valueInt) == NO_ERROR) {
+        if (valueInt > 0) {
+            mWriter->setRingSize(valueInt);
+        }
+        param.remove(String8("test_cmd_dump_ring_size"));
+    }
+    if (param.getInt(String8("test_cmd_dump_flush_size"), valueInt) == NO_ERROR) {
+        if (valueInt > 0) {
+            mWriter->setFlushSize(valueInt);
+        }
+        param.remove(String8("test_cmd_dump_flush_size"));
+    }
     if (param.get(String8("test_cmd_policy"), value) == NO_ERROR) {
         Mutex::Autolock _l(mLock);
         param.remove(String8("test_cmd_policy"));
@@ -233,6 +612,17 @@ String8 AudioDumpInterface::getParameters(const String8& keys)
         param.remove(String8("test_cmd_file_name"));
     }
 
+    if (param.get(String8("test_cmd_input_file_name"), value) == NO_ERROR) {
+        response.add(String8("test_cmd_input_file_name"), mInputFileName);
+        param.remove(String8("test_cmd_input_file_name"));
+    }
+
+    // bytes dropped by closed dump files because the writer could not keep up
+    if (param.get(String8("test_cmd_dump_dropped"), value) == NO_ERROR) {
+        response.addInt(String8("test_cmd_dump_dropped"), (int)mWriter->droppedBytes());
+        param.remove(String8("test_cmd_dump_dropped"));
+    }
+
     String8 keyValuePairs = response.toString();
 
     if (param.size() && mFinalInterface != 0 ) {
@@ -264,7 +654,7 @@ AudioStreamOutDump::AudioStreamOutDump(AudioDumpInterface *interface,
                                         uint32_t sampleRate)
     : mInterface(interface), mId(id),
       mSampleRate(sampleRate), mFormat(format), mChannels(channels), mLatency(0), mDevice(devices),
-      mBufferSize(1024), mFinalStream(finalStream), mFile(0), mFileCount(0)
+      mBufferSize(1024), mFinalStream(finalStream), mChannel(NULL), mFileCount(0)
 {
     ALOGV("AudioStreamOutDump Constructor %p, mInterface %p, mFinalStream %p", this, mInterface, mFinalStream);
 }
@@ -283,28 +673,29 @@ ssize_t AudioStreamOutDump::write(const void* buffer, size_t bytes)
     if (mFinalStream) {
         ret = mFinalStream->write(buffer, bytes);
     } else {
-        usleep((((bytes * 1000) / frameSize()) / sampleRate()) * 1000);
+        mPacer.wait(bytes / frameSize(), sampleRate());
         ret = bytes;
     }
-    if(!mFile) {
+    if (mChannel == NULL) {
         if (mInterface->fileName() != "") {
             char name[255];
             sprintf(name, "%s_out_%d_%d.pcm", mInterface->fileName().string(), mId, ++mFileCount);
-            mFile = fopen(name, "wb");
-            ALOGV("Opening dump file %s, fh %p", name, mFile);
+            mChannel = mInterface->writer()->openChannel(String8(name));
+            ALOGV("Opening dump file %s", name);
         }
     }
-    if (mFile) {
-        fwrite(buffer, bytes, 1, mFile);
+    if (mChannel != NULL) {
+        mInterface->writer()->write(mChannel, buffer, bytes);
     }
     return ret;
 }
 
 status_t AudioStreamOutDump::standby()
 {
-    ALOGV("AudioStreamOutDump standby(), mFile %p, mFinalStream %p", mFile, mFinalStream);
+    ALOGV("AudioStreamOutDump standby(), mChannel %p, mFinalStream %p", mChannel, mFinalStream);
 
     Close();
+    mPacer.standby();
     if (mFinalStream != 0 ) return mFinalStream->standby();
     return NO_ERROR;
 }
@@ -359,7 +750,7 @@ status_t AudioStreamOutDump::setParameters(const String8& keyValuePairs)
     }
 
     if (param.getInt(String8("format"), valueInt) == NO_ERROR) {
-        if (mFile == 0) {
+        if (mChannel == NULL) {
             mFormat = valueInt;
         } else {
             status = INVALID_OPERATION;
@@ -374,7 +765,7 @@ status_t AudioStreamOutDump::setParameters(const String8& keyValuePairs)
     }
     if (param.getInt(String8("sampling_rate"), valueInt) == NO_ERROR) {
         if (valueInt > 0 && valueInt <= 48000) {
-            if (mFile == 0) {
+            if (mChannel == NULL) {
                 mSampleRate = valueInt;
             } else {
                 status = INVALID_OPERATION;
@@ -402,16 +793,29 @@ status_t AudioStreamOutDump::dump(int fd, const Vector<String16>& args)
 
 void AudioStreamOutDump::Close()
 {
-    if(mFile) {
-        fclose(mFile);
-        mFile = 0;
+    if (mChannel != NULL) {
+        mInterface->writer()->closeChannel(mChannel);
+        mChannel = NULL;
     }
 }
 
 status_t AudioStreamOutDump::getRenderPosition(uint32_t *dspFrames)
 {
     if (mFinalStream != 0 ) return mFinalStream->getRenderPosition(dspFrames);
-    return INVALID_OPERATION;
+    *dspFrames = (uint32_t)mPacer.framesSinceStandby();
+    return NO_ERROR;
+}
+
+status_t AudioStreamOutDump::getNextWriteTimestamp(int64_t *timestamp)
+{
+    if (mFinalStream != 0 ) return mFinalStream->getNextWriteTimestamp(timestamp);
+    return mPacer.getNextWriteTimestamp(timestamp);
+}
+
+status_t AudioStreamOutDump::getPresentationPosition(uint64_t *frames, struct timespec *timestamp)
+{
+    if (mFinalStream != 0 ) return mFinalStream->getPresentationPosition(frames, timestamp);
+    return mPacer.getPresentationPosition(frames, timestamp);
 }
 
 // ----------------------------------------------------------------------------
@@ -425,7 +829,7 @@ AudioStreamInDump::AudioStreamInDump(AudioDumpInterface *interface,
                                         uint32_t sampleRate)
     : mInterface(interface), mId(id),
       mSampleRate(sampleRate), mFormat(format), mChannels(channels), mDevice(devices),
-      mBufferSize(1024), mFinalStream(finalStream), mFile(0), mFileCount(0)
+      mBufferSize(1024), mFinalStream(finalStream), mChannel(NULL), mFileCount(0)
 {
     ALOGV("AudioStreamInDump Constructor %p, mInterface %p, mFinalStream %p", this, mInterface, mFinalStream);
 }
@@ -442,56 +846,48 @@ ssize_t AudioStreamInDump::read(void* buffer, ssize_t bytes)
 
     if (mFinalStream) {
         ret = mFinalStream->read(buffer, bytes);
-        if(!mFile) {
+        if (mChannel == NULL) {
             if (mInterface->fileName() != "") {
                 char name[255];
                 sprintf(name, "%s_in_%d_%d.pcm", mInterface->fileName().string(), mId, ++mFileCount);
-                mFile = fopen(name, "wb");
-                ALOGV("Opening input dump file %s, fh %p", name, mFile);
+                mChannel = mInterface->writer()->openChannel(String8(name));
+                ALOGV("Opening input dump file %s", name);
             }
         }
-        if (mFile) {
-            fwrite(buffer, bytes, 1, mFile);
+        if (mChannel != NULL && ret > 0) {
+            mInterface->writer()->write(mChannel, buffer, ret);
         }
     } else {
-        usleep((((bytes * 1000) / frameSize()) / sampleRate()) * 1000);
-        ret = bytes;
-        if(!mFile) {
-            char name[255];
-            strcpy(name, "/sdcard/music/sine440");
-            if (channels() == AudioSystem::CHANNEL_IN_MONO) {
-                strcat(name, "_mo");
-            } else {
-                strcat(name, "_st");
-            }
-            if (format() == AudioSystem::PCM_16_BIT) {
-                strcat(name, "_16b");
-            } else {
-                strcat(name, "_8b");
+        size_t frames = bytes / frameSize();
+        ret = frames * frameSize();
+        if (!mSource.isOpen()) {
+            String8 name = mInterface->inputFileName();
+            if (name == "") {
+                name = "/sdcard/music/sine440";
+                name += (channels() == AudioSystem::CHANNEL_IN_MONO) ? "_mo" : "_st";
+                name += (format() == AudioSystem::PCM_16_BIT) ? "_16b" : "_8b";
+                if (sampleRate() < 16000) {
+                    name += "_8k";
+                } else if (sampleRate() < 32000) {
+                    name += "_22k";
+                } else if (sampleRate() < 48000) {
+                    name += "_44k";
+                } else {
+                    name += "_48k";
+                }
+                name += ".wav";
             }
-            if (sampleRate() < 16000) {
-                strcat(name, "_8k");
-            } else if (sampleRate() < 32000) {
-                strcat(name, "_22k");
-            } else if (sampleRate() < 48000) {
-                strcat(name, "_44k");
-            } else {
-                strcat(name, "_48k");
-            }
-            strcat(name, ".wav");
-            mFile = fopen(name, "rb");
-            ALOGV("Opening input read file %s, fh %p", name, mFile);
-            if (mFile) {
-                fseek(mFile, AUDIO_DUMP_WAVE_HDR_SIZE, SEEK_SET);
-            }
-        }
-        if (mFile) {
-            ssize_t bytesRead = fread(buffer, bytes, 1, mFile);
-            if (bytesRead >=0 && bytesRead < bytes) {
-                fseek(mFile, AUDIO_DUMP_WAVE_HDR_SIZE, SEEK_SET);
-                fread((uint8_t *)buffer+bytesRead, bytes-bytesRead, 1, mFile);
+            // a file that cannot be read is not opened again on each read: silence is returned
+            // until standby or until test_cmd_input_file_name changes
+            if (name != mFailedSourceName) {
+                status_t status = mSource.open(name.string());
+                ALOGV("Opening input read file %s, status %d", name.string(), status);
+                mFailedSourceName = (status == NO_ERROR) ? String8("") : name;
             }
         }
+        mSource.read(buffer, frames, sampleRate(), format(),
+                     AudioSystem::popCount(channels()));
+        mPacer.wait(frames, sampleRate());
     }
 
     return ret;
@@ -499,7 +895,7 @@ ssize_t AudioStreamInDump::read(void* buffer, ssize_t bytes)
 
 status_t AudioStreamInDump::standby()
 {
-    ALOGV("AudioStreamInDump standby(), mFile %p, mFinalStream %p", mFile, mFinalStream);
+    ALOGV("AudioStreamInDump standby(), mChannel %p, mFinalStream %p", mChannel, mFinalStream);
 
     Close();
     if (mFinalStream != 0 ) return mFinalStream->standby();
@@ -565,9 +961,12 @@ status_t AudioStreamInDump::dump(int fd, const Vector<String16>& args)
 
 void AudioStreamInDump::Close()
 {
-    if(mFile) {
-        fclose(mFile);
-        mFile = 0;
+    mSource.close();
+    mFailedSourceName = "";
+    mPacer.standby();
+    if (mChannel != NULL) {
+        mInterface->writer()->closeChannel(mChannel);
+        mChannel = NULL;
     }
 }
 }; // namespace android
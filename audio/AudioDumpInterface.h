@@ -22,6 +22,8 @@
 #include <sys/types.h>
 #include <utils/String8.h>
 #include <utils/SortedVector.h>
+#include <utils/Vector.h>
+#include <utils/threads.h>
 
 #include <hardware_legacy/AudioHardwareBase.h>
 
@@ -29,8 +31,111 @@ namespace android {
 
 #define AUDIO_DUMP_WAVE_HDR_SIZE 44
 
+// default size of the ring buffer of each dumped stream and minimum amount of data written to
+// the dump file at once. Can be changed with test_cmd_dump_ring_size and test_cmd_dump_flush_size
+#define AUDIO_DUMP_RING_SIZE (256 * 1024)
+#define AUDIO_DUMP_FLUSH_SIZE (16 * 1024)
+
 class AudioDumpInterface;
 
+// single producer (audio thread), single consumer (dump writer thread) lock free byte ring
+class AudioDumpRing {
+public:
+                        AudioDumpRing(size_t capacity);
+                        ~AudioDumpRing();
+
+    // producer side: copies all bytes or none. Returns false if there is not enough room
+    bool                push(const void *buffer, size_t bytes);
+    // consumer side: returns the number of contiguous bytes readable at *data
+    size_t              peek(const uint8_t **data);
+    void                consume(size_t bytes);
+    // number of bytes queued
+    size_t              available() const;
+
+private:
+    uint8_t             *mBuffer;
+    size_t              mCapacity;  // power of 2
+    volatile int32_t    mFront;     // read position, written by the consumer
+    volatile int32_t    mRear;      // write position, written by the producer
+};
+
+// writes the PCM dumped by all streams of an AudioDumpInterface to files, so that audio threads
+// never block on file I/O. Data that does not fit in a stream ring is dropped and counted.
+class AudioDumpWriter : public Thread {
+public:
+    // data dumped by one stream to one file between two standby() calls
+    class Channel {
+    public:
+                        Channel(const String8& fileName, size_t ringSize);
+
+        String8         mFileName;
+        FILE            *mFile;             // opened by the writer thread
+        AudioDumpRing   mRing;
+        uint32_t        mDroppedBytes;      // written by the producer only
+        bool            mClosing;           // set with the writer lock held
+    };
+
+                        AudioDumpWriter();
+    virtual             ~AudioDumpWriter();
+
+    // called by streams: openChannel() and closeChannel() lock, write() does not
+    Channel             *openChannel(const String8& fileName);
+    void                write(Channel *channel, const void *buffer, size_t bytes);
+    // the channel must not be used by the caller after this call
+    void                closeChannel(Channel *channel);
+
+    void                setRingSize(size_t size);
+    void                setFlushSize(size_t size);
+    uint32_t            droppedBytes() const { return mDroppedBytes; }
+
+    void                exit();
+
+private:
+    virtual bool        threadLoop();
+    // writes queued data of a channel to its file. Called without mLock held.
+    void                drain(Channel *channel, bool all);
+
+    static const uint32_t WRITER_PERIOD_MS = 100; // max delay before flushing full rings
+
+    Mutex               mLock;
+    Condition           mWaitWorkCV;
+    Vector<Channel *>   mChannels;
+    size_t              mRingSize;
+    volatile int32_t    mFlushSize;
+    uint32_t            mDroppedBytes;      // dropped by closed channels
+};
+
+// PCM read in a loop from a WAV file mapped in memory, converted to the sampling rate, format
+// and channel count requested by the input stream it feeds
+class AudioDumpWavSource {
+public:
+                        AudioDumpWavSource();
+                        ~AudioDumpWavSource();
+
+    status_t            open(const char *path);
+    void                close();
+    bool                isOpen() const { return mMap != NULL; }
+
+    // fills buffer with frames of the specified configuration
+    void                read(void *buffer, size_t frames, uint32_t sampleRate, int format,
+                             uint32_t channelCount);
+
+private:
+    // returns the sample of a channel of a source frame as signed 16 bit
+    int32_t             sampleAt(size_t frame, uint32_t channel) const;
+    // returns one output channel of the source at mPosition, resampled and channel converted
+    int32_t             convertedSample(uint32_t channel, uint32_t channelCount) const;
+
+    void                *mMap;
+    size_t              mMapSize;
+    const uint8_t       *mData;             // first sample of the data chunk
+    size_t              mFrames;            // number of frames in the data chunk
+    uint32_t            mSampleRate;
+    uint32_t            mChannelCount;
+    uint32_t            mBytesPerSample;    // 1 (unsigned 8 bit) or 2 (signed 16 bit)
+    uint64_t            mPosition;          // read position in frames, 32.32 fixed point
+};
+
 class AudioStreamOutDump : public AudioStreamOut {
 public:
                         AudioStreamOutDump(AudioDumpInterface *interface,
@@ -58,6 +163,8 @@ public:
     uint32_t            device() { return mDevice; }
     int                 getId()  { return mId; }
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
+    virtual status_t    getNextWriteTimestamp(int64_t *timestamp);
+    virtual status_t    getPresentationPosition(uint64_t *frames, struct timespec *timestamp);
 
 private:
     AudioDumpInterface *mInterface;
@@ -69,7 +176,8 @@ private:
     uint32_t mDevice;                   // current device this output is routed to
     size_t  mBufferSize;
     AudioStreamOut      *mFinalStream;
-    FILE                *mFile;      // output file
+    AudioStreamPacer    mPacer;      // write timing when there is no final stream
+    AudioDumpWriter::Channel *mChannel; // output dump, NULL if not dumping
     int                 mFileCount;
 };
 
@@ -109,7 +217,10 @@ private:
     uint32_t mDevice;                   // current device this output is routed to
     size_t  mBufferSize;
     AudioStreamIn      *mFinalStream;
-    FILE                *mFile;      // output file
+    AudioDumpWavSource  mSource;     // input file read when there is no final stream
+    String8             mFailedSourceName; // input file that could not be opened since standby
+    AudioStreamPacer    mPacer;      // read timing when there is no final stream
+    AudioDumpWriter::Channel *mChannel; // input dump, NULL if not dumping
     int                 mFileCount;
 };
 
@@ -155,6 +266,9 @@ public:
     virtual status_t    dump(int fd, const Vector<String16>& args) { return mFinalInterface->dumpState(fd, args); }
 
             String8     fileName() const { return mFileName; }
+            // WAV file read by input streams without final stream, empty for the default file
+            String8     inputFileName() const { return mInputFileName; }
+            AudioDumpWriter *writer() const { return mWriter.get(); }
 protected:
 
     AudioHardwareInterface          *mFinalInterface;
@@ -163,6 +277,8 @@ protected:
     Mutex                           mLock;
     String8                         mPolicyCommands;
     String8                         mFileName;
+    String8                         mInputFileName;
+    sp<AudioDumpWriter>             mWriter;
 };
 
 }; // namespace android
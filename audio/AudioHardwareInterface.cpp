@@ -16,7 +16,9 @@
 */
 
 #include <cutils/properties.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 //#define LOG_NDEBUG 0
 
@@ -78,6 +80,103 @@ status_t AudioStreamOut::getNextWriteTimestamp(int64_t *timestamp)
 
 AudioStreamIn::~AudioStreamIn() {}
 
+// ----------------------------------------------------------------------------
+
+AudioStreamPacer::AudioStreamPacer()
+    : mStartTime(0), mSampleRate(0), mScheduledFrames(0), mFramesSinceStandby(0), mTotalFrames(0)
+{
+}
+
+int64_t AudioStreamPacer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int64_t AudioStreamPacer::dueTime() const
+{
+    return mStartTime + (int64_t)((mScheduledFrames * 1000000000ULL) / mSampleRate);
+}
+
+void AudioStreamPacer::wait(size_t frames, uint32_t sampleRate)
+{
+    if (sampleRate == 0) {
+        return;
+    }
+    int64_t due;
+    {
+        android::Mutex::Autolock _l(mLock);
+        int64_t currentTime = now();
+        if (mStartTime == 0 || sampleRate != mSampleRate ||
+                currentTime - dueTime() > MAX_LATENESS_NS) {
+            mStartTime = currentTime;
+            mSampleRate = sampleRate;
+            mScheduledFrames = 0;
+        }
+        mScheduledFrames += frames;
+        mFramesSinceStandby += frames;
+        mTotalFrames += frames;
+        due = dueTime();
+    }
+
+    struct timespec ts;
+    ts.tv_sec = due / 1000000000LL;
+    ts.tv_nsec = due % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+void AudioStreamPacer::standby()
+{
+    android::Mutex::Autolock _l(mLock);
+    mStartTime = 0;
+    mFramesSinceStandby = 0;
+}
+
+uint64_t AudioStreamPacer::framesSinceStandby() const
+{
+    android::Mutex::Autolock _l(mLock);
+    return mFramesSinceStandby;
+}
+
+uint64_t AudioStreamPacer::framesTransferred() const
+{
+    android::Mutex::Autolock _l(mLock);
+    return mTotalFrames;
+}
+
+status_t AudioStreamPacer::getPresentationPosition(uint64_t *frames,
+                                                   struct timespec *timestamp) const
+{
+    android::Mutex::Autolock _l(mLock);
+    if (mStartTime == 0) {
+        return INVALID_OPERATION;
+    }
+    int64_t currentTime = now();
+    uint64_t elapsedFrames = 0;
+    if (currentTime > mStartTime) {
+        elapsedFrames = ((uint64_t)(currentTime - mStartTime) * mSampleRate) / 1000000000ULL;
+    }
+    if (elapsedFrames > mScheduledFrames) {
+        elapsedFrames = mScheduledFrames;
+    }
+    *frames = mTotalFrames - (mScheduledFrames - elapsedFrames);
+    timestamp->tv_sec = currentTime / 1000000000LL;
+    timestamp->tv_nsec = currentTime % 1000000000LL;
+    return NO_ERROR;
+}
+
+status_t AudioStreamPacer::getNextWriteTimestamp(int64_t *timestamp) const
+{
+    android::Mutex::Autolock _l(mLock);
+    if (mStartTime == 0) {
+        return INVALID_OPERATION;
+    }
+    *timestamp = dueTime() / 1000;
+    return NO_ERROR;
+}
+
 AudioHardwareBase::AudioHardwareBase()
 {
     mMode = 0;
@@ -128,13 +128,13 @@ status_t AudioStreamOutStub::set(int *pFormat, uint32_t *pChannels, uint32_t *pR
 ssize_t AudioStreamOutStub::write(const void* buffer, size_t bytes)
 {
     // fake timing for audio output
-    usleep(bytes * 1000000 / sizeof(int16_t) /
-               audio_channel_count_from_out_mask(channels()) / sampleRate());
+    mPacer.wait(bytes / frameSize(), sampleRate());
     return bytes;
 }
 
 status_t AudioStreamOutStub::standby()
 {
+    mPacer.standby();
     return NO_ERROR;
 }
 
@@ -161,7 +161,18 @@ String8 AudioStreamOutStub::getParameters(const String8& keys)
 
 status_t AudioStreamOutStub::getRenderPosition(uint32_t *dspFrames)
 {
-    return INVALID_OPERATION;
+    *dspFrames = (uint32_t)mPacer.framesSinceStandby();
+    return NO_ERROR;
+}
+
+status_t AudioStreamOutStub::getNextWriteTimestamp(int64_t *timestamp)
+{
+    return mPacer.getNextWriteTimestamp(timestamp);
+}
+
+status_t AudioStreamOutStub::getPresentationPosition(uint64_t *frames, struct timespec *timestamp)
+{
+    return mPacer.getPresentationPosition(frames, timestamp);
 }
 
 // ----------------------------------------------------------------------------
@@ -175,8 +186,7 @@ status_t AudioStreamInStub::set(int *pFormat, uint32_t *pChannels, uint32_t *pRa
 ssize_t AudioStreamInStub::read(void* buffer, ssize_t bytes)
 {
     // fake timing for audio input
-    usleep(bytes * 1000000 / sizeof(int16_t) /
-           audio_channel_count_from_in_mask(channels()) / sampleRate());
+    mPacer.wait(bytes / frameSize(), sampleRate());
     memset(buffer, 0, bytes);
     return bytes;
 }
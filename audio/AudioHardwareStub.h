@@ -42,6 +42,11 @@ public:
     virtual status_t    setParameters(const String8& keyValuePairs) { return NO_ERROR;}
     virtual String8     getParameters(const String8& keys);
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
+    virtual status_t    getNextWriteTimestamp(int64_t *timestamp);
+    virtual status_t    getPresentationPosition(uint64_t *frames, struct timespec *timestamp);
+
+private:
+    AudioStreamPacer    mPacer;
 };
 
 class AudioStreamInStub : public AudioStreamIn {
@@ -54,12 +59,15 @@ public:
     virtual status_t    setGain(float gain) { return NO_ERROR; }
     virtual ssize_t     read(void* buffer, ssize_t bytes);
     virtual status_t    dump(int fd, const Vector<String16>& args);
-    virtual status_t    standby() { return NO_ERROR; }
+    virtual status_t    standby() { mPacer.standby(); return NO_ERROR; }
     virtual status_t    setParameters(const String8& keyValuePairs) { return NO_ERROR;}
     virtual String8     getParameters(const String8& keys);
     virtual unsigned int  getInputFramesLost() const { return 0; }
     virtual status_t addAudioEffect(effect_handle_t effect) { return NO_ERROR; }
     virtual status_t removeAudioEffect(effect_handle_t effect) { return NO_ERROR; }
+
+private:
+    AudioStreamPacer    mPacer;
 };
 
 class AudioHardwareStub : public  AudioHardwareBase
@@ -18,6 +18,8 @@
 //#define LOG_NDEBUG 0
 
 #include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
@@ -32,6 +34,7 @@ namespace android_audio_legacy {
 
 audio_module_handle_t AudioPolicyCompatClient::loadHwModule(const char *moduleName)
 {
+    flushCommands();
     return mServiceOps->load_hw_module(mService, moduleName);
 }
 
@@ -44,6 +47,7 @@ audio_io_handle_t AudioPolicyCompatClient::openOutput(audio_module_handle_t modu
                                                       audio_output_flags_t flags,
                                                       const audio_offload_info_t *offloadInfo)
 {
+    flushCommands();
     return mServiceOps->open_output_on_module(mService, module, pDevices, pSamplingRate,
                                               pFormat, pChannelMask, pLatencyMs,
                                               flags, offloadInfo);
@@ -52,21 +56,25 @@ audio_io_handle_t AudioPolicyCompatClient::openOutput(audio_module_handle_t modu
 audio_io_handle_t AudioPolicyCompatClient::openDuplicateOutput(audio_io_handle_t output1,
                                                           audio_io_handle_t output2)
 {
+    flushCommands();
     return mServiceOps->open_duplicate_output(mService, output1, output2);
 }
 
 status_t AudioPolicyCompatClient::closeOutput(audio_io_handle_t output)
 {
+    flushCommands();
     return mServiceOps->close_output(mService, output);
 }
 
 status_t AudioPolicyCompatClient::suspendOutput(audio_io_handle_t output)
 {
+    flushCommands();
     return mServiceOps->suspend_output(mService, output);
 }
 
 status_t AudioPolicyCompatClient::restoreOutput(audio_io_handle_t output)
 {
+    flushCommands();
     return mServiceOps->restore_output(mService, output);
 }
 
@@ -76,23 +84,27 @@ audio_io_handle_t AudioPolicyCompatClient::openInput(audio_module_handle_t modul
                                                      audio_format_t *pFormat,
                                                      audio_channel_mask_t *pChannelMask)
 {
+    flushCommands();
     return mServiceOps->open_input_on_module(mService, module, pDevices,
                                              pSamplingRate, pFormat, pChannelMask);
 }
 
 status_t AudioPolicyCompatClient::closeInput(audio_io_handle_t input)
 {
+    flushCommands();
     return mServiceOps->close_input(mService, input);
 }
 
 status_t AudioPolicyCompatClient::invalidateStream(AudioSystem::stream_type stream)
 {
+    flushCommands();
     return mServiceOps->invalidate_stream(mService, (audio_stream_type_t)stream);
 }
 
 status_t AudioPolicyCompatClient::moveEffects(audio_session_t session, audio_io_handle_t srcOutput,
                                                audio_io_handle_t dstOutput)
 {
+    flushCommands();
     return mServiceOps->move_effects(mService, session, srcOutput, dstOutput);
 }
 
@@ -101,6 +113,7 @@ String8 AudioPolicyCompatClient::getParameters(audio_io_handle_t ioHandle, const
     char *str;
     String8 out_str8;
 
+    flushCommands();
     str = mServiceOps->get_parameters(mService, ioHandle, keys.string());
     out_str8 = String8(str);
     free(str);
@@ -112,6 +125,18 @@ void AudioPolicyCompatClient::setParameters(audio_io_handle_t ioHandle,
                                             const String8& keyValuePairs,
                                             int delayMs)
 {
+    {
+        Mutex::Autolock _l(mLock);
+        if (mBatchDepth != 0 && pthread_equal(mBatchThread, pthread_self())) {
+            PendingCommand command;
+            command.mIoHandle = ioHandle;
+            command.mDelayMs = delayMs;
+            command.mKeys = parameterKeys(keyValuePairs);
+            command.mKeyValuePairs = keyValuePairs;
+            queueCommand_l(command);
+            return;
+        }
+    }
     mServiceOps->set_parameters(mService, ioHandle, keyValuePairs.string(),
                            delayMs);
 }
@@ -122,6 +147,9 @@ status_t AudioPolicyCompatClient::setStreamVolume(
                                              audio_io_handle_t output,
                                              int delayMs)
 {
+    // volume commands are not queued: they often mute a stream before a routing change and
+    // the service command thread already drops superseded volume commands
+    flushCommands();
     return mServiceOps->set_stream_volume(mService, (audio_stream_type_t)stream,
                                           volume, output, delayMs);
 }
@@ -129,6 +157,7 @@ status_t AudioPolicyCompatClient::setStreamVolume(
 status_t AudioPolicyCompatClient::startTone(ToneGenerator::tone_type tone,
                                        AudioSystem::stream_type stream)
 {
+    flushCommands();
     return mServiceOps->start_tone(mService,
                                    AUDIO_POLICY_TONE_IN_CALL_NOTIFICATION,
                                    (audio_stream_type_t)stream);
@@ -136,12 +165,120 @@ status_t AudioPolicyCompatClient::startTone(ToneGenerator::tone_type tone,
 
 status_t AudioPolicyCompatClient::stopTone()
 {
+    flushCommands();
     return mServiceOps->stop_tone(mService);
 }
 
 status_t AudioPolicyCompatClient::setVoiceVolume(float volume, int delayMs)
 {
+    flushCommands();
     return mServiceOps->set_voice_volume(mService, volume, delayMs);
 }
 
+void AudioPolicyCompatClient::beginCommandBatch()
+{
+    Mutex::Autolock _l(mLock);
+    if (mBatchDepth++ == 0) {
+        mBatchThread = pthread_self();
+    }
+}
+
+void AudioPolicyCompatClient::endCommandBatch()
+{
+    {
+        Mutex::Autolock _l(mLock);
+        if (mBatchDepth == 0) {
+            ALOGW("endCommandBatch() no batch open");
+            return;
+        }
+        if (--mBatchDepth != 0) {
+            return;
+        }
+    }
+    flushCommands();
+}
+
+void AudioPolicyCompatClient::queueCommand_l(const PendingCommand& command)
+{
+    mQueuedCommands++;
+    // a command only supersedes a pending command with the same delay: commands with different
+    // delays implement mute and unmute sequences that must be preserved.
+    // The new command takes the place of the superseded one so that its order relative to
+    // the other pending commands is kept.
+    for (size_t i = 0; i < mPendingCommands.size(); i++) {
+        const PendingCommand& pending = mPendingCommands[i];
+        if (pending.mIoHandle == command.mIoHandle &&
+                pending.mDelayMs == command.mDelayMs &&
+                pending.mKeys == command.mKeys) {
+            ALOGV("queueCommand() io %d keys %s superseded",
+                  command.mIoHandle, command.mKeys.string());
+            mPendingCommands.editItemAt(i) = command;
+            mMergedCommands++;
+            return;
+        }
+    }
+    mPendingCommands.add(command);
+}
+
+void AudioPolicyCompatClient::flushCommands()
+{
+    Vector<PendingCommand> commands;
+    {
+        Mutex::Autolock _l(mLock);
+        // only the thread that queued the commands sends them, so that they are sent in order
+        // and before its own next command
+        if (mPendingCommands.isEmpty() || !pthread_equal(mBatchThread, pthread_self())) {
+            return;
+        }
+        ALOGV("flushCommands() %zu commands", mPendingCommands.size());
+        commands = mPendingCommands;
+        mPendingCommands.clear();
+        mFlushedBatches++;
+    }
+    // commands are removed from the queue and sent without mLock held
+    for (size_t i = 0; i < commands.size(); i++) {
+        const PendingCommand& command = commands[i];
+        mServiceOps->set_parameters(mService, command.mIoHandle,
+                                    command.mKeyValuePairs.string(), command.mDelayMs);
+    }
+}
+
+String8 AudioPolicyCompatClient::parameterKeys(const String8& keyValuePairs)
+{
+    String8 keys;
+    const char *pair = keyValuePairs.string();
+    while (*pair != '\0') {
+        const char *end = strchr(pair, ';');
+        size_t len = (end != NULL) ? (size_t)(end - pair) : strlen(pair);
+        const char *equal = (const char *)memchr(pair, '=', len);
+        size_t keyLen = (equal != NULL) ? (size_t)(equal - pair) : len;
+        if (keyLen != 0) {
+            if (!keys.isEmpty()) {
+                keys.append(";");
+            }
+            keys.append(pair, keyLen);
+        }
+        if (end == NULL) {
+            break;
+        }
+        pair = end + 1;
+    }
+    return keys;
+}
+
+status_t AudioPolicyCompatClient::dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+
+    snprintf(buffer, SIZE, "\nAudioPolicyCompatClient Dump: %p\n", this);
+    write(fd, buffer, strlen(buffer));
+    mLock.lock();
+    snprintf(buffer, SIZE, " Commands queued: %u, merged: %u, batches flushed: %u\n",
+             mQueuedCommands, mMergedCommands, mFlushedBatches);
+    mLock.unlock();
+    write(fd, buffer, strlen(buffer));
+    return NO_ERROR;
+}
+
 }; // namespace android_audio_legacy
@@ -21,6 +21,12 @@
 #include <system/audio_policy.h>
 #include <hardware/audio_policy.h>
 
+#include <pthread.h>
+
+#include <utils/String8.h>
+#include <utils/Vector.h>
+#include <utils/threads.h>
+
 #include <hardware_legacy/AudioSystemLegacy.h>
 #include <hardware_legacy/AudioPolicyInterface.h>
 
@@ -28,12 +34,14 @@
 /* FOR BACKWARDS COMPATIBILITY ONLY */
 /************************************/
 namespace android_audio_legacy {
+    using android::Mutex;
 
 class AudioPolicyCompatClient : public AudioPolicyClientInterface {
 public:
     AudioPolicyCompatClient(struct audio_policy_service_ops *serviceOps,
                             void *service) :
-            mServiceOps(serviceOps) , mService(service) {}
+            mServiceOps(serviceOps) , mService(service), mBatchDepth(0), mBatchThread(),
+            mQueuedCommands(0), mMergedCommands(0), mFlushedBatches(0) {}
 
     virtual audio_module_handle_t loadHwModule(const char *moduleName);
 
@@ -73,9 +81,46 @@ public:
     virtual status_t stopTone();
     virtual status_t setVoiceVolume(float volume, int delayMs = 0);
 
+    // While a command batch is open, setParameters() commands are queued. A queued command
+    // replaces, in place, a pending command with the same delay, I/O handle and parameter keys.
+    // The queue is flushed in order when the outermost batch is closed, when the policy manager
+    // calls flushCommands() before waiting for a command to take effect, or before any other
+    // call to the service.
+    // Batches are opened by the thread handling a policy call, one at a time as policy calls
+    // are serialized by the service. Only that thread queues and flushes commands: calls from
+    // other threads, e.g. volume commands from the volume ramp thread of the policy manager,
+    // go straight to the service. mLock is never held while calling the service.
+    void beginCommandBatch();
+    void endCommandBatch();
+    virtual void flushCommands();
+
+    status_t dump(int fd);
+
 private:
+    class PendingCommand {
+    public:
+        audio_io_handle_t mIoHandle;
+        int mDelayMs;
+        String8 mKeys;              // keys in mKeyValuePairs
+        String8 mKeyValuePairs;
+    };
+
+    // add a command to the queue or replace the pending command it supersedes. Called with
+    // mLock held
+    void queueCommand_l(const PendingCommand& command);
+    // returns the keys of a key value pair list "k1=v1;k2=v2" as "k1;k2"
+    static String8 parameterKeys(const String8& keyValuePairs);
+
     struct audio_policy_service_ops* mServiceOps;
     void*                            mService;
+
+    Mutex mLock;                            // protects the command queue and batch state
+    uint32_t mBatchDepth;                   // nesting level of open command batches
+    pthread_t mBatchThread;                 // thread that opened the outermost batch
+    Vector<PendingCommand> mPendingCommands;    // queued commands in issue order
+    uint32_t mQueuedCommands;               // commands queued since creation
+    uint32_t mMergedCommands;               // queued commands superseded by a later command
+    uint32_t mFlushedBatches;               // non empty batches flushed
 };
 
 }; // namespace android_audio_legacy
@@ -33,7 +33,10 @@
 
 #include <inttypes.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <utils/Log.h>
 #include <utils/Timers.h>
@@ -54,11 +57,15 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
                                                   AudioSystem::device_connection_state state,
                                                   const char *device_address)
 {
+    ApiTimer timer(this, API_SET_DEVICE_CONNECTION_STATE);
+    invalidateOutputCache();
     // device_address can be NULL and should be handled as an empty string in this case,
     // and it is not checked by AudioPolicyInterfaceImpl.cpp
     if (device_address == NULL) {
         device_address = "";
     }
+    traceStringEvent((state == AudioSystem::DEVICE_STATE_AVAILABLE) ?
+                         TRACE_CONNECT : TRACE_DISCONNECT, device_address, device);
     ALOGV("setDeviceConnectionState() device: 0x%X, state %d, address %s", device, state, device_address);
 
     // connect/disconnect only 1 device at a time
@@ -88,7 +95,10 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
 
         // save a copy of the opened output descriptors before any output is opened or closed
         // by checkOutputsForDevice(). This will be needed by checkOutputForAllStrategies()
-        mPreviousOutputs = mOutputs;
+        // Done by beginRoutingTransaction() if a transaction is in progress.
+        if (mRoutingTransactionDepth == 0) {
+            mPreviousOutputs = mOpenOutputs;
+        }
         String8 paramStr;
         switch (state)
         {
@@ -163,6 +173,16 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
             return BAD_VALUE;
         }
 
+        if (mRoutingTransactionDepth != 0) {
+            // outputs are checked for closing by commitRoutingTransaction()
+            for (size_t i = 0; i < outputs.size(); i++) {
+                mRoutingTransactionOutputs.add(outputs[i]);
+            }
+            mRoutingTransactionChanges |= ROUTING_CHANGE_DEVICE_CONNECTION;
+            mRoutingTransactionDeferred++;
+            return NO_ERROR;
+        }
+
         checkA2dpSuspend();
         checkOutputForAllStrategies();
         // outputs must be closed after checkOutputForAllStrategies() is executed
@@ -190,6 +210,7 @@ status_t AudioPolicyManagerBase::setDeviceConnectionState(audio_devices_t device
                             0);
         }
 
+        publishSnapshot();
         return NO_ERROR;
     }  // end if is output device
 
@@ -288,6 +309,9 @@ AudioSystem::device_connection_state AudioPolicyManagerBase::getDeviceConnection
 
 void AudioPolicyManagerBase::setPhoneState(int state)
 {
+    ApiTimer timer(this, API_SET_PHONE_STATE);
+    traceEvent(TRACE_PHONE_STATE, state);
+    invalidateOutputCache();
     ALOGV("setPhoneState() state %d", state);
     audio_devices_t newDevice = AUDIO_DEVICE_NONE;
     if (state < 0 || state >= AudioSystem::NUM_MODES) {
@@ -321,8 +345,8 @@ void AudioPolicyManagerBase::setPhoneState(int state)
         // even if no device change is needed
         force = true;
         for (int j = 0; j < DEVICE_CATEGORY_CNT; j++) {
-            mStreams[AUDIO_STREAM_DTMF].mVolumeCurve[j] =
-                    sVolumeProfiles[AUDIO_STREAM_VOICE_CALL][j];
+            mStreams[AUDIO_STREAM_DTMF].setVolumeCurve((device_category)j,
+                    sVolumeProfiles[AUDIO_STREAM_VOICE_CALL][j]);
         }
     } else if (isStateInCall(oldState) && !isStateInCall(state)) {
         ALOGV("  Exiting call in setPhoneState()");
@@ -330,8 +354,8 @@ void AudioPolicyManagerBase::setPhoneState(int state)
         // even if no device change is needed
         force = true;
         for (int j = 0; j < DEVICE_CATEGORY_CNT; j++) {
-            mStreams[AUDIO_STREAM_DTMF].mVolumeCurve[j] =
-                    sVolumeProfiles[AUDIO_STREAM_DTMF][j];
+            mStreams[AUDIO_STREAM_DTMF].setVolumeCurve((device_category)j,
+                    sVolumeProfiles[AUDIO_STREAM_DTMF][j]);
         }
     } else if (isStateInCall(state) && (state != oldState)) {
         ALOGV("  Switching between telephony and VoIP in setPhoneState()");
@@ -340,6 +364,13 @@ void AudioPolicyManagerBase::setPhoneState(int state)
         force = true;
     }
 
+    if (mRoutingTransactionDepth != 0) {
+        // routing and in call sonification are updated by commitRoutingTransaction()
+        mRoutingTransactionChanges |= ROUTING_CHANGE_PHONE_STATE;
+        mRoutingTransactionDeferred++;
+        return;
+    }
+
     // check for device and output changes triggered by new phone state
     newDevice = getNewDevice(mPrimaryOutput, false /*fromCache*/);
     checkA2dpSuspend();
@@ -356,28 +387,7 @@ void AudioPolicyManagerBase::setPhoneState(int state)
 
     int delayMs = 0;
     if (isStateInCall(state)) {
-        nsecs_t sysTime = systemTime();
-        for (size_t i = 0; i < mOutputs.size(); i++) {
-            AudioOutputDescriptor *desc = mOutputs.valueAt(i);
-            // mute media and sonification strategies and delay device switch by the largest
-            // latency of any output where either strategy is active.
-            // This avoid sending the ring tone or music tail into the earpiece or headset.
-            if ((desc->isStrategyActive(STRATEGY_MEDIA,
-                                     SONIFICATION_HEADSET_MUSIC_DELAY,
-                                     sysTime) ||
-                    desc->isStrategyActive(STRATEGY_SONIFICATION,
-                                         SONIFICATION_HEADSET_MUSIC_DELAY,
-                                         sysTime)) &&
-                    (delayMs < (int)desc->mLatency*2)) {
-                delayMs = desc->mLatency*2;
-            }
-            setStrategyMute(STRATEGY_MEDIA, true, mOutputs.keyAt(i));
-            setStrategyMute(STRATEGY_MEDIA, false, mOutputs.keyAt(i), MUTE_TIME_MS,
-                getDeviceForStrategy(STRATEGY_MEDIA, true /*fromCache*/));
-            setStrategyMute(STRATEGY_SONIFICATION, true, mOutputs.keyAt(i));
-            setStrategyMute(STRATEGY_SONIFICATION, false, mOutputs.keyAt(i), MUTE_TIME_MS,
-                getDeviceForStrategy(STRATEGY_SONIFICATION, true /*fromCache*/));
-        }
+        delayMs = muteStrategiesForCall();
     }
 
     // change routing is necessary
@@ -399,10 +409,15 @@ void AudioPolicyManagerBase::setPhoneState(int state)
     } else {
         mLimitRingtoneVolume = false;
     }
+
+    publishSnapshot();
 }
 
 void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSystem::forced_config config)
 {
+    ApiTimer timer(this, API_SET_FORCE_USE);
+    traceEvent(TRACE_FORCE_USE, usage, config);
+    invalidateOutputCache();
     ALOGV("setForceUse() usage %d, config %d, mPhoneState %d", usage, config, mPhoneState);
 
     bool forceVolumeReeval = false;
@@ -459,16 +474,25 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
         break;
     }
 
-    // check for device and output changes triggered by new force usage
-    checkA2dpSuspend();
-    checkOutputForAllStrategies();
-    updateDevicesAndOutputs();
-    for (size_t i = 0; i < mOutputs.size(); i++) {
-        audio_io_handle_t output = mOutputs.keyAt(i);
-        audio_devices_t newDevice = getNewDevice(output, true /*fromCache*/);
-        setOutputDevice(output, newDevice, (newDevice != AUDIO_DEVICE_NONE));
-        if (forceVolumeReeval && (newDevice != AUDIO_DEVICE_NONE)) {
-            applyStreamVolumes(output, newDevice, 0, true);
+    if (mRoutingTransactionDepth != 0) {
+        // output devices are updated by commitRoutingTransaction()
+        mRoutingTransactionChanges |= ROUTING_CHANGE_FORCE_USE;
+        if (forceVolumeReeval) {
+            mRoutingTransactionChanges |= ROUTING_CHANGE_FORCE_VOLUME;
+        }
+        mRoutingTransactionDeferred++;
+    } else {
+        // check for device and output changes triggered by new force usage
+        checkA2dpSuspend();
+        checkOutputForAllStrategies();
+        updateDevicesAndOutputs();
+        for (size_t i = 0; i < mOutputs.size(); i++) {
+            audio_io_handle_t output = mOutputs.keyAt(i);
+            audio_devices_t newDevice = getNewDevice(output, true /*fromCache*/);
+            setOutputDevice(output, newDevice, (newDevice != AUDIO_DEVICE_NONE));
+            if (forceVolumeReeval && (newDevice != AUDIO_DEVICE_NONE)) {
+                applyStreamVolumes(output, newDevice, 0, true);
+            }
         }
     }
 
@@ -486,6 +510,113 @@ void AudioPolicyManagerBase::setForceUse(AudioSystem::force_use usage, AudioSyst
         }
     }
 
+    publishSnapshot();
+}
+
+void AudioPolicyManagerBase::beginRoutingTransaction()
+{
+    traceEvent(TRACE_BEGIN_TRANSACTION);
+    if (mRoutingTransactionDepth++ != 0) {
+        return;
+    }
+    ALOGV("beginRoutingTransaction()");
+    // save a copy of the opened output descriptors before any output is opened or closed
+    // during the transaction. This will be needed by checkOutputForAllStrategies()
+    mPreviousOutputs = mOpenOutputs;
+    mRoutingTransactionPhoneState = mPhoneState;
+    mRoutingTransactionChanges = 0;
+}
+
+void AudioPolicyManagerBase::commitRoutingTransaction()
+{
+    ApiTimer timer(this, API_COMMIT_ROUTING_TRANSACTION);
+    traceEvent(TRACE_COMMIT_TRANSACTION);
+    if (mRoutingTransactionDepth == 0) {
+        ALOGW("commitRoutingTransaction() no transaction in progress");
+        return;
+    }
+    if (--mRoutingTransactionDepth != 0) {
+        return;
+    }
+    ALOGV("commitRoutingTransaction() changes %x", mRoutingTransactionChanges);
+    if (mRoutingTransactionChanges == 0) {
+        return;
+    }
+    mRoutingTransactionCount++;
+
+    int oldState = mRoutingTransactionPhoneState;
+    int state = mPhoneState;
+    // force routing command to audio hardware when entering or exiting a call, or when
+    // switching between telephony and VoIP, even if no device change is needed
+    bool phoneForce = (isStateInCall(oldState) || isStateInCall(state)) && (state != oldState);
+
+    checkA2dpSuspend();
+    checkOutputForAllStrategies();
+    // outputs must be closed after checkOutputForAllStrategies() is executed
+    for (size_t i = 0; i < mRoutingTransactionOutputs.size(); i++) {
+        audio_io_handle_t output = mRoutingTransactionOutputs[i];
+        ssize_t index = mOutputs.indexOfKey(output);
+        if (index < 0) {
+            continue;
+        }
+        AudioOutputDescriptor *desc = mOutputs.valueAt(index);
+        // close outputs not needed any more after device disconnection or direct outputs that
+        // have been opened by checkOutputsForDevice() to query dynamic parameters. The devices
+        // available when committing decide as a device may have been disconnected and connected
+        // again during the transaction.
+        if (!(desc->mProfile->mSupportedDevices & mAvailableOutputDevices) ||
+                (((desc->mFlags & AUDIO_OUTPUT_FLAG_DIRECT) != 0) &&
+                 (desc->mDirectOpenCount == 0))) {
+            closeOutput(output);
+        }
+    }
+    mRoutingTransactionOutputs.clear();
+
+    updateDevicesAndOutputs();
+
+    int delayMs = 0;
+    if (phoneForce && isStateInCall(state)) {
+        delayMs = muteStrategiesForCall();
+    }
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        audio_io_handle_t output = mOutputs.keyAt(i);
+        AudioOutputDescriptor *desc = mOutputs.valueAt(i);
+        audio_devices_t newDevice = getNewDevice(output, true /*fromCache*/);
+        // see setDeviceConnectionState() for the duplicated output case
+        bool force = (newDevice != AUDIO_DEVICE_NONE) ||
+                ((mRoutingTransactionChanges & ROUTING_CHANGE_DEVICE_CONNECTION) &&
+                        !desc->isDuplicated());
+        int outputDelayMs = 0;
+        if (output == mPrimaryOutput && phoneForce) {
+            // see setPhoneState()
+            if (isStateInCall(oldState) && newDevice == AUDIO_DEVICE_NONE) {
+                newDevice = desc->device();
+            }
+            force = true;
+            outputDelayMs = delayMs;
+        }
+        setOutputDevice(output, newDevice, force, outputDelayMs);
+        if ((mRoutingTransactionChanges & ROUTING_CHANGE_FORCE_VOLUME) &&
+                (newDevice != AUDIO_DEVICE_NONE)) {
+            applyStreamVolumes(output, newDevice, 0, true);
+        }
+    }
+
+    if (mRoutingTransactionChanges & ROUTING_CHANGE_PHONE_STATE) {
+        // if in call state, handle special case of active streams
+        // pertaining to sonification strategy see handleIncallSonification()
+        if (isStateInCall(state)) {
+            for (int stream = 0; stream < AudioSystem::NUM_STREAM_TYPES; stream++) {
+                handleIncallSonification(stream, true, true);
+            }
+        }
+        // Flag that ringtone volume must be limited to music volume until we exit MODE_RINGTONE
+        mLimitRingtoneVolume = (state == AudioSystem::MODE_RINGTONE &&
+                isStreamActive(AudioSystem::MUSIC, SONIFICATION_HEADSET_MUSIC_DELAY));
+    }
+    mRoutingTransactionChanges = 0;
+
+    publishSnapshot();
 }
 
 AudioSystem::forced_config AudioPolicyManagerBase::getForceUse(AudioSystem::force_use usage)
@@ -507,32 +638,13 @@ AudioPolicyManagerBase::IOProfile *AudioPolicyManagerBase::getProfileForDirectOu
                                                                audio_channel_mask_t channelMask,
                                                                audio_output_flags_t flags)
 {
-    for (size_t i = 0; i < mHwModules.size(); i++) {
-        if (mHwModules[i]->mHandle == 0) {
-            continue;
-        }
-        for (size_t j = 0; j < mHwModules[i]->mOutputProfiles.size(); j++) {
-            IOProfile *profile = mHwModules[i]->mOutputProfiles[j];
-            if (flags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) {
-                if (profile->isCompatibleProfile(device, samplingRate, format,
-                                           channelMask,
-                                           AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD)) {
-                    if (mAvailableOutputDevices & profile->mSupportedDevices) {
-                        return mHwModules[i]->mOutputProfiles[j];
-                    }
-                }
-            } else {
-                if (profile->isCompatibleProfile(device, samplingRate, format,
-                                           channelMask,
-                                           AUDIO_OUTPUT_FLAG_DIRECT)) {
-                    if (mAvailableOutputDevices & profile->mSupportedDevices) {
-                        return mHwModules[i]->mOutputProfiles[j];
-                    }
-                }
-            }
-        }
+    if (flags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) {
+        flags = AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD;
+    } else {
+        flags = AUDIO_OUTPUT_FLAG_DIRECT;
     }
-    return 0;
+    return findIndexedProfile(mOutputProfileIndex, device, samplingRate, format, channelMask,
+                              flags, mAvailableOutputDevices);
 }
 
 audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type stream,
@@ -541,13 +653,23 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
                                     audio_channel_mask_t channelMask,
                                     AudioSystem::output_flags flags,
                                     const audio_offload_info_t *offloadInfo)
+{
+    ApiTimer timer(this, API_GET_OUTPUT);
+    audio_io_handle_t output = getOutputInt(stream, samplingRate, format, channelMask, flags,
+                                            offloadInfo);
+    traceEvent(TRACE_GET_OUTPUT, output, stream, samplingRate, format, channelMask, flags);
+    return output;
+}
+
+audio_io_handle_t AudioPolicyManagerBase::getOutputInt(AudioSystem::stream_type stream,
+                                    uint32_t samplingRate,
+                                    audio_format_t format,
+                                    audio_channel_mask_t channelMask,
+                                    AudioSystem::output_flags flags,
+                                    const audio_offload_info_t *offloadInfo)
 {
     audio_io_handle_t output = 0;
     uint32_t latency = 0;
-    routing_strategy strategy = getStrategy((AudioSystem::stream_type)stream);
-    audio_devices_t device = getDeviceForStrategy(strategy, false /*fromCache*/);
-    ALOGV("getOutput() device %d, stream %d, samplingRate %d, format %x, channelMask %x, flags %x",
-          device, stream, samplingRate, format, channelMask, flags);
 
 #ifdef AUDIO_POLICY_TEST
     if (mCurOutput != 0) {
@@ -582,6 +704,20 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
     }
 #endif //AUDIO_POLICY_TEST
 
+    OutputCacheKey cacheKey(stream, samplingRate, format, channelMask, flags);
+    ssize_t cacheIndex = mOutputCache.indexOfKey(cacheKey);
+    if (cacheIndex >= 0) {
+        mOutputCacheHits++;
+        ALOGV("getOutput() returns cached output %d", mOutputCache.valueAt(cacheIndex));
+        return mOutputCache.valueAt(cacheIndex);
+    }
+    mOutputCacheMisses++;
+
+    routing_strategy strategy = getStrategy((AudioSystem::stream_type)stream);
+    audio_devices_t device = getDeviceForStrategy(strategy, false /*fromCache*/);
+    ALOGV("getOutput() device %d, stream %d, samplingRate %d, format %x, channelMask %x, flags %x",
+          device, stream, samplingRate, format, channelMask, flags);
+
     // open a direct output if required by specified parameters
     //force direct flag if offload flag is set: offloading implies a direct output stream
     // and all common behaviors are driven by checking only the direct flag
@@ -634,8 +770,6 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
         outputDesc->mChannelMask = channelMask;
         outputDesc->mLatency = 0;
         outputDesc->mFlags =(audio_output_flags_t) (outputDesc->mFlags | flags);
-        outputDesc->mRefCount[stream] = 0;
-        outputDesc->mStopTime[stream] = 0;
         outputDesc->mDirectOpenCount = 1;
         output = mpClientInterface->openOutput(profile->mModule->mHandle,
                                         &outputDesc->mDevice,
@@ -667,7 +801,7 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
         if (dstOutput == output) {
             mpClientInterface->moveEffects(AUDIO_SESSION_OUTPUT_MIX, srcOutput, dstOutput);
         }
-        mPreviousOutputs = mOutputs;
+        mPreviousOutputs = mOpenOutputs;
         ALOGV("getOutput() returns new direct output %d", output);
         return output;
     }
@@ -680,19 +814,32 @@ audio_io_handle_t AudioPolicyManagerBase::getOutput(AudioSystem::stream_type str
     if (audio_is_linear_pcm(format)) {
         // get which output is suitable for the specified stream. The actual
         // routing change will happen when startOutput() will be called
-        SortedVector<audio_io_handle_t> outputs = getOutputsForDevice(device, mOutputs);
+        OutputSet outputs = getOutputsForDevice(device, mOpenOutputs);
 
         output = selectOutput(outputs, flags);
     }
     ALOGW_IF((output == 0), "getOutput() could not find output for stream %d, samplingRate %d,"
             "format %d, channels %x, flags %x", stream, samplingRate, format, channelMask, flags);
 
+    // Only cache mixer outputs: direct outputs are reference counted by getOutput(). Strategies
+    // depending on stream activity are not cached as activity changes do not invalidate the cache
+    audio_devices_t strategyDevices;
+    if ((output != 0) &&
+            ((flags & (AUDIO_OUTPUT_FLAG_DIRECT | AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD)) == 0) &&
+            ((getStrategyDependencies(strategy, &strategyDevices) &
+                    DEPENDS_ON_STREAM_ACTIVITY) == 0)) {
+        if (mOutputCache.size() >= MAX_OUTPUT_CACHE_SIZE) {
+            mOutputCache.clear();
+        }
+        mOutputCache.add(cacheKey, output);
+    }
+
     ALOGV("getOutput() returns output %d", output);
 
     return output;
 }
 
-audio_io_handle_t AudioPolicyManagerBase::selectOutput(const SortedVector<audio_io_handle_t>& outputs,
+audio_io_handle_t AudioPolicyManagerBase::selectOutput(const OutputSet& outputs,
                                                        AudioSystem::output_flags flags)
 {
     // select one output among several that provide a path to a particular device or set of
@@ -700,30 +847,35 @@ audio_io_handle_t AudioPolicyManagerBase::selectOutput(const SortedVector<audio_
     // The priority is as follows:
     // 1: the output with the highest number of requested policy flags
     // 2: the primary output
-    // 3: the first output in the list
+    // 3: the output with the lowest handle
 
-    if (outputs.size() == 0) {
+    if (outputs.isEmpty()) {
         return 0;
     }
     if (outputs.size() == 1) {
-        return outputs[0];
+        return mOutputSlots[outputs.first()]->mId;
     }
 
     int maxCommonFlags = 0;
     audio_io_handle_t outputFlags = 0;
     audio_io_handle_t outputPrimary = 0;
+    audio_io_handle_t outputFirst = 0;
 
-    for (size_t i = 0; i < outputs.size(); i++) {
-        AudioOutputDescriptor *outputDesc = mOutputs.valueFor(outputs[i]);
+    for (uint32_t slot = outputs.first(); slot < MAX_OUTPUTS; slot = outputs.next(slot)) {
+        AudioOutputDescriptor *outputDesc = mOutputSlots[slot];
+        if (outputFirst == 0 || outputDesc->mId < outputFirst) {
+            outputFirst = outputDesc->mId;
+        }
         if (!outputDesc->isDuplicated()) {
             int commonFlags = (int)AudioSystem::popCount(outputDesc->mProfile->mFlags & flags);
             if (commonFlags > maxCommonFlags) {
-                outputFlags = outputs[i];
+                outputFlags = outputDesc->mId;
                 maxCommonFlags = commonFlags;
-                ALOGV("selectOutput() commonFlags for output %d, %04x", outputs[i], commonFlags);
+                ALOGV("selectOutput() commonFlags for output %d, %04x", outputDesc->mId,
+                      commonFlags);
             }
             if (outputDesc->mProfile->mFlags & AUDIO_OUTPUT_FLAG_PRIMARY) {
-                outputPrimary = outputs[i];
+                outputPrimary = outputDesc->mId;
             }
         }
     }
@@ -735,13 +887,15 @@ audio_io_handle_t AudioPolicyManagerBase::selectOutput(const SortedVector<audio_
         return outputPrimary;
     }
 
-    return outputs[0];
+    return outputFirst;
 }
 
 status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
                                              AudioSystem::stream_type stream,
                                              audio_session_t session)
 {
+    ApiTimer timer(this, API_START_OUTPUT);
+    traceEvent(TRACE_START_OUTPUT, output, stream, session);
     ALOGV("startOutput() output %d, stream %d, session %d", output, stream, session);
     ssize_t index = mOutputs.indexOfKey(output);
     if (index < 0) {
@@ -799,9 +953,11 @@ status_t AudioPolicyManagerBase::startOutput(audio_io_handle_t output,
         // routing
         handleNotificationRoutingForStream(stream);
         if (waitMs > muteWaitMs) {
+            mpClientInterface->flushCommands();
             usleep((waitMs - muteWaitMs) * 2 * 1000);
         }
     }
+    publishSnapshot();
     return NO_ERROR;
 }
 
@@ -810,6 +966,8 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
                                             AudioSystem::stream_type stream,
                                             audio_session_t session)
 {
+    ApiTimer timer(this, API_STOP_OUTPUT);
+    traceEvent(TRACE_STOP_OUTPUT, output, stream, session);
     ALOGV("stopOutput() output %d, stream %d, session %d", output, stream, session);
     ssize_t index = mOutputs.indexOfKey(output);
     if (index < 0) {
@@ -829,7 +987,7 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
         outputDesc->changeRefCount(stream, -1);
         // store time at which the stream was stopped - see isStreamActive()
         if (outputDesc->mRefCount[stream] == 0) {
-            outputDesc->mStopTime[stream] = systemTime();
+            outputDesc->setStopTime(stream, systemTime());
             audio_devices_t newDevice = getNewDevice(output, false /*fromCache*/);
             // delay the device switch by twice the latency because stopOutput() is executed when
             // the track stop() command is received and at that time the audio track buffer can
@@ -856,6 +1014,7 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
             // update the outputs if stopping one with a stream that can affect notification routing
             handleNotificationRoutingForStream(stream);
         }
+        publishSnapshot();
         return NO_ERROR;
     } else {
         ALOGW("stopOutput() refcount is already 0 for output %d", output);
@@ -865,6 +1024,8 @@ status_t AudioPolicyManagerBase::stopOutput(audio_io_handle_t output,
 
 void AudioPolicyManagerBase::releaseOutput(audio_io_handle_t output)
 {
+    ApiTimer timer(this, API_RELEASE_OUTPUT);
+    traceEvent(TRACE_RELEASE_OUTPUT, output);
     ALOGV("releaseOutput() %d", output);
     ssize_t index = mOutputs.indexOfKey(output);
     if (index < 0) {
@@ -878,8 +1039,8 @@ void AudioPolicyManagerBase::releaseOutput(audio_io_handle_t output)
         AudioOutputDescriptor *outputDesc = mOutputs.valueAt(index);
         if (outputDesc->isActive()) {
             mpClientInterface->closeOutput(output);
-            delete mOutputs.valueAt(index);
-            mOutputs.removeItem(output);
+            removeOutput(output);
+            delete outputDesc;
             mTestOutputs[testIndex] = 0;
         }
         return;
@@ -901,6 +1062,7 @@ void AudioPolicyManagerBase::releaseOutput(audio_io_handle_t output)
             if (dstOutput != mPrimaryOutput) {
                 mpClientInterface->moveEffects(AUDIO_SESSION_OUTPUT_MIX, mPrimaryOutput, dstOutput);
             }
+            publishSnapshot();
         }
     }
 }
@@ -911,6 +1073,19 @@ audio_io_handle_t AudioPolicyManagerBase::getInput(int inputSource,
                                     audio_format_t format,
                                     audio_channel_mask_t channelMask,
                                     AudioSystem::audio_in_acoustics acoustics)
+{
+    ApiTimer timer(this, API_GET_INPUT);
+    audio_io_handle_t input = getInputInt(inputSource, samplingRate, format, channelMask,
+                                          acoustics);
+    traceEvent(TRACE_GET_INPUT, input, inputSource, samplingRate, format, channelMask, acoustics);
+    return input;
+}
+
+audio_io_handle_t AudioPolicyManagerBase::getInputInt(int inputSource,
+                                    uint32_t samplingRate,
+                                    audio_format_t format,
+                                    audio_channel_mask_t channelMask,
+                                    AudioSystem::audio_in_acoustics acoustics)
 {
     audio_io_handle_t input = 0;
     audio_devices_t device = getDeviceForInputSource(inputSource);
@@ -989,6 +1164,8 @@ audio_io_handle_t AudioPolicyManagerBase::getInput(int inputSource,
 
 status_t AudioPolicyManagerBase::startInput(audio_io_handle_t input)
 {
+    ApiTimer timer(this, API_START_INPUT);
+    traceEvent(TRACE_START_INPUT, input);
     ALOGV("startInput() input %d", input);
     ssize_t index = mInputs.indexOfKey(input);
     if (index < 0) {
@@ -1045,6 +1222,8 @@ status_t AudioPolicyManagerBase::startInput(audio_io_handle_t input)
 
 status_t AudioPolicyManagerBase::stopInput(audio_io_handle_t input)
 {
+    ApiTimer timer(this, API_STOP_INPUT);
+    traceEvent(TRACE_STOP_INPUT, input);
     ALOGV("stopInput() input %d", input);
     ssize_t index = mInputs.indexOfKey(input);
     if (index < 0) {
@@ -1073,6 +1252,8 @@ status_t AudioPolicyManagerBase::stopInput(audio_io_handle_t input)
 
 void AudioPolicyManagerBase::releaseInput(audio_io_handle_t input)
 {
+    ApiTimer timer(this, API_RELEASE_INPUT);
+    traceEvent(TRACE_RELEASE_INPUT, input);
     ALOGV("releaseInput() %d", input);
     ssize_t index = mInputs.indexOfKey(input);
     if (index < 0) {
@@ -1097,6 +1278,8 @@ void AudioPolicyManagerBase::initStreamVolume(AudioSystem::stream_type stream,
                                             int indexMin,
                                             int indexMax)
 {
+    ApiTimer timer(this, API_INIT_STREAM_VOLUME);
+    traceEvent(TRACE_INIT_STREAM_VOLUME, stream, indexMin, indexMax);
     ALOGV("initStreamVolume() stream %d, min %d, max %d", stream , indexMin, indexMax);
     if (indexMin < 0 || indexMin >= indexMax) {
         ALOGW("initStreamVolume() invalid index limits for stream %d, min %d, max %d", stream , indexMin, indexMax);
@@ -1110,6 +1293,8 @@ status_t AudioPolicyManagerBase::setStreamVolumeIndex(AudioSystem::stream_type s
                                                       int index,
                                                       audio_devices_t device)
 {
+    ApiTimer timer(this, API_SET_STREAM_VOLUME_INDEX);
+    traceEvent(TRACE_SET_VOLUME_INDEX, stream, index, device);
 
     if ((index < mStreams[stream].mIndexMin) || (index > mStreams[stream].mIndexMax)) {
         return BAD_VALUE;
@@ -1130,6 +1315,7 @@ status_t AudioPolicyManagerBase::setStreamVolumeIndex(AudioSystem::stream_type s
         mStreams[stream].mIndexCur.clear();
     }
     mStreams[stream].mIndexCur.add(device, index);
+    publishSnapshot();
 
     // compute and apply stream volume on all outputs according to connected device
     status_t status = NO_ERROR;
@@ -1168,8 +1354,47 @@ status_t AudioPolicyManagerBase::getStreamVolumeIndex(AudioSystem::stream_type s
     return NO_ERROR;
 }
 
-audio_io_handle_t AudioPolicyManagerBase::selectOutputForEffects(
-                                            const SortedVector<audio_io_handle_t>& outputs)
+status_t AudioPolicyManagerBase::getStreamVolumeIndexSnapshot(AudioSystem::stream_type stream,
+                                                              int *index,
+                                                              audio_devices_t device)
+{
+    if (index == NULL) {
+        return BAD_VALUE;
+    }
+    if (!audio_is_output_device(device)) {
+        return BAD_VALUE;
+    }
+    if (stream < (AudioSystem::stream_type) 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+        return BAD_VALUE;
+    }
+    routing_strategy strategy = getStrategy(stream);
+    audio_devices_t volumeDevice;
+    int32_t seq;
+    do {
+        seq = android_atomic_acquire_load(&mSnapshotSeq);
+        // see getStreamVolumeIndex() and StreamDescriptor::getVolumeIndex()
+        volumeDevice = device;
+        if (volumeDevice == AUDIO_DEVICE_OUT_DEFAULT) {
+            volumeDevice = mSnapshot.mDeviceForStrategy[strategy];
+        }
+        volumeDevice = getDeviceForVolume(volumeDevice);
+        *index = 0;
+        for (size_t i = 0; i < mSnapshot.mVolumeIndexCount[stream]; i++) {
+            if (mSnapshot.mVolumeDevice[stream][i] == volumeDevice) {
+                *index = mSnapshot.mVolumeIndex[stream][i];
+                break;
+            } else if (mSnapshot.mVolumeDevice[stream][i] == AUDIO_DEVICE_OUT_DEFAULT) {
+                *index = mSnapshot.mVolumeIndex[stream][i];
+            }
+        }
+    } while ((seq & 1) || (android_atomic_release_load(&mSnapshotSeq) != seq));
+
+    ALOGV("getStreamVolumeIndexSnapshot() stream %d device %08x index %d",
+          stream, volumeDevice, *index);
+    return NO_ERROR;
+}
+
+audio_io_handle_t AudioPolicyManagerBase::selectOutputForEffects(const OutputSet& outputs)
 {
     // select one output among several suitable for global effects.
     // The priority is as follows:
@@ -1177,23 +1402,27 @@ audio_io_handle_t AudioPolicyManagerBase::selectOutputForEffects(
     //    AudioFlinger will invalidate the track and the offloaded output
     //    will be closed causing the effect to be moved to a PCM output.
     // 2: A deep buffer output
-    // 3: the first output in the list
+    // 3: the output with the lowest handle
 
-    if (outputs.size() == 0) {
+    if (outputs.isEmpty()) {
         return 0;
     }
 
     audio_io_handle_t outputOffloaded = 0;
     audio_io_handle_t outputDeepBuffer = 0;
+    audio_io_handle_t outputFirst = 0;
 
-    for (size_t i = 0; i < outputs.size(); i++) {
-        AudioOutputDescriptor *desc = mOutputs.valueFor(outputs[i]);
-        ALOGV("selectOutputForEffects outputs[%zu] flags %x", i, desc->mFlags);
+    for (uint32_t slot = outputs.first(); slot < MAX_OUTPUTS; slot = outputs.next(slot)) {
+        AudioOutputDescriptor *desc = mOutputSlots[slot];
+        ALOGV("selectOutputForEffects output %d flags %x", desc->mId, desc->mFlags);
+        if (outputFirst == 0 || desc->mId < outputFirst) {
+            outputFirst = desc->mId;
+        }
         if ((desc->mFlags & AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD) != 0) {
-            outputOffloaded = outputs[i];
+            outputOffloaded = desc->mId;
         }
         if ((desc->mFlags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) != 0) {
-            outputDeepBuffer = outputs[i];
+            outputDeepBuffer = desc->mId;
         }
     }
 
@@ -1206,16 +1435,17 @@ audio_io_handle_t AudioPolicyManagerBase::selectOutputForEffects(
         return outputDeepBuffer;
     }
 
-    return outputs[0];
+    return outputFirst;
 }
 
 audio_io_handle_t AudioPolicyManagerBase::getOutputForEffect(const effect_descriptor_t *desc)
 {
+    ApiTimer timer(this, API_GET_OUTPUT_FOR_EFFECT);
     // apply simple rule where global effects are attached to the same output as MUSIC streams
 
     routing_strategy strategy = getStrategy(AudioSystem::MUSIC);
     audio_devices_t device = getDeviceForStrategy(strategy, false /*fromCache*/);
-    SortedVector<audio_io_handle_t> dstOutputs = getOutputsForDevice(device, mOutputs);
+    OutputSet dstOutputs = getOutputsForDevice(device, mOpenOutputs);
 
     audio_io_handle_t output = selectOutputForEffects(dstOutputs);
     ALOGV("getOutputForEffect() got output %d for fx %s flags %x",
@@ -1230,6 +1460,9 @@ status_t AudioPolicyManagerBase::registerEffect(const effect_descriptor_t *desc,
                                 audio_session_t session,
                                 int id)
 {
+    ApiTimer timer(this, API_REGISTER_EFFECT);
+    traceEvent(TRACE_REGISTER_EFFECT, id, io, strategy, session, desc->flags,
+               (desc->cpuLoad << 16) | desc->memoryUsage);
     ssize_t index = mOutputs.indexOfKey(io);
     if (index < 0) {
         index = mInputs.indexOfKey(io);
@@ -1244,6 +1477,11 @@ status_t AudioPolicyManagerBase::registerEffect(const effect_descriptor_t *desc,
                 desc->name, desc->memoryUsage);
         return INVALID_OPERATION;
     }
+    if (!checkEffectBudgets(io, 0, desc->memoryUsage)) {
+        ALOGW("registerEffect() io %d memory budget exceeded for Fx %s, Memory %d KB",
+                io, desc->name, desc->memoryUsage);
+        return INVALID_OPERATION;
+    }
     mTotalEffectsMemory += desc->memoryUsage;
     ALOGV("registerEffect() effect %s, io %d, strategy %d session %d id %d",
             desc->name, io, strategy, session, id);
@@ -1257,12 +1495,15 @@ status_t AudioPolicyManagerBase::registerEffect(const effect_descriptor_t *desc,
     pDesc->mEnabled = false;
 
     mEffects.add(id, pDesc);
+    updateEffectUsage(pDesc, true);
 
     return NO_ERROR;
 }
 
 status_t AudioPolicyManagerBase::unregisterEffect(int id)
 {
+    ApiTimer timer(this, API_UNREGISTER_EFFECT);
+    traceEvent(TRACE_UNREGISTER_EFFECT, id);
     ssize_t index = mEffects.indexOfKey(id);
     if (index < 0) {
         ALOGW("unregisterEffect() unknown effect ID %d", id);
@@ -1281,6 +1522,7 @@ status_t AudioPolicyManagerBase::unregisterEffect(int id)
     mTotalEffectsMemory -= pDesc->mDesc.memoryUsage;
     ALOGV("unregisterEffect() effect %s, ID %d, memory %d total memory %d",
             pDesc->mDesc.name, id, pDesc->mDesc.memoryUsage, mTotalEffectsMemory);
+    updateEffectUsage(pDesc, false);
 
     mEffects.removeItem(id);
     delete pDesc;
@@ -1290,6 +1532,8 @@ status_t AudioPolicyManagerBase::unregisterEffect(int id)
 
 status_t AudioPolicyManagerBase::setEffectEnabled(int id, bool enabled)
 {
+    ApiTimer timer(this, API_SET_EFFECT_ENABLED);
+    traceEvent(TRACE_SET_EFFECT_ENABLED, id, enabled);
     ssize_t index = mEffects.indexOfKey(id);
     if (index < 0) {
         ALOGW("unregisterEffect() unknown effect ID %d", id);
@@ -1313,6 +1557,11 @@ status_t AudioPolicyManagerBase::setEffectEnabled(EffectDescriptor *pDesc, bool
                  pDesc->mDesc.name, (float)pDesc->mDesc.cpuLoad/10);
             return INVALID_OPERATION;
         }
+        if (!checkEffectBudgets(pDesc->mIo, pDesc->mDesc.cpuLoad, 0)) {
+            ALOGW("setEffectEnabled(true) io %d CPU budget exceeded for Fx %s, CPU %f MIPS",
+                 pDesc->mIo, pDesc->mDesc.name, (float)pDesc->mDesc.cpuLoad/10);
+            return INVALID_OPERATION;
+        }
         mTotalEffectsCpuLoad += pDesc->mDesc.cpuLoad;
         ALOGV("setEffectEnabled(true) total CPU %d", mTotalEffectsCpuLoad);
     } else {
@@ -1324,22 +1573,156 @@ status_t AudioPolicyManagerBase::setEffectEnabled(EffectDescriptor *pDesc, bool
         mTotalEffectsCpuLoad -= pDesc->mDesc.cpuLoad;
         ALOGV("setEffectEnabled(false) total CPU %d", mTotalEffectsCpuLoad);
     }
+    updateEffectUsage(pDesc, false);
     pDesc->mEnabled = enabled;
+    updateEffectUsage(pDesc, true);
     return NO_ERROR;
 }
 
-bool AudioPolicyManagerBase::isNonOffloadableEffectEnabled()
+bool AudioPolicyManagerBase::isNonOffloadableEffect(const EffectDescriptor *pDesc)
 {
-    for (size_t i = 0; i < mEffects.size(); i++) {
-        const EffectDescriptor * const pDesc = mEffects.valueAt(i);
-        if (pDesc->mEnabled && (pDesc->mStrategy == STRATEGY_MEDIA) &&
-                ((pDesc->mDesc.flags & EFFECT_FLAG_OFFLOAD_SUPPORTED) == 0)) {
-            ALOGV("isNonOffloadableEffectEnabled() non offloadable effect %s enabled on session %d",
-                  pDesc->mDesc.name, pDesc->mSession);
-            return true;
+    return (pDesc->mStrategy == STRATEGY_MEDIA) &&
+            ((pDesc->mDesc.flags & EFFECT_FLAG_OFFLOAD_SUPPORTED) == 0);
+}
+
+void AudioPolicyManagerBase::updateEffectUsage(EffectUsage& usage,
+                                               const EffectDescriptor *pDesc,
+                                               bool add)
+{
+    bool nonOffloadable = pDesc->mEnabled && isNonOffloadableEffect(pDesc);
+
+    if (add) {
+        usage.mMemory += pDesc->mDesc.memoryUsage;
+        if (pDesc->mEnabled) {
+            usage.mCpuLoad += pDesc->mDesc.cpuLoad;
         }
+        if (nonOffloadable) {
+            usage.mNonOffloadableCount++;
+        }
+        return;
     }
-    return false;
+
+    usage.mMemory = (usage.mMemory > pDesc->mDesc.memoryUsage) ?
+            usage.mMemory - pDesc->mDesc.memoryUsage : 0;
+    if (pDesc->mEnabled) {
+        usage.mCpuLoad = (usage.mCpuLoad > pDesc->mDesc.cpuLoad) ?
+                usage.mCpuLoad - pDesc->mDesc.cpuLoad : 0;
+    }
+    if (nonOffloadable && usage.mNonOffloadableCount != 0) {
+        usage.mNonOffloadableCount--;
+    }
+}
+
+void AudioPolicyManagerBase::updateEffectUsage(EffectDescriptor *pDesc, bool add)
+{
+    if (add) {
+        pDesc->mModule = getModuleForIo(pDesc->mIo);
+    }
+
+    ssize_t index = mEffectUsage.indexOfKey(pDesc->mIo);
+    if (index < 0 && add) {
+        index = mEffectUsage.add(pDesc->mIo, EffectUsage());
+    }
+    if (index >= 0) {
+        EffectUsage& usage = mEffectUsage.editValueAt(index);
+        updateEffectUsage(usage, pDesc, add);
+        if (usage.mMemory == 0 && usage.mCpuLoad == 0 && usage.mNonOffloadableCount == 0) {
+            mEffectUsage.removeItemsAt(index);
+        }
+    } else {
+        ALOGW("updateEffectUsage() no usage for io %d", pDesc->mIo);
+    }
+
+    if (pDesc->mModule != AUDIO_MODULE_HANDLE_NONE) {
+        index = mModuleEffectUsage.indexOfKey(pDesc->mModule);
+        if (index < 0 && add) {
+            index = mModuleEffectUsage.add(pDesc->mModule, EffectUsage());
+        }
+        if (index >= 0) {
+            EffectUsage& usage = mModuleEffectUsage.editValueAt(index);
+            updateEffectUsage(usage, pDesc, add);
+            if (usage.mMemory == 0 && usage.mCpuLoad == 0 && usage.mNonOffloadableCount == 0) {
+                mModuleEffectUsage.removeItemsAt(index);
+            }
+        }
+    }
+
+    if (!pDesc->mEnabled || !isNonOffloadableEffect(pDesc)) {
+        return;
+    }
+    ssize_t sessionIndex = mNonOffloadableEffectsPerSession.indexOfKey(pDesc->mSession);
+    if (add) {
+        mNonOffloadableEffectsEnabled++;
+        if (sessionIndex < 0) {
+            mNonOffloadableEffectsPerSession.add(pDesc->mSession, 1);
+        } else {
+            mNonOffloadableEffectsPerSession.editValueAt(sessionIndex)++;
+        }
+        ALOGV("updateEffectUsage() non offloadable effect %s enabled on session %d",
+              pDesc->mDesc.name, pDesc->mSession);
+    } else {
+        if (mNonOffloadableEffectsEnabled != 0) {
+            mNonOffloadableEffectsEnabled--;
+        }
+        if (sessionIndex >= 0 &&
+                --mNonOffloadableEffectsPerSession.editValueAt(sessionIndex) == 0) {
+            mNonOffloadableEffectsPerSession.removeItemsAt(sessionIndex);
+        }
+    }
+}
+
+audio_module_handle_t AudioPolicyManagerBase::getModuleForIo(audio_io_handle_t io) const
+{
+    const IOProfile *profile = NULL;
+    ssize_t index = mOutputs.indexOfKey(io);
+    if (index >= 0) {
+        profile = mOutputs.valueAt(index)->mProfile;
+    } else {
+        index = mInputs.indexOfKey(io);
+        if (index >= 0) {
+            profile = mInputs.valueAt(index)->mProfile;
+        }
+    }
+    if (profile == NULL || profile->mModule == NULL) {
+        return AUDIO_MODULE_HANDLE_NONE;
+    }
+    return profile->mModule->mHandle;
+}
+
+bool AudioPolicyManagerBase::checkEffectBudgets(audio_io_handle_t io,
+                                                uint32_t cpuLoad,
+                                                uint32_t memory) const
+{
+    EffectUsage usage;
+    ssize_t index = mEffectUsage.indexOfKey(io);
+    if (index >= 0) {
+        usage = mEffectUsage.valueAt(index);
+    }
+    if ((mMaxEffectsCpuLoadPerIo != 0 && usage.mCpuLoad + cpuLoad > mMaxEffectsCpuLoadPerIo) ||
+            (mMaxEffectsMemoryPerIo != 0 && usage.mMemory + memory > mMaxEffectsMemoryPerIo)) {
+        ALOGV("checkEffectBudgets() io %d CPU %u memory %u over budget", io,
+              usage.mCpuLoad + cpuLoad, usage.mMemory + memory);
+        return false;
+    }
+
+    audio_module_handle_t module = getModuleForIo(io);
+    if (module == AUDIO_MODULE_HANDLE_NONE) {
+        return true;
+    }
+    usage = EffectUsage();
+    index = mModuleEffectUsage.indexOfKey(module);
+    if (index >= 0) {
+        usage = mModuleEffectUsage.valueAt(index);
+    }
+    if ((mMaxEffectsCpuLoadPerModule != 0 &&
+                usage.mCpuLoad + cpuLoad > mMaxEffectsCpuLoadPerModule) ||
+            (mMaxEffectsMemoryPerModule != 0 &&
+                usage.mMemory + memory > mMaxEffectsMemoryPerModule)) {
+        ALOGV("checkEffectBudgets() module %d CPU %u memory %u over budget", module,
+              usage.mCpuLoad + cpuLoad, usage.mMemory + memory);
+        return false;
+    }
+    return true;
 }
 
 bool AudioPolicyManagerBase::isStreamActive(int stream, uint32_t inPastMs) const
@@ -1367,6 +1750,40 @@ bool AudioPolicyManagerBase::isStreamActiveRemotely(int stream, uint32_t inPastM
     return false;
 }
 
+bool AudioPolicyManagerBase::isStreamActiveSnapshot(int stream, uint32_t inPastMs) const
+{
+    if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+        return false;
+    }
+    uint32_t refCount;
+    nsecs_t stopTime;
+    int32_t seq;
+    do {
+        seq = android_atomic_acquire_load(&mSnapshotSeq);
+        refCount = mSnapshot.mRefCount[stream];
+        stopTime = mSnapshot.mStopTime[stream];
+    } while ((seq & 1) || (android_atomic_release_load(&mSnapshotSeq) != seq));
+
+    return isSnapshotStreamActive(refCount, stopTime, inPastMs);
+}
+
+bool AudioPolicyManagerBase::isStreamActiveRemotelySnapshot(int stream, uint32_t inPastMs) const
+{
+    if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+        return false;
+    }
+    uint32_t refCount;
+    nsecs_t stopTime;
+    int32_t seq;
+    do {
+        seq = android_atomic_acquire_load(&mSnapshotSeq);
+        refCount = mSnapshot.mRemoteRefCount[stream];
+        stopTime = mSnapshot.mRemoteStopTime[stream];
+    } while ((seq & 1) || (android_atomic_release_load(&mSnapshotSeq) != seq));
+
+    return isSnapshotStreamActive(refCount, stopTime, inPastMs);
+}
+
 bool AudioPolicyManagerBase::isSourceActive(audio_source_t source) const
 {
     for (size_t i = 0; i < mInputs.size(); i++) {
@@ -1388,6 +1805,24 @@ status_t AudioPolicyManagerBase::dump(int fd)
     char buffer[SIZE];
     String8 result;
 
+    // the statistics are cleared once each time property audio.policy.dump.reset is given a new
+    // value, e.g. "setprop audio.policy.dump.reset $(date +%s)", not at every dump
+    char propValue[PROPERTY_VALUE_MAX];
+    bool resetStats = false;
+    if (property_get("audio.policy.dump.reset", propValue, "") > 0 &&
+            mApiStatsResetToken != propValue) {
+        mApiStatsResetToken = propValue;
+        resetStats = true;
+    }
+    if (property_get("audio.policy.dump.format", propValue, NULL) &&
+            strcmp(propValue, "json") == 0) {
+        status_t status = dumpJson(fd);
+        if (resetStats) {
+            resetApiStats();
+        }
+        return status;
+    }
+
     snprintf(buffer, SIZE, "\nAudioPolicyManager Dump: %p\n", this);
     result.append(buffer);
 
@@ -1415,6 +1850,28 @@ status_t AudioPolicyManagerBase::dump(int fd)
     result.append(buffer);
     snprintf(buffer, SIZE, " Force use for system %d\n", mForceUse[AudioSystem::FOR_SYSTEM]);
     result.append(buffer);
+    snprintf(buffer, SIZE, " Device for strategy cache: %u hits, %u recomputes\n",
+             mDeviceForStrategyHits, mDeviceForStrategyRecomputes);
+    result.append(buffer);
+    snprintf(buffer, SIZE, " Routing transactions: %u committed, %u deferred changes\n",
+             mRoutingTransactionCount, mRoutingTransactionDeferred);
+    result.append(buffer);
+    snprintf(buffer, SIZE, " getOutput cache: %u hits, %u misses\n",
+             mOutputCacheHits, mOutputCacheMisses);
+    result.append(buffer);
+    snprintf(buffer, SIZE, " Volume ramps: %u ms %s, %u scheduled, %u superseded\n",
+             mVolumeRampMs, sVolumeRampCurveNames[mVolumeRampCurve], mVolumeRampCount,
+             mVolumeRampSuperseded);
+    result.append(buffer);
+    snprintf(buffer, SIZE, " Descriptor pools (used/capacity, peak, heap allocations):"
+             " outputs %u/%u, %u, %u; inputs %u/%u, %u, %u; effects %u/%u, %u, %u\n",
+             sOutputDescPool.used(), sOutputDescPool.capacity(), sOutputDescPool.peak(),
+             sOutputDescPool.overflows(),
+             sInputDescPool.used(), sInputDescPool.capacity(), sInputDescPool.peak(),
+             sInputDescPool.overflows(),
+             sEffectDescPool.used(), sEffectDescPool.capacity(), sEffectDescPool.peak(),
+             sEffectDescPool.overflows());
+    result.append(buffer);
     write(fd, result.string(), result.size());
 
 
@@ -1457,6 +1914,34 @@ status_t AudioPolicyManagerBase::dump(int fd)
             (float)mTotalEffectsCpuLoad/10, mTotalEffectsMemory);
     write(fd, buffer, strlen(buffer));
 
+    snprintf(buffer, SIZE, "Effects budgets: per I/O CPU %f MIPS, memory %u KB;"
+             " per HW module CPU %f MIPS, memory %u KB (0: unlimited)\n",
+             (float)mMaxEffectsCpuLoadPerIo/10, mMaxEffectsMemoryPerIo,
+             (float)mMaxEffectsCpuLoadPerModule/10, mMaxEffectsMemoryPerModule);
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, SIZE, "Effects usage per I/O (%u non offloadable enabled):\n",
+             mNonOffloadableEffectsEnabled);
+    write(fd, buffer, strlen(buffer));
+    for (size_t i = 0; i < mEffectUsage.size(); i++) {
+        const EffectUsage& usage = mEffectUsage.valueAt(i);
+        snprintf(buffer, SIZE, " I/O %d: CPU %f MIPS, memory %u KB, non offloadable %u\n",
+                 mEffectUsage.keyAt(i), (float)usage.mCpuLoad/10, usage.mMemory,
+                 usage.mNonOffloadableCount);
+        write(fd, buffer, strlen(buffer));
+    }
+    for (size_t i = 0; i < mModuleEffectUsage.size(); i++) {
+        const EffectUsage& usage = mModuleEffectUsage.valueAt(i);
+        snprintf(buffer, SIZE, " HW module %d: CPU %f MIPS, memory %u KB\n",
+                 mModuleEffectUsage.keyAt(i), (float)usage.mCpuLoad/10, usage.mMemory);
+        write(fd, buffer, strlen(buffer));
+    }
+    for (size_t i = 0; i < mNonOffloadableEffectsPerSession.size(); i++) {
+        snprintf(buffer, SIZE, " Session %d: non offloadable %u\n",
+                 mNonOffloadableEffectsPerSession.keyAt(i),
+                 mNonOffloadableEffectsPerSession.valueAt(i));
+        write(fd, buffer, strlen(buffer));
+    }
+
     snprintf(buffer, SIZE, "Registered effects:\n");
     write(fd, buffer, strlen(buffer));
     for (size_t i = 0; i < mEffects.size(); i++) {
@@ -1465,19 +1950,611 @@ status_t AudioPolicyManagerBase::dump(int fd)
         mEffects.valueAt(i)->dump(fd);
     }
 
+    snprintf(buffer, SIZE, "\nAPI calls:\n");
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, SIZE, " %-28s %10s %12s %10s\n", "API", "Count", "Avg (us)", "Max (us)");
+    write(fd, buffer, strlen(buffer));
+    for (int i = 0; i < NUM_APIS; i++) {
+        const ApiStats& stats = mApiStats[i];
+        snprintf(buffer, SIZE, " %-28s %10u %12.1f %10.1f\n",
+                 sApiNames[i], stats.mCount,
+                 stats.mCount != 0 ? (double)stats.mTotalTime / stats.mCount / 1000 : 0.0,
+                 (double)stats.mMaxTime / 1000);
+        write(fd, buffer, strlen(buffer));
+    }
+
+    result.setTo("\nAPI call latency histograms (us):\n ");
+    snprintf(buffer, SIZE, "%-28s", "API");
+    result.append(buffer);
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        if (i == NUM_LATENCY_BUCKETS - 1) {
+            snprintf(buffer, SIZE, " >=%-5u", 1u << (i - 1));
+        } else {
+            snprintf(buffer, SIZE, " <%-6u", 1u << i);
+        }
+        result.append(buffer);
+    }
+    result.append("\n");
+    for (int i = 0; i < NUM_APIS; i++) {
+        const ApiStats& stats = mApiStats[i];
+        if (stats.mCount == 0) {
+            continue;
+        }
+        snprintf(buffer, SIZE, " %-28s", sApiNames[i]);
+        result.append(buffer);
+        for (int j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+            snprintf(buffer, SIZE, " %-7u", stats.mHistogram[j]);
+            result.append(buffer);
+        }
+        result.append("\n");
+    }
+    write(fd, result.string(), result.size());
+
+    if (mTrace != NULL) {
+        dumpTrace(fd);
+    }
 
+    if (resetStats) {
+        resetApiStats();
+    }
     return NO_ERROR;
 }
 
-// This function checks for the parameters which can be offloaded.
-// This can be enhanced depending on the capability of the DSP and policy
-// of the system.
-bool AudioPolicyManagerBase::isOffloadSupported(const audio_offload_info_t& offloadInfo)
+void AudioPolicyManagerBase::traceEvent(trace_event_type type,
+                                        int32_t arg0, int32_t arg1, int32_t arg2,
+                                        int32_t arg3, int32_t arg4, int32_t arg5)
 {
-    ALOGV("isOffloadSupported: SR=%u, CM=0x%x, Format=0x%x, StreamType=%d,"
-     " BitRate=%u, duration=%" PRId64 " us, has_video=%d",
-     offloadInfo.sample_rate, offloadInfo.channel_mask,
-     offloadInfo.format,
+    traceStringEvent(type, "", arg0, arg1, arg2, arg3, arg4, arg5);
+}
+
+void AudioPolicyManagerBase::traceStringEvent(trace_event_type type, const char *string,
+                                              int32_t arg0, int32_t arg1, int32_t arg2,
+                                              int32_t arg3, int32_t arg4, int32_t arg5)
+{
+    if (mTrace == NULL) {
+        return;
+    }
+    // calls made while handling another call are replayed by replaying the outer call
+    if (type < TRACE_CMD_LOAD_HW_MODULE && mApiDepth > 1) {
+        return;
+    }
+    AutoMutex _l(mTraceLock);
+    TraceEvent& event = mTrace[mTraceCount % TRACE_SIZE];
+    event.mTime = systemTime();
+    event.mType = type;
+    event.mArgs[0] = arg0;
+    event.mArgs[1] = arg1;
+    event.mArgs[2] = arg2;
+    event.mArgs[3] = arg3;
+    event.mArgs[4] = arg4;
+    event.mArgs[5] = arg5;
+    strncpy(event.mString, string, TRACE_STRING_LEN);
+    event.mString[TRACE_STRING_LEN - 1] = '\0';
+    mTraceCount++;
+}
+
+void AudioPolicyManagerBase::dumpTrace(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    mTraceLock.lock();
+    uint32_t first = (mTraceCount > TRACE_SIZE) ? mTraceCount - TRACE_SIZE : 0;
+    snprintf(buffer, SIZE, "\nEvent trace: %u events, %u dropped\n", mTraceCount, first);
+    result.append(buffer);
+    for (uint32_t i = first; i < mTraceCount; i++) {
+        const TraceEvent& event = mTrace[i % TRACE_SIZE];
+        const int32_t *args = event.mArgs;
+        long long sec = event.mTime / 1000000000;
+        long long usec = ns2us(event.mTime % 1000000000);
+        switch (event.mType) {
+        case TRACE_CONNECT:
+        case TRACE_DISCONNECT:
+            snprintf(buffer, SIZE, "%s 0x%x %s # %lld.%06lld\n",
+                     event.mType == TRACE_CONNECT ? "connect" : "disconnect", args[0],
+                     event.mString, sec, usec);
+            break;
+        case TRACE_PHONE_STATE:
+            snprintf(buffer, SIZE, "phone %d # %lld.%06lld\n", args[0], sec, usec);
+            break;
+        case TRACE_FORCE_USE:
+            snprintf(buffer, SIZE, "force %d %d # %lld.%06lld\n", args[0], args[1], sec, usec);
+            break;
+        case TRACE_INIT_STREAM_VOLUME:
+            snprintf(buffer, SIZE, "init %d %d %d # %lld.%06lld\n",
+                     args[0], args[1], args[2], sec, usec);
+            break;
+        case TRACE_GET_OUTPUT:
+            snprintf(buffer, SIZE, "output %d %d %u 0x%x 0x%x 0x%x # %lld.%06lld\n",
+                     args[0], args[1], args[2], args[3], args[4], args[5], sec, usec);
+            break;
+        case TRACE_START_OUTPUT:
+        case TRACE_STOP_OUTPUT:
+            snprintf(buffer, SIZE, "%s %d %d %d # %lld.%06lld\n",
+                     event.mType == TRACE_START_OUTPUT ? "start" : "stop",
+                     args[0], args[1], args[2], sec, usec);
+            break;
+        case TRACE_RELEASE_OUTPUT:
+            snprintf(buffer, SIZE, "release %d # %lld.%06lld\n", args[0], sec, usec);
+            break;
+        case TRACE_GET_INPUT:
+            snprintf(buffer, SIZE, "input %d %d %u 0x%x 0x%x 0x%x # %lld.%06lld\n",
+                     args[0], args[1], args[2], args[3], args[4], args[5], sec, usec);
+            break;
+        case TRACE_START_INPUT:
+        case TRACE_STOP_INPUT:
+        case TRACE_RELEASE_INPUT:
+            snprintf(buffer, SIZE, "%s %d # %lld.%06lld\n",
+                     event.mType == TRACE_START_INPUT ? "start_input" :
+                             event.mType == TRACE_STOP_INPUT ? "stop_input" : "release_input",
+                     args[0], sec, usec);
+            break;
+        case TRACE_SET_VOLUME_INDEX:
+            snprintf(buffer, SIZE, "volume %d %d 0x%x # %lld.%06lld\n",
+                     args[0], args[1], args[2], sec, usec);
+            break;
+        case TRACE_REGISTER_EFFECT:
+            snprintf(buffer, SIZE, "effect %d %d %d %d 0x%x %d %d # %lld.%06lld\n",
+                     args[0], args[1], args[2], args[3], args[4],
+                     (uint32_t)args[5] >> 16, args[5] & 0xffff, sec, usec);
+            break;
+        case TRACE_UNREGISTER_EFFECT:
+            snprintf(buffer, SIZE, "unregister_effect %d # %lld.%06lld\n", args[0], sec, usec);
+            break;
+        case TRACE_SET_EFFECT_ENABLED:
+            snprintf(buffer, SIZE, "enable_effect %d %d # %lld.%06lld\n",
+                     args[0], args[1], sec, usec);
+            break;
+        case TRACE_BEGIN_TRANSACTION:
+        case TRACE_COMMIT_TRANSACTION:
+            snprintf(buffer, SIZE, "%s # %lld.%06lld\n",
+                     event.mType == TRACE_BEGIN_TRANSACTION ? "begin" : "commit", sec, usec);
+            break;
+        case TRACE_CMD_LOAD_HW_MODULE:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> load module %s handle %d\n",
+                     sec, usec, event.mString, args[0]);
+            break;
+        case TRACE_CMD_OPEN_OUTPUT:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> open output %d module %d device 0x%x "
+                     "rate %u format 0x%x flags 0x%x\n",
+                     sec, usec, args[0], args[1], args[2], args[3], args[4], args[5]);
+            break;
+        case TRACE_CMD_OPEN_DUPLICATE_OUTPUT:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> open output %d duplicating %d %d\n",
+                     sec, usec, args[0], args[1], args[2]);
+            break;
+        case TRACE_CMD_CLOSE_OUTPUT:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> close output %d\n", sec, usec, args[0]);
+            break;
+        case TRACE_CMD_SUSPEND_OUTPUT:
+        case TRACE_CMD_RESTORE_OUTPUT:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> %s output %d\n", sec, usec,
+                     event.mType == TRACE_CMD_SUSPEND_OUTPUT ? "suspend" : "restore", args[0]);
+            break;
+        case TRACE_CMD_OPEN_INPUT:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> open input %d module %d device 0x%x "
+                     "rate %u format 0x%x channels 0x%x\n",
+                     sec, usec, args[0], args[1], args[2], args[3], args[4], args[5]);
+            break;
+        case TRACE_CMD_CLOSE_INPUT:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> close input %d\n", sec, usec, args[0]);
+            break;
+        case TRACE_CMD_ROUTING:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> routing io %d device 0x%x delay %d\n",
+                     sec, usec, args[0], args[1], args[2]);
+            break;
+        case TRACE_CMD_PARAMETERS:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> parameters io %d %s delay %d\n",
+                     sec, usec, args[0], event.mString, args[1]);
+            break;
+        case TRACE_CMD_VOLUME:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> volume stream %d output %d volume %.3f "
+                     "delay %d\n", sec, usec, args[0], args[1], (float)args[2] / 1000, args[3]);
+            break;
+        case TRACE_CMD_VOICE_VOLUME:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> voice volume %.3f delay %d\n",
+                     sec, usec, (float)args[0] / 1000, args[1]);
+            break;
+        case TRACE_CMD_INVALIDATE_STREAM:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> invalidate stream %d\n", sec, usec, args[0]);
+            break;
+        case TRACE_CMD_START_TONE:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> start tone %d stream %d\n",
+                     sec, usec, args[0], args[1]);
+            break;
+        case TRACE_CMD_STOP_TONE:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> stop tone\n", sec, usec);
+            break;
+        case TRACE_CMD_MOVE_EFFECTS:
+            snprintf(buffer, SIZE, "# %lld.%06lld -> move effects session %d from %d to %d\n",
+                     sec, usec, args[0], args[1], args[2]);
+            break;
+        }
+        result.append(buffer);
+    }
+    mTraceLock.unlock();
+    // a complete trace replays from boot: close it with the current routing so the replay can
+    // check it reaches the same state
+    if (first == 0) {
+        for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+            snprintf(buffer, SIZE, "expect %d 0x%x\n", i,
+                     getDevicesForStream((AudioSystem::stream_type)i));
+            result.append(buffer);
+        }
+    }
+    write(fd, result.string(), result.size());
+}
+
+void AudioPolicyManagerBase::resetApiStats()
+{
+    memset(mApiStats, 0, sizeof(mApiStats));
+}
+
+void AudioPolicyManagerBase::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    int valueInt;
+
+    if (param.getInt(String8(AUDIO_POLICY_RESET_STATS_KEY), valueInt) == NO_ERROR &&
+            valueInt != 0) {
+        ALOGV("setParameters() API statistics reset");
+        resetApiStats();
+    }
+#ifdef AUDIO_POLICY_TEST
+    if (param.getInt(String8("test_cmd_policy"), valueInt) == NO_ERROR) {
+        AutoMutex _l(mLock);
+        mTestCommands.add(keyValuePairs);
+        mWaitWorkCV.signal();
+    }
+#endif //AUDIO_POLICY_TEST
+}
+
+status_t AudioPolicyManagerBase::dumpJson(int fd)
+{
+    // the whole dump is formatted before being written in one call
+    String8 result;
+
+    result.appendFormat("{\"primaryOutput\":%d", mPrimaryOutput);
+    result.append(",\"a2dpDeviceAddress\":");
+    appendJsonString(result, mA2dpDeviceAddress.string());
+    result.append(",\"scoDeviceAddress\":");
+    appendJsonString(result, mScoDeviceAddress.string());
+    result.append(",\"usbOutCardAndDevice\":");
+    appendJsonString(result, mUsbOutCardAndDevice.string());
+    result.appendFormat(",\"outputDevices\":%u,\"inputDevices\":%u,\"phoneState\":%d",
+                        mAvailableOutputDevices, mAvailableInputDevices, mPhoneState);
+    result.append(",\"forceUse\":[");
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        result.appendFormat("%s%d", i == 0 ? "" : ",", mForceUse[i]);
+    }
+    result.append("],\"deviceForStrategy\":[");
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        result.appendFormat("%s%u", i == 0 ? "" : ",", mDeviceForStrategy[i]);
+    }
+    result.appendFormat("],\"strategyCache\":{\"hits\":%u,\"recomputes\":%u}",
+                        mDeviceForStrategyHits, mDeviceForStrategyRecomputes);
+    result.appendFormat(",\"routingTransactions\":{\"committed\":%u,\"deferred\":%u}",
+                        mRoutingTransactionCount, mRoutingTransactionDeferred);
+    result.appendFormat(",\"outputCache\":{\"hits\":%u,\"misses\":%u}",
+                        mOutputCacheHits, mOutputCacheMisses);
+    result.appendFormat(",\"volumeRamps\":{\"durationMs\":%u,\"curve\":\"%s\","
+                        "\"scheduled\":%u,\"superseded\":%u}",
+                        mVolumeRampMs, sVolumeRampCurveNames[mVolumeRampCurve], mVolumeRampCount,
+                        mVolumeRampSuperseded);
+    result.appendFormat(",\"descriptorPools\":{"
+                        "\"outputs\":{\"used\":%u,\"capacity\":%u,\"peak\":%u,\"overflows\":%u},"
+                        "\"inputs\":{\"used\":%u,\"capacity\":%u,\"peak\":%u,\"overflows\":%u},"
+                        "\"effects\":{\"used\":%u,\"capacity\":%u,\"peak\":%u,\"overflows\":%u}}",
+                        sOutputDescPool.used(), sOutputDescPool.capacity(),
+                        sOutputDescPool.peak(), sOutputDescPool.overflows(),
+                        sInputDescPool.used(), sInputDescPool.capacity(),
+                        sInputDescPool.peak(), sInputDescPool.overflows(),
+                        sEffectDescPool.used(), sEffectDescPool.capacity(),
+                        sEffectDescPool.peak(), sEffectDescPool.overflows());
+
+    result.append(",\"hwModules\":[");
+    for (size_t i = 0; i < mHwModules.size(); i++) {
+        if (i != 0) {
+            result.append(",");
+        }
+        mHwModules[i]->dumpJson(result);
+    }
+    result.append("],\"outputs\":[");
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        result.appendFormat("%s{\"id\":%d,", i == 0 ? "" : ",", mOutputs.keyAt(i));
+        mOutputs.valueAt(i)->dumpJson(result);
+        result.append("}");
+    }
+    result.append("],\"inputs\":[");
+    for (size_t i = 0; i < mInputs.size(); i++) {
+        result.appendFormat("%s{\"id\":%d,", i == 0 ? "" : ",", mInputs.keyAt(i));
+        mInputs.valueAt(i)->dumpJson(result);
+        result.append("}");
+    }
+    result.append("],\"streams\":[");
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        if (i != 0) {
+            result.append(",");
+        }
+        mStreams[i].dumpJson(result);
+    }
+    result.appendFormat("],\"effectsCpuLoad\":%u,\"effectsMemory\":%u,\"effects\":[",
+                        mTotalEffectsCpuLoad, mTotalEffectsMemory);
+    for (size_t i = 0; i < mEffects.size(); i++) {
+        result.appendFormat("%s{\"id\":%d,", i == 0 ? "" : ",", mEffects.keyAt(i));
+        mEffects.valueAt(i)->dumpJson(result);
+        result.append("}");
+    }
+    result.appendFormat("],\"nonOffloadableEffects\":%u,\"effectUsage\":[",
+                        mNonOffloadableEffectsEnabled);
+    for (size_t i = 0; i < mEffectUsage.size(); i++) {
+        const EffectUsage& usage = mEffectUsage.valueAt(i);
+        result.appendFormat("%s{\"io\":%d,\"cpuLoad\":%u,\"memory\":%u,\"nonOffloadable\":%u}",
+                            i == 0 ? "" : ",", mEffectUsage.keyAt(i), usage.mCpuLoad,
+                            usage.mMemory, usage.mNonOffloadableCount);
+    }
+    result.appendFormat("],\"effectBudgets\":{\"cpuLoadPerIo\":%u,\"memoryPerIo\":%u,"
+                        "\"cpuLoadPerModule\":%u,\"memoryPerModule\":%u},\"moduleEffectUsage\":[",
+                        mMaxEffectsCpuLoadPerIo, mMaxEffectsMemoryPerIo,
+                        mMaxEffectsCpuLoadPerModule, mMaxEffectsMemoryPerModule);
+    for (size_t i = 0; i < mModuleEffectUsage.size(); i++) {
+        const EffectUsage& usage = mModuleEffectUsage.valueAt(i);
+        result.appendFormat("%s{\"module\":%d,\"cpuLoad\":%u,\"memory\":%u}",
+                            i == 0 ? "" : ",", mModuleEffectUsage.keyAt(i), usage.mCpuLoad,
+                            usage.mMemory);
+    }
+    result.append("],\"apis\":[");
+    for (int i = 0; i < NUM_APIS; i++) {
+        const ApiStats& stats = mApiStats[i];
+        result.appendFormat("%s{\"name\":\"%s\",\"count\":%u,\"totalNs\":%lld,\"maxNs\":%lld,"
+                            "\"histogram\":[",
+                            i == 0 ? "" : ",", sApiNames[i], stats.mCount,
+                            (long long)stats.mTotalTime, (long long)stats.mMaxTime);
+        for (int j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+            result.appendFormat("%s%u", j == 0 ? "" : ",", stats.mHistogram[j]);
+        }
+        result.append("]}");
+    }
+    result.append("],\"trace\":[");
+    mTraceLock.lock();
+    uint32_t first = (mTraceCount > TRACE_SIZE) ? mTraceCount - TRACE_SIZE : 0;
+    for (uint32_t i = first; i < mTraceCount; i++) {
+        const TraceEvent& event = mTrace[i % TRACE_SIZE];
+        result.appendFormat("%s{\"t\":%lld,\"type\":%d,\"args\":[%d,%d,%d,%d,%d,%d]",
+                            i == first ? "" : ",", (long long)event.mTime, event.mType,
+                            event.mArgs[0], event.mArgs[1], event.mArgs[2], event.mArgs[3],
+                            event.mArgs[4], event.mArgs[5]);
+        if (event.mString[0] != '\0') {
+            result.append(",\"string\":");
+            appendJsonString(result, event.mString);
+        }
+        result.append("}");
+    }
+    mTraceLock.unlock();
+    result.append("]}\n");
+
+    write(fd, result.string(), result.size());
+    return NO_ERROR;
+}
+
+void AudioPolicyManagerBase::appendJsonString(String8& result, const char *str)
+{
+    result.append("\"");
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            result.appendFormat("\\%c", c);
+        } else if (c < 0x20) {
+            result.appendFormat("\\u%04x", c);
+        } else {
+            result.append((const char *)&c, 1);
+        }
+    }
+    result.append("\"");
+}
+
+// --- ApiTimer class implementation
+
+const char * const AudioPolicyManagerBase::sApiNames[AudioPolicyManagerBase::NUM_APIS] = {
+    "setDeviceConnectionState",
+    "setPhoneState",
+    "setForceUse",
+    "commitRoutingTransaction",
+    "getOutput",
+    "startOutput",
+    "stopOutput",
+    "releaseOutput",
+    "getInput",
+    "startInput",
+    "stopInput",
+    "releaseInput",
+    "initStreamVolume",
+    "setStreamVolumeIndex",
+    "getOutputForEffect",
+    "registerEffect",
+    "unregisterEffect",
+    "setEffectEnabled",
+    "isOffloadSupported",
+};
+
+AudioPolicyManagerBase::ApiTimer::ApiTimer(AudioPolicyManagerBase *apm, api_id api)
+    : mApm(apm), mApi(api), mStartTime(systemTime())
+{
+    mApm->mApiDepth++;
+}
+
+AudioPolicyManagerBase::ApiTimer::~ApiTimer()
+{
+    mApm->mApiDepth--;
+    nsecs_t duration = systemTime() - mStartTime;
+    ApiStats& stats = mApm->mApiStats[mApi];
+    stats.mCount++;
+    stats.mTotalTime += duration;
+    if (duration > stats.mMaxTime) {
+        stats.mMaxTime = duration;
+    }
+    nsecs_t us = ns2us(duration);
+    int bucket;
+    if (us <= 0) {
+        bucket = 0;
+    } else if (us >= (1 << (NUM_LATENCY_BUCKETS - 2))) {
+        bucket = NUM_LATENCY_BUCKETS - 1;
+    } else {
+        bucket = 32 - __builtin_clz((uint32_t)us);
+    }
+    stats.mHistogram[bucket]++;
+}
+
+// --- TraceClient class implementation
+
+audio_module_handle_t AudioPolicyManagerBase::TraceClient::loadHwModule(const char *name)
+{
+    audio_module_handle_t module = mClient->loadHwModule(name);
+    mApm->traceStringEvent(TRACE_CMD_LOAD_HW_MODULE, name, module);
+    return module;
+}
+
+audio_io_handle_t AudioPolicyManagerBase::TraceClient::openOutput(audio_module_handle_t module,
+                                                   audio_devices_t *pDevices,
+                                                   uint32_t *pSamplingRate,
+                                                   audio_format_t *pFormat,
+                                                   audio_channel_mask_t *pChannelMask,
+                                                   uint32_t *pLatencyMs,
+                                                   audio_output_flags_t flags,
+                                                   const audio_offload_info_t *offloadInfo)
+{
+    audio_io_handle_t output = mClient->openOutput(module, pDevices, pSamplingRate, pFormat,
+                                                   pChannelMask, pLatencyMs, flags, offloadInfo);
+    mApm->traceEvent(TRACE_CMD_OPEN_OUTPUT, output, module, *pDevices, *pSamplingRate, *pFormat,
+                     flags);
+    return output;
+}
+
+audio_io_handle_t AudioPolicyManagerBase::TraceClient::openDuplicateOutput(
+                                                            audio_io_handle_t output1,
+                                                            audio_io_handle_t output2)
+{
+    audio_io_handle_t output = mClient->openDuplicateOutput(output1, output2);
+    mApm->traceEvent(TRACE_CMD_OPEN_DUPLICATE_OUTPUT, output, output1, output2);
+    return output;
+}
+
+status_t AudioPolicyManagerBase::TraceClient::closeOutput(audio_io_handle_t output)
+{
+    mApm->traceEvent(TRACE_CMD_CLOSE_OUTPUT, output);
+    return mClient->closeOutput(output);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::suspendOutput(audio_io_handle_t output)
+{
+    mApm->traceEvent(TRACE_CMD_SUSPEND_OUTPUT, output);
+    return mClient->suspendOutput(output);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::restoreOutput(audio_io_handle_t output)
+{
+    mApm->traceEvent(TRACE_CMD_RESTORE_OUTPUT, output);
+    return mClient->restoreOutput(output);
+}
+
+audio_io_handle_t AudioPolicyManagerBase::TraceClient::openInput(audio_module_handle_t module,
+                                                  audio_devices_t *pDevices,
+                                                  uint32_t *pSamplingRate,
+                                                  audio_format_t *pFormat,
+                                                  audio_channel_mask_t *pChannelMask)
+{
+    audio_io_handle_t input = mClient->openInput(module, pDevices, pSamplingRate, pFormat,
+                                                 pChannelMask);
+    mApm->traceEvent(TRACE_CMD_OPEN_INPUT, input, module, *pDevices, *pSamplingRate, *pFormat,
+                     *pChannelMask);
+    return input;
+}
+
+status_t AudioPolicyManagerBase::TraceClient::closeInput(audio_io_handle_t input)
+{
+    mApm->traceEvent(TRACE_CMD_CLOSE_INPUT, input);
+    return mClient->closeInput(input);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::setStreamVolume(AudioSystem::stream_type stream,
+                                                              float volume,
+                                                              audio_io_handle_t output,
+                                                              int delayMs)
+{
+    mApm->traceEvent(TRACE_CMD_VOLUME, stream, output, (int32_t)(volume * 1000), delayMs);
+    return mClient->setStreamVolume(stream, volume, output, delayMs);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::invalidateStream(AudioSystem::stream_type stream)
+{
+    mApm->traceEvent(TRACE_CMD_INVALIDATE_STREAM, stream);
+    return mClient->invalidateStream(stream);
+}
+
+void AudioPolicyManagerBase::TraceClient::setParameters(audio_io_handle_t ioHandle,
+                                                        const String8& keyValuePairs,
+                                                        int delayMs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    int device;
+    if (param.size() == 1 &&
+            param.getInt(String8(AudioParameter::keyRouting), device) == NO_ERROR) {
+        mApm->traceEvent(TRACE_CMD_ROUTING, ioHandle, device, delayMs);
+    } else {
+        mApm->traceStringEvent(TRACE_CMD_PARAMETERS, keyValuePairs.string(), ioHandle, delayMs);
+    }
+    mClient->setParameters(ioHandle, keyValuePairs, delayMs);
+}
+
+String8 AudioPolicyManagerBase::TraceClient::getParameters(audio_io_handle_t ioHandle,
+                                                           const String8& keys)
+{
+    return mClient->getParameters(ioHandle, keys);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::startTone(ToneGenerator::tone_type tone,
+                                                        AudioSystem::stream_type stream)
+{
+    mApm->traceEvent(TRACE_CMD_START_TONE, tone, stream);
+    return mClient->startTone(tone, stream);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::stopTone()
+{
+    mApm->traceEvent(TRACE_CMD_STOP_TONE);
+    return mClient->stopTone();
+}
+
+status_t AudioPolicyManagerBase::TraceClient::setVoiceVolume(float volume, int delayMs)
+{
+    mApm->traceEvent(TRACE_CMD_VOICE_VOLUME, (int32_t)(volume * 1000), delayMs);
+    return mClient->setVoiceVolume(volume, delayMs);
+}
+
+status_t AudioPolicyManagerBase::TraceClient::moveEffects(audio_session_t session,
+                                                          audio_io_handle_t srcOutput,
+                                                          audio_io_handle_t dstOutput)
+{
+    mApm->traceEvent(TRACE_CMD_MOVE_EFFECTS, session, srcOutput, dstOutput);
+    return mClient->moveEffects(session, srcOutput, dstOutput);
+}
+
+void AudioPolicyManagerBase::TraceClient::flushCommands()
+{
+    mClient->flushCommands();
+}
+
+// This function checks for the parameters which can be offloaded.
+// This can be enhanced depending on the capability of the DSP and policy
+// of the system.
+bool AudioPolicyManagerBase::isOffloadSupported(const audio_offload_info_t& offloadInfo)
+{
+    ApiTimer timer(this, API_IS_OFFLOAD_SUPPORTED);
+    ALOGV("isOffloadSupported: SR=%u, CM=0x%x, Format=0x%x, StreamType=%d,"
+     " BitRate=%u, duration=%" PRId64 " us, has_video=%d",
+     offloadInfo.sample_rate, offloadInfo.channel_mask,
+     offloadInfo.format,
      offloadInfo.stream_type, offloadInfo.bit_rate, offloadInfo.duration_us,
      offloadInfo.has_video);
 
@@ -1540,7 +2617,8 @@ bool AudioPolicyManagerBase::isOffloadSupported(const audio_offload_info_t& offl
 // AudioPolicyManagerBase
 // ----------------------------------------------------------------------------
 
-AudioPolicyManagerBase::AudioPolicyManagerBase(AudioPolicyClientInterface *clientInterface)
+AudioPolicyManagerBase::AudioPolicyManagerBase(AudioPolicyClientInterface *clientInterface,
+                                               const char *configFile)
     :
 #ifdef AUDIO_POLICY_TEST
     Thread(false),
@@ -1548,22 +2626,66 @@ AudioPolicyManagerBase::AudioPolicyManagerBase(AudioPolicyClientInterface *clien
     mPrimaryOutput((audio_io_handle_t)0),
     mAvailableOutputDevices(AUDIO_DEVICE_NONE),
     mPhoneState(AudioSystem::MODE_NORMAL),
-    mLimitRingtoneVolume(false), mLastVoiceVolume(-1.0f),
-    mTotalEffectsCpuLoad(0), mTotalEffectsMemory(0),
+    mLimitRingtoneVolume(false), mDeviceForStrategyValid(false),
+    mCachedAvailableOutputDevices(AUDIO_DEVICE_NONE), mCachedPhoneState(AudioSystem::MODE_NORMAL),
+    mCachedA2dpOutput(false), mDeviceForStrategyHits(0), mDeviceForStrategyRecomputes(0),
+    mLastVoiceVolume(-1.0f),
+    mTotalEffectsCpuLoad(0), mTotalEffectsMemory(0), mMaxEffectsCpuLoadPerIo(0),
+    mMaxEffectsMemoryPerIo(0), mMaxEffectsCpuLoadPerModule(0), mMaxEffectsMemoryPerModule(0),
+    mNonOffloadableEffectsEnabled(0),
     mA2dpSuspended(false), mHasA2dp(false), mHasUsb(false), mHasRemoteSubmix(false),
-    mSpeakerDrcEnabled(false)
+    mSpeakerDrcEnabled(false), mProfileIndexValid(false),
+    mOutputCacheHits(0), mOutputCacheMisses(0),
+    mRoutingTransactionDepth(0), mRoutingTransactionChanges(0),
+    mRoutingTransactionPhoneState(AudioSystem::MODE_NORMAL),
+    mRoutingTransactionCount(0), mRoutingTransactionDeferred(0),
+    mVolumeRampMs(0), mVolumeRampCurve(RAMP_CURVE_LINEAR), mVolumeRampCount(0),
+    mVolumeRampSuperseded(0),
+    mTraceCount(0), mTrace(NULL), mApiDepth(0), mSnapshotSeq(0)
 {
     mpClientInterface = clientInterface;
 
+    resetApiStats();
+    memset(mOutputSlots, 0, sizeof(mOutputSlots));
+    char propValue[PROPERTY_VALUE_MAX];
+    // a reset requested before the policy manager was created does not apply to its statistics
+    if (property_get("audio.policy.dump.reset", propValue, "") > 0) {
+        mApiStatsResetToken = propValue;
+    }
+    if (property_get("audio.policy.trace", propValue, "0") && atoi(propValue) != 0) {
+        mTrace = new TraceEvent[TRACE_SIZE];
+        mpClientInterface = new TraceClient(this, clientInterface);
+    }
+    if (property_get("audio.policy.volume_ramp_ms", propValue, "0")) {
+        mVolumeRampMs = (uint32_t)atoi(propValue);
+        if (mVolumeRampMs > VOLUME_RAMP_STEP_MS * MAX_VOLUME_RAMP_STEPS) {
+            mVolumeRampMs = VOLUME_RAMP_STEP_MS * MAX_VOLUME_RAMP_STEPS;
+        }
+    }
+    if (property_get("audio.policy.volume_ramp_curve", propValue, "linear")) {
+        mVolumeRampCurve = parseVolumeRampCurve(propValue);
+    }
+    if (mVolumeRampMs != 0) {
+        mVolumeRampThread = new VolumeRampThread(mpClientInterface, mVolumeRampCurve);
+        mVolumeRampThread->run("AudioPolicyVolumeRamp", ANDROID_PRIORITY_AUDIO);
+    }
+
     for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
         mForceUse[i] = AudioSystem::FORCE_NONE;
+        mCachedForceUse[i] = AudioSystem::FORCE_NONE;
     }
 
     mA2dpDeviceAddress = String8("");
     mScoDeviceAddress = String8("");
     mUsbOutCardAndDevice = String8("");
 
-    if (loadAudioPolicyConfig(AUDIO_POLICY_VENDOR_CONFIG_FILE) != NO_ERROR) {
+    if (configFile != NULL) {
+        if (loadAudioPolicyConfig(configFile) != NO_ERROR) {
+            ALOGE("could not load audio policy configuration file %s, setting defaults",
+                  configFile);
+            defaultAudioPolicyConfig();
+        }
+    } else if (loadAudioPolicyConfig(AUDIO_POLICY_VENDOR_CONFIG_FILE) != NO_ERROR) {
         if (loadAudioPolicyConfig(AUDIO_POLICY_CONFIG_FILE) != NO_ERROR) {
             ALOGE("could not load audio policy configuration file, setting defaults");
             defaultAudioPolicyConfig();
@@ -1625,7 +2747,9 @@ AudioPolicyManagerBase::AudioPolicyManagerBase(AudioPolicyClientInterface *clien
 
     ALOGE_IF((mPrimaryOutput == 0), "Failed to open primary output");
 
+    updateProfileIndex();
     updateDevicesAndOutputs();
+    publishSnapshot();
 
 #ifdef AUDIO_POLICY_TEST
     if (mPrimaryOutput != 0) {
@@ -1657,6 +2781,10 @@ AudioPolicyManagerBase::~AudioPolicyManagerBase()
 #ifdef AUDIO_POLICY_TEST
     exit();
 #endif //AUDIO_POLICY_TEST
+    if (mVolumeRampThread != 0) {
+        mVolumeRampThread->exit();
+        mVolumeRampThread.clear();
+    }
    for (size_t i = 0; i < mOutputs.size(); i++) {
         mpClientInterface->closeOutput(mOutputs.keyAt(i));
         delete mOutputs.valueAt(i);
@@ -1668,6 +2796,10 @@ AudioPolicyManagerBase::~AudioPolicyManagerBase()
    for (size_t i = 0; i < mHwModules.size(); i++) {
         delete mHwModules[i];
    }
+   if (mTrace != NULL) {
+        delete mpClientInterface;
+        delete[] mTrace;
+   }
 }
 
 status_t AudioPolicyManagerBase::initCheck()
@@ -1681,14 +2813,21 @@ bool AudioPolicyManagerBase::threadLoop()
     ALOGV("entering threadLoop()");
     while (!exitPending())
     {
-        String8 command;
         int valueInt;
         String8 value;
 
+        // test commands are only delivered by setParameters(): the legacy audio policy HAL has
+        // no set_parameters entry point and the audio HAL is not polled for them
         Mutex::Autolock _l(mLock);
-        mWaitWorkCV.waitRelative(mLock, milliseconds(50));
-
-        command = mpClientInterface->getParameters(0, String8("test_cmd_policy"));
+        if (mTestCommands.isEmpty()) {
+            // exit() requests the exit with mLock held: checking here cannot miss its signal
+            if (!exitPending()) {
+                mWaitWorkCV.wait(mLock);
+            }
+            continue;
+        }
+        String8 command = mTestCommands[0];
+        mTestCommands.removeAt(0);
         AudioParameter param = AudioParameter(command);
 
         if (param.getInt(String8("test_cmd_policy"), valueInt) == NO_ERROR &&
@@ -1776,8 +2915,8 @@ bool AudioPolicyManagerBase::threadLoop()
 
                 audio_module_handle_t moduleHandle = outputDesc->mModule->mHandle;
 
-                delete mOutputs.valueFor(mPrimaryOutput);
-                mOutputs.removeItem(mPrimaryOutput);
+                removeOutput(mPrimaryOutput);
+                delete outputDesc;
 
                 AudioOutputDescriptor *outputDesc = new AudioOutputDescriptor(NULL);
                 outputDesc->mDevice = AUDIO_DEVICE_OUT_SPEAKER;
@@ -1798,14 +2937,12 @@ bool AudioPolicyManagerBase::threadLoop()
                     addOutput(mPrimaryOutput, outputDesc);
                 }
             }
-
-
-            mpClientInterface->setParameters(0, String8("test_cmd_policy="));
         }
     }
     return false;
 }
 
+
 void AudioPolicyManagerBase::exit()
 {
     {
@@ -1830,7 +2967,76 @@ int AudioPolicyManagerBase::testOutputIndex(audio_io_handle_t output)
 void AudioPolicyManagerBase::addOutput(audio_io_handle_t id, AudioOutputDescriptor *outputDesc)
 {
     outputDesc->mId = id;
+    outputDesc->mSlot = MAX_OUTPUTS;
+    uint64_t freeSlots = ~mOpenOutputs.mSlots;
+    if (freeSlots != 0) {
+        outputDesc->mSlot = __builtin_ctzll(freeSlots);
+        mOutputSlots[outputDesc->mSlot] = outputDesc;
+        mOpenOutputs.add(outputDesc->mSlot);
+    } else {
+        ALOGE("addOutput() more than %u outputs open, output %d will not be selected",
+              MAX_OUTPUTS, id);
+    }
     mOutputs.add(id, outputDesc);
+    invalidateOutputCache();
+}
+
+void AudioPolicyManagerBase::removeOutput(audio_io_handle_t id)
+{
+    AudioOutputDescriptor *outputDesc = mOutputs.valueFor(id);
+    if (outputDesc == NULL) {
+        return;
+    }
+    if (mVolumeRampThread != 0) {
+        mVolumeRampThread->cancelRamps(id);
+    }
+    if (outputDesc->mSlot < MAX_OUTPUTS) {
+        mOutputSlots[outputDesc->mSlot] = NULL;
+        mOpenOutputs.remove(outputDesc->mSlot);
+        mPreviousOutputs.remove(outputDesc->mSlot);
+        outputDesc->mSlot = MAX_OUTPUTS;
+    }
+    mOutputs.removeItem(id);
+}
+
+AudioPolicyManagerBase::DescriptorPool<AudioPolicyManagerBase::AudioOutputDescriptor,
+                                       AudioPolicyManagerBase::MAX_OUTPUTS>
+        AudioPolicyManagerBase::sOutputDescPool;
+AudioPolicyManagerBase::DescriptorPool<AudioPolicyManagerBase::AudioInputDescriptor,
+                                       AudioPolicyManagerBase::INPUT_DESCRIPTOR_POOL_SIZE>
+        AudioPolicyManagerBase::sInputDescPool;
+AudioPolicyManagerBase::DescriptorPool<AudioPolicyManagerBase::EffectDescriptor,
+                                       AudioPolicyManagerBase::EFFECT_DESCRIPTOR_POOL_SIZE>
+        AudioPolicyManagerBase::sEffectDescPool;
+
+void *AudioPolicyManagerBase::AudioOutputDescriptor::operator new(size_t size)
+{
+    return sOutputDescPool.alloc(size);
+}
+
+void AudioPolicyManagerBase::AudioOutputDescriptor::operator delete(void *ptr)
+{
+    sOutputDescPool.release(ptr);
+}
+
+void *AudioPolicyManagerBase::AudioInputDescriptor::operator new(size_t size)
+{
+    return sInputDescPool.alloc(size);
+}
+
+void AudioPolicyManagerBase::AudioInputDescriptor::operator delete(void *ptr)
+{
+    sInputDescPool.release(ptr);
+}
+
+void *AudioPolicyManagerBase::EffectDescriptor::operator new(size_t size)
+{
+    return sEffectDescPool.alloc(size);
+}
+
+void AudioPolicyManagerBase::EffectDescriptor::operator delete(void *ptr)
+{
+    sEffectDescPool.release(ptr);
 }
 
 void AudioPolicyManagerBase::addInput(audio_io_handle_t id, AudioInputDescriptor *inputDesc)
@@ -2000,7 +3206,7 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                             ALOGW("checkOutputsForDevice() could not open dup output for %d and %d",
                                     mPrimaryOutput, output);
                             mpClientInterface->closeOutput(output);
-                            mOutputs.removeItem(output);
+                            removeOutput(output);
                             output = 0;
                         }
                     }
@@ -2017,6 +3223,9 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
             }
         }
 
+        // dynamic parameters may have been read from the outputs opened
+        mProfileIndexValid = false;
+
         if (profiles.isEmpty()) {
             ALOGW("checkOutputsForDevice(): No output available for device %04x", device);
             return BAD_VALUE;
@@ -2058,6 +3267,7 @@ status_t AudioPolicyManagerBase::checkOutputsForDevice(audio_devices_t device,
                 }
             }
         }
+        mProfileIndexValid = false;
     }
     return NO_ERROR;
 }
@@ -2191,6 +3401,9 @@ status_t AudioPolicyManagerBase::checkInputsForDevice(audio_devices_t device,
             }
         } // end scan profiles
 
+        // dynamic parameters may have been read from the inputs opened
+        mProfileIndexValid = false;
+
         if (profiles.isEmpty()) {
             ALOGW("checkInputsForDevice(): No input available for device 0x%X", device);
             return BAD_VALUE;
@@ -2235,6 +3448,7 @@ status_t AudioPolicyManagerBase::checkInputsForDevice(audio_devices_t device,
                 }
             }
         }
+        mProfileIndexValid = false;
     } // end disconnect
 
     return NO_ERROR;
@@ -2243,6 +3457,7 @@ status_t AudioPolicyManagerBase::checkInputsForDevice(audio_devices_t device,
 void AudioPolicyManagerBase::closeOutput(audio_io_handle_t output)
 {
     ALOGV("closeOutput(%d)", output);
+    invalidateOutputCache();
 
     AudioOutputDescriptor *outputDesc = mOutputs.valueFor(output);
     if (outputDesc == NULL) {
@@ -2274,8 +3489,8 @@ void AudioPolicyManagerBase::closeOutput(audio_io_handle_t output)
             ALOGV("closeOutput() closing also duplicated output %d", duplicatedOutput);
 
             mpClientInterface->closeOutput(duplicatedOutput);
-            delete mOutputs.valueFor(duplicatedOutput);
-            mOutputs.removeItem(duplicatedOutput);
+            removeOutput(duplicatedOutput);
+            delete dupOutputDesc;
         }
     }
 
@@ -2284,58 +3499,57 @@ void AudioPolicyManagerBase::closeOutput(audio_io_handle_t output)
     mpClientInterface->setParameters(output, param.toString());
 
     mpClientInterface->closeOutput(output);
+    removeOutput(output);
     delete outputDesc;
-    mOutputs.removeItem(output);
-    mPreviousOutputs = mOutputs;
+    mPreviousOutputs = mOpenOutputs;
 }
 
-SortedVector<audio_io_handle_t> AudioPolicyManagerBase::getOutputsForDevice(audio_devices_t device,
-                        DefaultKeyedVector<audio_io_handle_t, AudioOutputDescriptor *> openOutputs)
+uint32_t AudioPolicyManagerBase::OutputSet::next(uint32_t slot) const
 {
-    SortedVector<audio_io_handle_t> outputs;
-
-    ALOGVV("getOutputsForDevice() device %04x", device);
-    for (size_t i = 0; i < openOutputs.size(); i++) {
-        ALOGVV("output %d isDuplicated=%d device=%04x",
-                i, openOutputs.valueAt(i)->isDuplicated(), openOutputs.valueAt(i)->supportedDevices());
-        if ((device & openOutputs.valueAt(i)->supportedDevices()) == device) {
-            ALOGVV("getOutputsForDevice() found output %d", openOutputs.keyAt(i));
-            outputs.add(openOutputs.keyAt(i));
-        }
+    if (slot >= MAX_OUTPUTS - 1) {
+        return MAX_OUTPUTS;
     }
-    return outputs;
+    uint64_t slots = mSlots & (~(uint64_t)0 << (slot + 1));
+    return (slots == 0) ? MAX_OUTPUTS : __builtin_ctzll(slots);
 }
 
-bool AudioPolicyManagerBase::vectorsEqual(SortedVector<audio_io_handle_t>& outputs1,
-                                   SortedVector<audio_io_handle_t>& outputs2)
+AudioPolicyManagerBase::OutputSet AudioPolicyManagerBase::getOutputsForDevice(
+                                                                    audio_devices_t device,
+                                                                    const OutputSet& outputs)
 {
-    if (outputs1.size() != outputs2.size()) {
-        return false;
-    }
-    for (size_t i = 0; i < outputs1.size(); i++) {
-        if (outputs1[i] != outputs2[i]) {
-            return false;
+    OutputSet deviceOutputs;
+
+    ALOGVV("getOutputsForDevice() device %04x", device);
+    for (uint32_t slot = outputs.first(); slot < MAX_OUTPUTS; slot = outputs.next(slot)) {
+        // slots in mPreviousOutputs are released together with mOpenOutputs by removeOutput()
+        AudioOutputDescriptor *outputDesc = mOutputSlots[slot];
+        ALOGVV("output %d isDuplicated=%d device=%04x",
+                outputDesc->mId, outputDesc->isDuplicated(), outputDesc->supportedDevices());
+        if ((device & outputDesc->supportedDevices()) == device) {
+            ALOGVV("getOutputsForDevice() found output %d", outputDesc->mId);
+            deviceOutputs.add(slot);
         }
     }
-    return true;
+    return deviceOutputs;
 }
 
 void AudioPolicyManagerBase::checkOutputForStrategy(routing_strategy strategy)
 {
     audio_devices_t oldDevice = getDeviceForStrategy(strategy, true /*fromCache*/);
     audio_devices_t newDevice = getDeviceForStrategy(strategy, false /*fromCache*/);
-    SortedVector<audio_io_handle_t> srcOutputs = getOutputsForDevice(oldDevice, mPreviousOutputs);
-    SortedVector<audio_io_handle_t> dstOutputs = getOutputsForDevice(newDevice, mOutputs);
+    OutputSet srcOutputs = getOutputsForDevice(oldDevice, mPreviousOutputs);
+    OutputSet dstOutputs = getOutputsForDevice(newDevice, mOpenOutputs);
 
-    if (!vectorsEqual(srcOutputs,dstOutputs)) {
-        ALOGV("checkOutputForStrategy() strategy %d, moving from output %d to output %d",
-              strategy, srcOutputs[0], dstOutputs[0]);
+    if (srcOutputs != dstOutputs) {
+        ALOGV("checkOutputForStrategy() strategy %d, moving from outputs %llx to outputs %llx",
+              strategy, (unsigned long long)srcOutputs.mSlots,
+              (unsigned long long)dstOutputs.mSlots);
         // mute strategy while moving tracks from one output to another
-        for (size_t i = 0; i < srcOutputs.size(); i++) {
-            AudioOutputDescriptor *desc = mOutputs.valueFor(srcOutputs[i]);
+        for (uint32_t slot = srcOutputs.first(); slot < MAX_OUTPUTS; slot = srcOutputs.next(slot)) {
+            AudioOutputDescriptor *desc = mOutputSlots[slot];
             if (desc->isStrategyActive(strategy)) {
-                setStrategyMute(strategy, true, srcOutputs[i]);
-                setStrategyMute(strategy, false, srcOutputs[i], MUTE_TIME_MS, newDevice);
+                setStrategyMute(strategy, true, desc->mId);
+                setStrategyMute(strategy, false, desc->mId, MUTE_TIME_MS, newDevice);
             }
         }
 
@@ -2354,7 +3568,9 @@ void AudioPolicyManagerBase::checkOutputForStrategy(routing_strategy strategy)
                                                        fxOutput);
                         moved.add(desc->mIo);
                     }
+                    updateEffectUsage(desc, false);
                     desc->mIo = fxOutput;
+                    updateEffectUsage(desc, true);
                 }
             }
         }
@@ -2475,6 +3691,24 @@ audio_devices_t AudioPolicyManagerBase::getNewDevice(audio_io_handle_t output, b
     return device;
 }
 
+audio_devices_t AudioPolicyManagerBase::getDevicesForStreamSnapshot(
+                                                        AudioSystem::stream_type stream)
+{
+    // same range check as getDevicesForStream()
+    if (stream < (AudioSystem::stream_type) 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+        return AUDIO_DEVICE_NONE;
+    }
+    routing_strategy strategy = getStrategy(stream);
+    audio_devices_t devices;
+    int32_t seq;
+    do {
+        seq = android_atomic_acquire_load(&mSnapshotSeq);
+        devices = mSnapshot.mDeviceForStrategy[strategy];
+    } while ((seq & 1) || (android_atomic_release_load(&mSnapshotSeq) != seq));
+
+    return devices;
+}
+
 uint32_t AudioPolicyManagerBase::getStrategyForStream(AudioSystem::stream_type stream) {
     return (uint32_t)getStrategy(stream);
 }
@@ -2743,30 +3977,215 @@ audio_devices_t AudioPolicyManagerBase::getDeviceForStrategy(routing_strategy st
     return device;
 }
 
-void AudioPolicyManagerBase::updateDevicesAndOutputs()
+uint32_t AudioPolicyManagerBase::getStrategyDependencies(routing_strategy strategy,
+                                                         audio_devices_t *devices)
 {
-    for (int i = 0; i < NUM_STRATEGIES; i++) {
-        mDeviceForStrategy[i] = getDeviceForStrategy((routing_strategy)i, false /*fromCache*/);
-    }
-    mPreviousOutputs = mOutputs;
+    *devices = AUDIO_DEVICE_OUT_ALL;
+    return DEPENDS_ON_ALL;
 }
 
-uint32_t AudioPolicyManagerBase::checkDeviceMuteStrategies(AudioOutputDescriptor *outputDesc,
-                                                       audio_devices_t prevDevice,
-                                                       uint32_t delayMs)
+uint32_t AudioPolicyManagerBase::getDefaultStrategyDependencies(routing_strategy strategy,
+                                                                audio_devices_t *devices)
 {
-    // mute/unmute strategies using an incompatible device combination
-    // if muting, wait for the audio in pcm buffer to be drained before proceeding
-    // if unmuting, unmute only after the specified delay
-    if (outputDesc->isDuplicated()) {
-        return 0;
-    }
+    // devices and state read by the STRATEGY_MEDIA rules, also used as second device by
+    // STRATEGY_SONIFICATION and STRATEGY_ENFORCED_AUDIBLE
+    const audio_devices_t mediaDevices = AUDIO_DEVICE_OUT_REMOTE_SUBMIX |
+            AUDIO_DEVICE_OUT_ALL_A2DP |
+            AUDIO_DEVICE_OUT_WIRED_HEADPHONE | AUDIO_DEVICE_OUT_WIRED_HEADSET |
+            AUDIO_DEVICE_OUT_USB_ACCESSORY | AUDIO_DEVICE_OUT_USB_DEVICE |
+            AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET | AUDIO_DEVICE_OUT_AUX_DIGITAL |
+            AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET | AUDIO_DEVICE_OUT_SPEAKER;
+    const uint32_t mediaDependencies = DEPENDS_ON_FORCE_MEDIA | DEPENDS_ON_FORCE_DOCK |
+            DEPENDS_ON_A2DP_OUTPUT;
+    // devices and state read by the STRATEGY_PHONE rules
+    const audio_devices_t phoneDevices = AUDIO_DEVICE_OUT_ALL_SCO |
+            AUDIO_DEVICE_OUT_ALL_A2DP |
+            AUDIO_DEVICE_OUT_WIRED_HEADPHONE | AUDIO_DEVICE_OUT_WIRED_HEADSET |
+            AUDIO_DEVICE_OUT_USB_ACCESSORY | AUDIO_DEVICE_OUT_USB_DEVICE |
+            AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET | AUDIO_DEVICE_OUT_AUX_DIGITAL |
+            AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET | AUDIO_DEVICE_OUT_EARPIECE |
+            AUDIO_DEVICE_OUT_SPEAKER;
+    const uint32_t phoneDependencies = DEPENDS_ON_PHONE_STATE | DEPENDS_ON_FORCE_COMM |
+            DEPENDS_ON_FORCE_MEDIA | DEPENDS_ON_A2DP_OUTPUT;
 
-    uint32_t muteWaitMs = 0;
-    audio_devices_t device = outputDesc->device();
-    bool shouldMute = outputDesc->isActive() && (AudioSystem::popCount(device) >= 2);
-    // temporary mute output if device selection changes to avoid volume bursts due to
-    // different per device volumes
+    switch (strategy) {
+    case STRATEGY_MEDIA:
+        *devices = mediaDevices;
+        return mediaDependencies;
+    case STRATEGY_ENFORCED_AUDIBLE:
+        *devices = mediaDevices;
+        return mediaDependencies | DEPENDS_ON_FORCE_SYSTEM;
+    case STRATEGY_PHONE:
+        *devices = phoneDevices;
+        return phoneDependencies;
+    case STRATEGY_SONIFICATION:
+    case STRATEGY_DTMF:
+        // follow STRATEGY_PHONE or STRATEGY_MEDIA rules depending on phone state
+        *devices = phoneDevices | mediaDevices;
+        return phoneDependencies | mediaDependencies;
+    case STRATEGY_SONIFICATION_RESPECTFUL:
+    default:
+        *devices = AUDIO_DEVICE_OUT_ALL;
+        return DEPENDS_ON_STREAM_ACTIVITY;
+    }
+}
+
+void AudioPolicyManagerBase::updateDevicesAndOutputs()
+{
+    invalidateOutputCache();
+    bool a2dpOutput = (getA2dpOutput() != 0) && !mA2dpSuspended;
+    audio_devices_t changedDevices = mAvailableOutputDevices ^ mCachedAvailableOutputDevices;
+    uint32_t changedState = DEPENDS_ON_STREAM_ACTIVITY;
+
+    if (mPhoneState != mCachedPhoneState) {
+        changedState |= DEPENDS_ON_PHONE_STATE;
+    }
+    if (mForceUse[AudioSystem::FOR_COMMUNICATION] !=
+            mCachedForceUse[AudioSystem::FOR_COMMUNICATION]) {
+        changedState |= DEPENDS_ON_FORCE_COMM;
+    }
+    if (mForceUse[AudioSystem::FOR_MEDIA] != mCachedForceUse[AudioSystem::FOR_MEDIA]) {
+        changedState |= DEPENDS_ON_FORCE_MEDIA;
+    }
+    if (mForceUse[AudioSystem::FOR_DOCK] != mCachedForceUse[AudioSystem::FOR_DOCK]) {
+        changedState |= DEPENDS_ON_FORCE_DOCK;
+    }
+    if (mForceUse[AudioSystem::FOR_SYSTEM] != mCachedForceUse[AudioSystem::FOR_SYSTEM]) {
+        changedState |= DEPENDS_ON_FORCE_SYSTEM;
+    }
+    if (a2dpOutput != mCachedA2dpOutput) {
+        changedState |= DEPENDS_ON_A2DP_OUTPUT;
+    }
+
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        audio_devices_t devices;
+        uint32_t dependencies = getStrategyDependencies((routing_strategy)i, &devices);
+
+        if (mDeviceForStrategyValid &&
+                ((dependencies & changedState) == 0) && ((devices & changedDevices) == 0)) {
+            mDeviceForStrategyHits++;
+            continue;
+        }
+        mDeviceForStrategy[i] = getDeviceForStrategy((routing_strategy)i, false /*fromCache*/);
+        mDeviceForStrategyRecomputes++;
+    }
+
+    mDeviceForStrategyValid = true;
+    mCachedAvailableOutputDevices = mAvailableOutputDevices;
+    mCachedPhoneState = mPhoneState;
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        mCachedForceUse[i] = mForceUse[i];
+    }
+    mCachedA2dpOutput = a2dpOutput;
+
+    mPreviousOutputs = mOpenOutputs;
+}
+
+int AudioPolicyManagerBase::muteStrategiesForCall()
+{
+    int delayMs = 0;
+    nsecs_t sysTime = systemTime();
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        AudioOutputDescriptor *desc = mOutputs.valueAt(i);
+        // mute media and sonification strategies and delay device switch by the largest
+        // latency of any output where either strategy is active.
+        // This avoid sending the ring tone or music tail into the earpiece or headset.
+        if ((desc->isStrategyActive(STRATEGY_MEDIA,
+                                 SONIFICATION_HEADSET_MUSIC_DELAY,
+                                 sysTime) ||
+                desc->isStrategyActive(STRATEGY_SONIFICATION,
+                                     SONIFICATION_HEADSET_MUSIC_DELAY,
+                                     sysTime)) &&
+                (delayMs < (int)desc->mLatency*2)) {
+            delayMs = desc->mLatency*2;
+        }
+        setStrategyMute(STRATEGY_MEDIA, true, mOutputs.keyAt(i));
+        setStrategyMute(STRATEGY_MEDIA, false, mOutputs.keyAt(i), MUTE_TIME_MS,
+            getDeviceForStrategy(STRATEGY_MEDIA, true /*fromCache*/));
+        setStrategyMute(STRATEGY_SONIFICATION, true, mOutputs.keyAt(i));
+        setStrategyMute(STRATEGY_SONIFICATION, false, mOutputs.keyAt(i), MUTE_TIME_MS,
+            getDeviceForStrategy(STRATEGY_SONIFICATION, true /*fromCache*/));
+    }
+    return delayMs;
+}
+
+void AudioPolicyManagerBase::publishSnapshot()
+{
+    // only called with the policy service lock held: there is no concurrent writer
+    int32_t seq = mSnapshotSeq;
+    android_atomic_acquire_store(seq + 1, &mSnapshotSeq);
+
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        mSnapshot.mRefCount[i] = 0;
+        mSnapshot.mStopTime[i] = 0;
+        mSnapshot.mRemoteRefCount[i] = 0;
+        mSnapshot.mRemoteStopTime[i] = 0;
+    }
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        const AudioOutputDescriptor *outputDesc = mOutputs.valueAt(i);
+        bool remote = (outputDesc->device() & APM_AUDIO_OUT_DEVICE_REMOTE_ALL) != 0;
+        for (int j = 0; j < AudioSystem::NUM_STREAM_TYPES; j++) {
+            mSnapshot.mRefCount[j] += outputDesc->mRefCount[j];
+            if (outputDesc->mStopTime[j] > mSnapshot.mStopTime[j]) {
+                mSnapshot.mStopTime[j] = outputDesc->mStopTime[j];
+            }
+            if (remote) {
+                mSnapshot.mRemoteRefCount[j] += outputDesc->mRefCount[j];
+                if (outputDesc->mStopTime[j] > mSnapshot.mRemoteStopTime[j]) {
+                    mSnapshot.mRemoteStopTime[j] = outputDesc->mStopTime[j];
+                }
+            }
+        }
+    }
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        mSnapshot.mDeviceForStrategy[i] = mDeviceForStrategy[i];
+    }
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        const KeyedVector<audio_devices_t, int>& indexCur = mStreams[i].mIndexCur;
+        size_t count = indexCur.size();
+        if (count > MAX_SNAPSHOT_VOLUME_INDICES) {
+            ALOGW("publishSnapshot() too many volume indices %zu for stream %d", count, i);
+            count = MAX_SNAPSHOT_VOLUME_INDICES;
+        }
+        for (size_t j = 0; j < count; j++) {
+            mSnapshot.mVolumeDevice[i][j] = indexCur.keyAt(j);
+            mSnapshot.mVolumeIndex[i][j] = indexCur.valueAt(j);
+        }
+        mSnapshot.mVolumeIndexCount[i] = count;
+    }
+
+    android_atomic_release_store(seq + 2, &mSnapshotSeq);
+}
+
+bool AudioPolicyManagerBase::isSnapshotStreamActive(uint32_t refCount,
+                                                    nsecs_t stopTime,
+                                                    uint32_t inPastMs)
+{
+    if (refCount != 0) {
+        return true;
+    }
+    if (inPastMs == 0 || stopTime == 0) {
+        return false;
+    }
+    return ns2ms(systemTime() - stopTime) < inPastMs;
+}
+
+uint32_t AudioPolicyManagerBase::checkDeviceMuteStrategies(AudioOutputDescriptor *outputDesc,
+                                                       audio_devices_t prevDevice,
+                                                       uint32_t delayMs)
+{
+    // mute/unmute strategies using an incompatible device combination
+    // if muting, wait for the audio in pcm buffer to be drained before proceeding
+    // if unmuting, unmute only after the specified delay
+    if (outputDesc->isDuplicated()) {
+        return 0;
+    }
+
+    uint32_t muteWaitMs = 0;
+    audio_devices_t device = outputDesc->device();
+    bool shouldMute = outputDesc->isActive() && (AudioSystem::popCount(device) >= 2);
+    // temporary mute output if device selection changes to avoid volume bursts due to
+    // different per device volumes
     bool tempMute = outputDesc->isActive() && (device != prevDevice);
 
     for (size_t i = 0; i < NUM_STRATEGIES; i++) {
@@ -2818,6 +4237,7 @@ uint32_t AudioPolicyManagerBase::checkDeviceMuteStrategies(AudioOutputDescriptor
     // wait for the PCM output buffers to empty before proceeding with the rest of the command
     if (muteWaitMs > delayMs) {
         muteWaitMs -= delayMs;
+        mpClientInterface->flushCommands();
         usleep(muteWaitMs * 1000);
         return muteWaitMs;
     }
@@ -2900,20 +4320,92 @@ AudioPolicyManagerBase::IOProfile *AudioPolicyManagerBase::getInputProfile(audio
 {
     // Choose an input profile based on the requested capture parameters: select the first available
     // profile supporting all requested parameters.
-    for (size_t i = 0; i < mHwModules.size(); i++)
-    {
+    return findIndexedProfile(mInputProfileIndex, device, samplingRate, format, channelMask,
+                              AUDIO_OUTPUT_FLAG_NONE, AUDIO_DEVICE_IN_ALL);
+}
+
+void AudioPolicyManagerBase::updateProfileIndex()
+{
+    mOutputProfileIndex.clear();
+    mInputProfileIndex.clear();
+    for (size_t i = 0; i < mHwModules.size(); i++) {
         if (mHwModules[i]->mHandle == 0) {
             continue;
         }
-        for (size_t j = 0; j < mHwModules[i]->mInputProfiles.size(); j++)
-        {
-            IOProfile *profile = mHwModules[i]->mInputProfiles[j];
-            // profile->log();
-            if (profile->isCompatibleProfile(device, samplingRate, format,
-                                             channelMask, AUDIO_OUTPUT_FLAG_NONE)) {
-                return profile;
+        for (size_t j = 0; j < mHwModules[i]->mOutputProfiles.size(); j++) {
+            addProfileToIndex(mOutputProfileIndex, mHwModules[i]->mOutputProfiles[j]);
+        }
+        for (size_t j = 0; j < mHwModules[i]->mInputProfiles.size(); j++) {
+            addProfileToIndex(mInputProfileIndex, mHwModules[i]->mInputProfiles[j]);
+        }
+    }
+    mProfileIndexValid = true;
+    ALOGV("updateProfileIndex() %zu output keys, %zu input keys",
+          mOutputProfileIndex.size(), mInputProfileIndex.size());
+}
+
+void AudioPolicyManagerBase::addProfileToIndex(ProfileIndex& index, IOProfile *profile)
+{
+    profile->mSortedSamplingRates.clear();
+    for (size_t i = 0; i < profile->mSamplingRates.size(); i++) {
+        profile->mSortedSamplingRates.add(profile->mSamplingRates[i]);
+    }
+
+    // AUDIO_DEVICE_NONE key first: matches requests ignoring the device
+    audio_devices_t devices = profile->mSupportedDevices & ~AUDIO_DEVICE_BIT_IN;
+    audio_devices_t device = AUDIO_DEVICE_NONE;
+    do {
+        for (size_t i = 0; i < profile->mFormats.size(); i++) {
+            for (size_t j = 0; j < profile->mChannelMasks.size(); j++) {
+                ProfileIndexKey key(device, profile->mFormats[i], profile->mChannelMasks[j]);
+                ssize_t keyIndex = index.indexOfKey(key);
+                if (keyIndex < 0) {
+                    keyIndex = index.add(key, Vector<IOProfile *>());
+                }
+                Vector<IOProfile *>& profiles = index.editValueAt(keyIndex);
+                // formats or channel masks listed twice
+                if (profiles.isEmpty() || profiles.top() != profile) {
+                    profiles.add(profile);
+                }
             }
         }
+        device = devices & -devices;
+        devices &= ~device;
+    } while (device != AUDIO_DEVICE_NONE);
+}
+
+AudioPolicyManagerBase::IOProfile *AudioPolicyManagerBase::findIndexedProfile(
+                                                            const ProfileIndex& index,
+                                                            audio_devices_t device,
+                                                            uint32_t samplingRate,
+                                                            audio_format_t format,
+                                                            audio_channel_mask_t channelMask,
+                                                            audio_output_flags_t flags,
+                                                            audio_devices_t availableDevices)
+{
+    if (samplingRate == 0 || !audio_is_valid_format(format) || channelMask == 0) {
+        return NULL;
+    }
+    if (!mProfileIndexValid) {
+        updateProfileIndex();
+    }
+
+    // profiles supporting all requested devices are indexed under any of them
+    audio_devices_t keyDevice = device & ~AUDIO_DEVICE_BIT_IN;
+    keyDevice &= -keyDevice;
+    ssize_t keyIndex = index.indexOfKey(ProfileIndexKey(keyDevice, format, channelMask));
+    if (keyIndex < 0) {
+        return NULL;
+    }
+    const Vector<IOProfile *>& profiles = index.valueAt(keyIndex);
+    for (size_t i = 0; i < profiles.size(); i++) {
+        IOProfile *profile = profiles[i];
+        if (((profile->mSupportedDevices & device) == device) &&
+                ((profile->mFlags & flags) == flags) &&
+                (profile->mSortedSamplingRates.indexOf(samplingRate) >= 0) &&
+                ((profile->mSupportedDevices & availableDevices) != 0)) {
+            return profile;
+        }
     }
     return NULL;
 }
@@ -3063,6 +4555,18 @@ float AudioPolicyManagerBase::volIndexToAmpl(audio_devices_t device, const Strea
     int volIdx = (nbSteps * (indexInUi - streamDesc.mIndexMin)) /
             (streamDesc.mIndexMax - streamDesc.mIndexMin);
 
+    // out of bounds indices are not covered by the amplitude table
+    if (volIdx < curve[VOLMIN].mIndex) {
+        return 0.0f;
+    } else if ((volIdx > curve[VOLMAX].mIndex) || (volIdx >= VOL_TABLE_SIZE)) {
+        return 1.0f;
+    }
+
+    return streamDesc.mVolumeAmpl[deviceCategory][volIdx];
+}
+
+float AudioPolicyManagerBase::curveIndexToAmpl(const VolumeCurvePoint *curve, int volIdx)
+{
     // find what part of the curve this index volume belongs to, or if it's out of bounds
     int segment = 0;
     if (volIdx < curve[VOLMIN].mIndex) {         // out of bounds
@@ -3212,21 +4716,20 @@ void AudioPolicyManagerBase::initializeVolumeCurves()
 {
     for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
         for (int j = 0; j < DEVICE_CATEGORY_CNT; j++) {
-            mStreams[i].mVolumeCurve[j] =
-                    sVolumeProfiles[i][j];
+            mStreams[i].setVolumeCurve((device_category)j, sVolumeProfiles[i][j]);
         }
     }
 
     // Check availability of DRC on speaker path: if available, override some of the speaker curves
     if (mSpeakerDrcEnabled) {
-        mStreams[AUDIO_STREAM_SYSTEM].mVolumeCurve[DEVICE_CATEGORY_SPEAKER] =
-                sDefaultSystemVolumeCurveDrc;
-        mStreams[AUDIO_STREAM_RING].mVolumeCurve[DEVICE_CATEGORY_SPEAKER] =
-                sSpeakerSonificationVolumeCurveDrc;
-        mStreams[AUDIO_STREAM_ALARM].mVolumeCurve[DEVICE_CATEGORY_SPEAKER] =
-                sSpeakerSonificationVolumeCurveDrc;
-        mStreams[AUDIO_STREAM_NOTIFICATION].mVolumeCurve[DEVICE_CATEGORY_SPEAKER] =
-                sSpeakerSonificationVolumeCurveDrc;
+        mStreams[AUDIO_STREAM_SYSTEM].setVolumeCurve(DEVICE_CATEGORY_SPEAKER,
+                sDefaultSystemVolumeCurveDrc);
+        mStreams[AUDIO_STREAM_RING].setVolumeCurve(DEVICE_CATEGORY_SPEAKER,
+                sSpeakerSonificationVolumeCurveDrc);
+        mStreams[AUDIO_STREAM_ALARM].setVolumeCurve(DEVICE_CATEGORY_SPEAKER,
+                sSpeakerSonificationVolumeCurveDrc);
+        mStreams[AUDIO_STREAM_NOTIFICATION].setVolumeCurve(DEVICE_CATEGORY_SPEAKER,
+                sSpeakerSonificationVolumeCurveDrc);
     }
 }
 
@@ -3319,8 +4822,8 @@ status_t AudioPolicyManagerBase::checkAndSetVolume(int stream,
     // We actually change the volume if:
     // - the float value returned by computeVolume() changed
     // - the force flag is set
-    if (volume != mOutputs.valueFor(output)->mCurVolume[stream] ||
-            force) {
+    float prevVolume = mOutputs.valueFor(output)->mCurVolume[stream];
+    if (volume != prevVolume || force) {
         mOutputs.valueFor(output)->mCurVolume[stream] = volume;
         ALOGVV("checkAndSetVolume() for output %d stream %d, volume %f, delay %d", output, stream, volume, delayMs);
         // Force VOICE_CALL to track BLUETOOTH_SCO stream volume when bluetooth audio is
@@ -3328,7 +4831,20 @@ status_t AudioPolicyManagerBase::checkAndSetVolume(int stream,
         if (stream == AudioSystem::BLUETOOTH_SCO) {
             mpClientInterface->setStreamVolume(AudioSystem::VOICE_CALL, volume, output, delayMs);
         }
-        mpClientInterface->setStreamVolume((AudioSystem::stream_type)stream, volume, output, delayMs);
+        if (mVolumeRampMs != 0 && stream != AudioSystem::VOICE_CALL &&
+                stream != AudioSystem::BLUETOOTH_SCO && prevVolume >= 0 &&
+                mOutputs.valueFor(output)->isStreamActive((AudioSystem::stream_type)stream)) {
+            scheduleVolumeRamp(stream, prevVolume, volume, output, delayMs);
+        } else {
+            mOutputs.valueFor(output)->mVolumeRamp[stream] = VolumeRamp();
+            if (mVolumeRampThread != 0) {
+                // ordered with the steps of a ramp in progress on this stream
+                mVolumeRampThread->setVolume(stream, output, volume, delayMs);
+            } else {
+                mpClientInterface->setStreamVolume((AudioSystem::stream_type)stream, volume,
+                                                   output, delayMs);
+            }
+        }
     }
 
     if (stream == AudioSystem::VOICE_CALL ||
@@ -3350,6 +4866,229 @@ status_t AudioPolicyManagerBase::checkAndSetVolume(int stream,
     return NO_ERROR;
 }
 
+const char * const AudioPolicyManagerBase::sVolumeRampCurveNames[NUM_RAMP_CURVES] = {
+    "linear",
+    "db",
+    "s_curve",
+};
+
+AudioPolicyManagerBase::volume_ramp_curve AudioPolicyManagerBase::parseVolumeRampCurve(
+                                                                        const char *name)
+{
+    for (int i = 0; i < NUM_RAMP_CURVES; i++) {
+        if (strcmp(name, sVolumeRampCurveNames[i]) == 0) {
+            return (volume_ramp_curve)i;
+        }
+    }
+    ALOGW("parseVolumeRampCurve() unknown curve %s, using linear", name);
+    return RAMP_CURVE_LINEAR;
+}
+
+float AudioPolicyManagerBase::VolumeRamp::valueAt(nsecs_t time, volume_ramp_curve curve) const
+{
+    if (time <= mStartTime) {
+        return mFrom;
+    }
+    if (time >= mEndTime) {
+        return mTo;
+    }
+    float fraction = (float)(time - mStartTime) / (float)(mEndTime - mStartTime);
+
+    switch (curve) {
+    case RAMP_CURVE_DB: {
+        // silence is reached through the lowest volume step of the volume curves (-60dB)
+        const float minDb = -60.0f;
+        float fromDb = (mFrom > 0.001f) ? 20.0f * log10f(mFrom) : minDb;
+        float toDb = (mTo > 0.001f) ? 20.0f * log10f(mTo) : minDb;
+        return powf(10.0f, (fromDb + (toDb - fromDb) * fraction) / 20.0f);
+    }
+    case RAMP_CURVE_S_CURVE:
+        fraction = fraction * fraction * (3.0f - 2.0f * fraction);
+        break;
+    default:
+        break;
+    }
+    return mFrom + (mTo - mFrom) * fraction;
+}
+
+void AudioPolicyManagerBase::scheduleVolumeRamp(int stream,
+                                                float from,
+                                                float volume,
+                                                audio_io_handle_t output,
+                                                int delayMs)
+{
+    AudioOutputDescriptor *outputDesc = mOutputs.valueFor(output);
+    VolumeRamp& ramp = outputDesc->mVolumeRamp[stream];
+    nsecs_t startTime = systemTime() + milliseconds(delayMs);
+
+    // a ramp still in progress when this one starts continues from its volume at that time
+    if (ramp.isPending(startTime)) {
+        from = ramp.valueAt(startTime, mVolumeRampCurve);
+        mVolumeRampSuperseded++;
+    }
+
+    // the ramp must not outlast the output latency: mute requests wait for the audio
+    // in the output buffer to be drained before changing the routing
+    uint32_t rampMs = mVolumeRampMs;
+    if (rampMs > outputDesc->latency()) {
+        rampMs = outputDesc->latency();
+    }
+    uint32_t steps = rampMs / VOLUME_RAMP_STEP_MS;
+    if (steps < 1) {
+        steps = 1;
+    }
+
+    ramp.mFrom = from;
+    ramp.mTo = volume;
+    ramp.mStartTime = startTime;
+    ramp.mEndTime = startTime + milliseconds(steps * VOLUME_RAMP_STEP_MS);
+    mVolumeRampCount++;
+
+    ALOGVV("scheduleVolumeRamp() output %d stream %d from %f to %f in %u steps",
+           output, stream, from, volume, steps);
+    mVolumeRampThread->startRamp(stream, output, ramp);
+}
+
+// --- VolumeRampThread class implementation
+
+AudioPolicyManagerBase::VolumeRampThread::VolumeRampThread(
+                                                AudioPolicyClientInterface *clientInterface,
+                                                volume_ramp_curve curve)
+    : Thread(false), mpClientInterface(clientInterface), mCurve(curve), mNextGeneration(0),
+      mSending(false), mSendingKey(0)
+{
+}
+
+void AudioPolicyManagerBase::VolumeRampThread::startRamp(int stream,
+                                                         audio_io_handle_t output,
+                                                         const VolumeRamp& ramp)
+{
+    Mutex::Autolock _l(mLock);
+    mGenerations.replaceValueFor(rampKey(output, stream), ++mNextGeneration);
+    for (size_t i = 0; i < mRamps.size(); i++) {
+        if (mRamps[i].mOutput == output && mRamps[i].mStream == stream) {
+            mRamps.editItemAt(i).mRamp = ramp;
+            return;
+        }
+    }
+    ActiveRamp activeRamp;
+    activeRamp.mOutput = output;
+    activeRamp.mStream = stream;
+    activeRamp.mRamp = ramp;
+    mRamps.add(activeRamp);
+    mWaitWorkCV.signal();
+}
+
+void AudioPolicyManagerBase::VolumeRampThread::cancelRamps(audio_io_handle_t output, int stream)
+{
+    Mutex::Autolock _l(mLock);
+    cancelRamps_l(output, stream);
+}
+
+void AudioPolicyManagerBase::VolumeRampThread::cancelRamps_l(audio_io_handle_t output,
+                                                             int stream)
+{
+    for (size_t i = 0; i < mRamps.size(); ) {
+        if (mRamps[i].mOutput == output && (stream == -1 || mRamps[i].mStream == stream)) {
+            mRamps.removeAt(i);
+        } else {
+            i++;
+        }
+    }
+    if (stream != -1) {
+        mGenerations.replaceValueFor(rampKey(output, stream), ++mNextGeneration);
+    } else {
+        // the output is closed: forget its streams, steps without a generation are dropped
+        for (size_t i = 0; i < mGenerations.size(); ) {
+            if ((audio_io_handle_t)(mGenerations.keyAt(i) >> 32) == output) {
+                mGenerations.removeItemsAt(i);
+            } else {
+                i++;
+            }
+        }
+    }
+    while (mSending && (audio_io_handle_t)(mSendingKey >> 32) == output &&
+            (stream == -1 || mSendingKey == rampKey(output, stream))) {
+        mSendCV.wait(mLock);
+    }
+}
+
+status_t AudioPolicyManagerBase::VolumeRampThread::setVolume(int stream,
+                                                             audio_io_handle_t output,
+                                                             float volume,
+                                                             int delayMs)
+{
+    {
+        Mutex::Autolock _l(mLock);
+        cancelRamps_l(output, stream);
+    }
+    // steps computed before cancelRamps_l() are dropped: this volume is sent last
+    return mpClientInterface->setStreamVolume((AudioSystem::stream_type)stream, volume, output,
+                                              delayMs);
+}
+
+void AudioPolicyManagerBase::VolumeRampThread::exit()
+{
+    {
+        AutoMutex _l(mLock);
+        requestExit();
+        mWaitWorkCV.signal();
+    }
+    requestExitAndWait();
+}
+
+bool AudioPolicyManagerBase::VolumeRampThread::threadLoop()
+{
+    Mutex::Autolock _l(mLock);
+    while (!exitPending()) {
+        if (mRamps.isEmpty()) {
+            mWaitWorkCV.wait(mLock);
+            continue;
+        }
+        nsecs_t now = systemTime();
+        Vector<RampStep> steps;
+        for (size_t i = 0; i < mRamps.size(); ) {
+            const ActiveRamp& activeRamp = mRamps[i];
+            if (now < activeRamp.mRamp.mStartTime) {
+                i++;
+                continue;
+            }
+            RampStep step;
+            step.mOutput = activeRamp.mOutput;
+            step.mStream = activeRamp.mStream;
+            step.mVolume = activeRamp.mRamp.valueAt(now, mCurve);
+            step.mGeneration = mGenerations.valueFor(rampKey(step.mOutput, step.mStream));
+            steps.add(step);
+            if (activeRamp.mRamp.isPending(now)) {
+                i++;
+            } else {
+                mRamps.removeAt(i);
+            }
+        }
+        // the client call can block on the service: send the steps without mLock held
+        for (size_t i = 0; i < steps.size(); i++) {
+            const RampStep& step = steps[i];
+            int64_t key = rampKey(step.mOutput, step.mStream);
+            ssize_t index = mGenerations.indexOfKey(key);
+            if (index < 0 || mGenerations.valueAt(index) != step.mGeneration) {
+                continue;
+            }
+            mSending = true;
+            mSendingKey = key;
+            mLock.unlock();
+            mpClientInterface->setStreamVolume((AudioSystem::stream_type)step.mStream,
+                                               step.mVolume, step.mOutput);
+            mLock.lock();
+            mSending = false;
+            mSendCV.broadcast();
+        }
+        if (!exitPending()) {
+            mWaitWorkCV.waitRelative(mLock, milliseconds(VOLUME_RAMP_STEP_MS));
+        }
+    }
+    return false;
+}
+
 void AudioPolicyManagerBase::applyStreamVolumes(audio_io_handle_t output,
                                                 audio_devices_t device,
                                                 int delayMs,
@@ -3488,9 +5227,10 @@ uint32_t AudioPolicyManagerBase::getMaxEffectsMemory()
 
 AudioPolicyManagerBase::AudioOutputDescriptor::AudioOutputDescriptor(
         const IOProfile *profile)
-    : mId(0), mSamplingRate(0), mFormat(AUDIO_FORMAT_DEFAULT),
+    : mId(0), mSlot(MAX_OUTPUTS), mSamplingRate(0), mFormat(AUDIO_FORMAT_DEFAULT),
       mChannelMask(0), mLatency(0),
     mFlags((audio_output_flags_t)0), mDevice(AUDIO_DEVICE_NONE),
+    mActiveStreams(0), mLastStopTime(0),
     mOutput1(0), mOutput2(0), mProfile(profile), mDirectOpenCount(0),
     mForceRouting(false)
 {
@@ -3503,6 +5243,8 @@ AudioPolicyManagerBase::AudioOutputDescriptor::AudioOutputDescriptor(
     }
     for (int i = 0; i < NUM_STRATEGIES; i++) {
         mStrategyMutedByDevice[i] = false;
+        mStrategyRefCount[i] = 0;
+        mStrategyStopTime[i] = 0;
     }
     if (profile != NULL) {
         mSamplingRate = profile->mSamplingRates[0];
@@ -3549,15 +5291,37 @@ void AudioPolicyManagerBase::AudioOutputDescriptor::changeRefCount(AudioSystem::
         mOutput1->changeRefCount(stream, delta);
         mOutput2->changeRefCount(stream, delta);
     }
+    routing_strategy strategy = getStrategy(stream);
     if ((delta + (int)mRefCount[stream]) < 0) {
         ALOGW("changeRefCount() invalid delta %d for stream %d, refCount %d", delta, stream, mRefCount[stream]);
+        mStrategyRefCount[strategy] -= mRefCount[stream];
         mRefCount[stream] = 0;
+        mActiveStreams &= ~(1 << stream);
         return;
     }
     mRefCount[stream] += delta;
+    mStrategyRefCount[strategy] += delta;
+    if (mRefCount[stream] != 0) {
+        mActiveStreams |= (1 << stream);
+    } else {
+        mActiveStreams &= ~(1 << stream);
+    }
     ALOGV("changeRefCount() stream %d, count %d", stream, mRefCount[stream]);
 }
 
+void AudioPolicyManagerBase::AudioOutputDescriptor::setStopTime(AudioSystem::stream_type stream,
+                                                                nsecs_t stopTime)
+{
+    routing_strategy strategy = getStrategy(stream);
+    mStopTime[stream] = stopTime;
+    if (stopTime > mStrategyStopTime[strategy]) {
+        mStrategyStopTime[strategy] = stopTime;
+    }
+    if (stopTime > mLastStopTime) {
+        mLastStopTime = stopTime;
+    }
+}
+
 audio_devices_t AudioPolicyManagerBase::AudioOutputDescriptor::supportedDevices()
 {
     if (isDuplicated()) {
@@ -3576,17 +5340,27 @@ bool AudioPolicyManagerBase::AudioOutputDescriptor::isStrategyActive(routing_str
                                                                        uint32_t inPastMs,
                                                                        nsecs_t sysTime) const
 {
-    if ((sysTime == 0) && (inPastMs != 0)) {
-        sysTime = systemTime();
-    }
-    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
-        if (((getStrategy((AudioSystem::stream_type)i) == strategy) ||
-                (NUM_STRATEGIES == strategy)) &&
-                isStreamActive((AudioSystem::stream_type)i, inPastMs, sysTime)) {
+    nsecs_t stopTime;
+    if (strategy == NUM_STRATEGIES) {
+        if (mActiveStreams != 0) {
+            return true;
+        }
+        stopTime = mLastStopTime;
+    } else {
+        if (mStrategyRefCount[strategy] != 0) {
             return true;
         }
+        stopTime = mStrategyStopTime[strategy];
     }
-    return false;
+    // no stream of this strategy is active: check if the most recently stopped one
+    // was stopped less than inPastMs ago
+    if ((inPastMs == 0) || (stopTime == 0)) {
+        return false;
+    }
+    if (sysTime == 0) {
+        sysTime = systemTime();
+    }
+    return ns2ms(sysTime - stopTime) < inPastMs;
 }
 
 bool AudioPolicyManagerBase::AudioOutputDescriptor::isStreamActive(AudioSystem::stream_type stream,
@@ -3638,6 +5412,18 @@ status_t AudioPolicyManagerBase::AudioOutputDescriptor::dump(int fd)
     return NO_ERROR;
 }
 
+void AudioPolicyManagerBase::AudioOutputDescriptor::dumpJson(String8& result) const
+{
+    result.appendFormat("\"samplingRate\":%u,\"format\":%u,\"channelMask\":%u,"
+                        "\"latency\":%u,\"flags\":%u,\"devices\":%u,\"streams\":[",
+                        mSamplingRate, mFormat, mChannelMask, mLatency, mFlags, device());
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        result.appendFormat("%s{\"volume\":%.03f,\"refCount\":%u,\"muteCount\":%u}",
+                            i == 0 ? "" : ",", mCurVolume[i], mRefCount[i], mMuteCount[i]);
+    }
+    result.append("]");
+}
+
 // --- AudioInputDescriptor class implementation
 
 AudioPolicyManagerBase::AudioInputDescriptor::AudioInputDescriptor(const IOProfile *profile)
@@ -3673,6 +5459,13 @@ status_t AudioPolicyManagerBase::AudioInputDescriptor::dump(int fd)
     return NO_ERROR;
 }
 
+void AudioPolicyManagerBase::AudioInputDescriptor::dumpJson(String8& result) const
+{
+    result.appendFormat("\"samplingRate\":%u,\"format\":%u,\"channelMask\":%u,"
+                        "\"devices\":%u,\"refCount\":%u,\"inputSource\":%d",
+                        mSamplingRate, mFormat, mChannelMask, mDevice, mRefCount, mInputSource);
+}
+
 // --- StreamDescriptor class implementation
 
 AudioPolicyManagerBase::StreamDescriptor::StreamDescriptor()
@@ -3691,6 +5484,15 @@ int AudioPolicyManagerBase::StreamDescriptor::getVolumeIndex(audio_devices_t dev
     return mIndexCur.valueFor(device);
 }
 
+void AudioPolicyManagerBase::StreamDescriptor::setVolumeCurve(device_category deviceCategory,
+                                                              const VolumeCurvePoint *curve)
+{
+    mVolumeCurve[deviceCategory] = curve;
+    for (int i = 0; i < VOL_TABLE_SIZE; i++) {
+        mVolumeAmpl[deviceCategory][i] = AudioPolicyManagerBase::curveIndexToAmpl(curve, i);
+    }
+}
+
 void AudioPolicyManagerBase::StreamDescriptor::dump(int fd)
 {
     const size_t SIZE = 256;
@@ -3711,6 +5513,17 @@ void AudioPolicyManagerBase::StreamDescriptor::dump(int fd)
     write(fd, result.string(), result.size());
 }
 
+void AudioPolicyManagerBase::StreamDescriptor::dumpJson(String8& result) const
+{
+    result.appendFormat("{\"canBeMuted\":%s,\"indexMin\":%d,\"indexMax\":%d,\"indexCur\":[",
+                        mCanBeMuted ? "true" : "false", mIndexMin, mIndexMax);
+    for (size_t i = 0; i < mIndexCur.size(); i++) {
+        result.appendFormat("%s{\"device\":%u,\"index\":%d}",
+                            i == 0 ? "" : ",", mIndexCur.keyAt(i), mIndexCur.valueAt(i));
+    }
+    result.append("]}");
+}
+
 // --- EffectDescriptor class implementation
 
 status_t AudioPolicyManagerBase::EffectDescriptor::dump(int fd)
@@ -3734,6 +5547,14 @@ status_t AudioPolicyManagerBase::EffectDescriptor::dump(int fd)
     return NO_ERROR;
 }
 
+void AudioPolicyManagerBase::EffectDescriptor::dumpJson(String8& result) const
+{
+    result.appendFormat("\"io\":%d,\"strategy\":%d,\"session\":%d,\"name\":",
+                        mIo, mStrategy, mSession);
+    appendJsonString(result, mDesc.name);
+    result.appendFormat(",\"enabled\":%s", mEnabled ? "true" : "false");
+}
+
 // --- IOProfile class implementation
 
 AudioPolicyManagerBase::HwModule::HwModule(const char *name)
@@ -3781,6 +5602,27 @@ void AudioPolicyManagerBase::HwModule::dump(int fd)
     }
 }
 
+void AudioPolicyManagerBase::HwModule::dumpJson(String8& result) const
+{
+    result.append("{\"name\":");
+    appendJsonString(result, mName);
+    result.appendFormat(",\"handle\":%d,\"outputs\":[", mHandle);
+    for (size_t i = 0; i < mOutputProfiles.size(); i++) {
+        if (i != 0) {
+            result.append(",");
+        }
+        mOutputProfiles[i]->dumpJson(result);
+    }
+    result.append("],\"inputs\":[");
+    for (size_t i = 0; i < mInputProfiles.size(); i++) {
+        if (i != 0) {
+            result.append(",");
+        }
+        mInputProfiles[i]->dumpJson(result);
+    }
+    result.append("]}");
+}
+
 AudioPolicyManagerBase::IOProfile::IOProfile(HwModule *module)
     : mFlags((audio_output_flags_t)0), mModule(module)
 {
@@ -3790,6 +5632,47 @@ AudioPolicyManagerBase::IOProfile::~IOProfile()
 {
 }
 
+bool AudioPolicyManagerBase::ProfileIndexKey::operator<(const ProfileIndexKey& other) const
+{
+    if (mDevice != other.mDevice) {
+        return mDevice < other.mDevice;
+    }
+    if (mFormat != other.mFormat) {
+        return mFormat < other.mFormat;
+    }
+    return mChannelMask < other.mChannelMask;
+}
+
+bool AudioPolicyManagerBase::ProfileIndexKey::operator==(const ProfileIndexKey& other) const
+{
+    return (mDevice == other.mDevice) && (mFormat == other.mFormat) &&
+            (mChannelMask == other.mChannelMask);
+}
+
+bool AudioPolicyManagerBase::OutputCacheKey::operator<(const OutputCacheKey& other) const
+{
+    if (mStream != other.mStream) {
+        return mStream < other.mStream;
+    }
+    if (mSamplingRate != other.mSamplingRate) {
+        return mSamplingRate < other.mSamplingRate;
+    }
+    if (mFormat != other.mFormat) {
+        return mFormat < other.mFormat;
+    }
+    if (mChannelMask != other.mChannelMask) {
+        return mChannelMask < other.mChannelMask;
+    }
+    return mFlags < other.mFlags;
+}
+
+bool AudioPolicyManagerBase::OutputCacheKey::operator==(const OutputCacheKey& other) const
+{
+    return (mStream == other.mStream) && (mSamplingRate == other.mSamplingRate) &&
+            (mFormat == other.mFormat) && (mChannelMask == other.mChannelMask) &&
+            (mFlags == other.mFlags);
+}
+
 // checks if the IO profile is compatible with specified parameters.
 // Sampling rate, format and channel mask must be specified in order to
 // get a valid a match
@@ -3878,6 +5761,23 @@ void AudioPolicyManagerBase::IOProfile::dump(int fd)
     write(fd, result.string(), result.size());
 }
 
+void AudioPolicyManagerBase::IOProfile::dumpJson(String8& result) const
+{
+    result.append("{\"samplingRates\":[");
+    for (size_t i = 0; i < mSamplingRates.size(); i++) {
+        result.appendFormat("%s%u", i == 0 ? "" : ",", mSamplingRates[i]);
+    }
+    result.append("],\"channelMasks\":[");
+    for (size_t i = 0; i < mChannelMasks.size(); i++) {
+        result.appendFormat("%s%u", i == 0 ? "" : ",", mChannelMasks[i]);
+    }
+    result.append("],\"formats\":[");
+    for (size_t i = 0; i < mFormats.size(); i++) {
+        result.appendFormat("%s%u", i == 0 ? "" : ",", mFormats[i]);
+    }
+    result.appendFormat("],\"devices\":%u,\"flags\":%u}", mSupportedDevices, mFlags);
+}
+
 void AudioPolicyManagerBase::IOProfile::log()
 {
     const size_t SIZE = 256;
@@ -3913,82 +5813,118 @@ struct StringToEnum {
 #define STRING_TO_ENUM(string) { #string, string }
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+// The following tables are looked up by binary search in stringToEnum():
+// entries must be kept sorted by name in strcmp() order.
+
 const struct StringToEnum sDeviceNameToEnumTable[] = {
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_EARPIECE),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_SPEAKER),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_WIRED_HEADSET),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_WIRED_HEADPHONE),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ALL_SCO),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ALL_A2DP),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_AUX_DIGITAL),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_USB_DEVICE),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_USB_ACCESSORY),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ALL_USB),
-    STRING_TO_ENUM(AUDIO_DEVICE_OUT_REMOTE_SUBMIX),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_BUILTIN_MIC),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_WIRED_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_ANLG_DOCK_HEADSET),
     STRING_TO_ENUM(AUDIO_DEVICE_IN_AUX_DIGITAL),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_VOICE_CALL),
     STRING_TO_ENUM(AUDIO_DEVICE_IN_BACK_MIC),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_REMOTE_SUBMIX),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_ANLG_DOCK_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_BLUETOOTH_A2DP),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_BUILTIN_MIC),
     STRING_TO_ENUM(AUDIO_DEVICE_IN_DGTL_DOCK_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_REMOTE_SUBMIX),
     STRING_TO_ENUM(AUDIO_DEVICE_IN_USB_ACCESSORY),
     STRING_TO_ENUM(AUDIO_DEVICE_IN_USB_DEVICE),
-    STRING_TO_ENUM(AUDIO_DEVICE_IN_BLUETOOTH_A2DP),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_VOICE_CALL),
+    STRING_TO_ENUM(AUDIO_DEVICE_IN_WIRED_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ALL_A2DP),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ALL_SCO),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ALL_USB),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_AUX_DIGITAL),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_EARPIECE),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_REMOTE_SUBMIX),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_SPEAKER),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_USB_ACCESSORY),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_USB_DEVICE),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_WIRED_HEADPHONE),
+    STRING_TO_ENUM(AUDIO_DEVICE_OUT_WIRED_HEADSET),
 };
 
 const struct StringToEnum sFlagNameToEnumTable[] = {
+    STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD),
+    STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_DEEP_BUFFER),
     STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_DIRECT),
-    STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_PRIMARY),
     STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_FAST),
-    STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_DEEP_BUFFER),
-    STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD),
     STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_NON_BLOCKING),
+    STRING_TO_ENUM(AUDIO_OUTPUT_FLAG_PRIMARY),
 };
 
 const struct StringToEnum sFormatNameToEnumTable[] = {
+    STRING_TO_ENUM(AUDIO_FORMAT_AAC),
+    STRING_TO_ENUM(AUDIO_FORMAT_AC3),
+    STRING_TO_ENUM(AUDIO_FORMAT_E_AC3),
+    STRING_TO_ENUM(AUDIO_FORMAT_HE_AAC_V1),
+    STRING_TO_ENUM(AUDIO_FORMAT_HE_AAC_V2),
+    STRING_TO_ENUM(AUDIO_FORMAT_MP3),
+    STRING_TO_ENUM(AUDIO_FORMAT_OPUS),
     STRING_TO_ENUM(AUDIO_FORMAT_PCM_16_BIT),
-    STRING_TO_ENUM(AUDIO_FORMAT_PCM_8_BIT),
+    STRING_TO_ENUM(AUDIO_FORMAT_PCM_24_BIT_PACKED),
     STRING_TO_ENUM(AUDIO_FORMAT_PCM_32_BIT),
     STRING_TO_ENUM(AUDIO_FORMAT_PCM_8_24_BIT),
+    STRING_TO_ENUM(AUDIO_FORMAT_PCM_8_BIT),
     STRING_TO_ENUM(AUDIO_FORMAT_PCM_FLOAT),
-    STRING_TO_ENUM(AUDIO_FORMAT_PCM_24_BIT_PACKED),
-    STRING_TO_ENUM(AUDIO_FORMAT_MP3),
-    STRING_TO_ENUM(AUDIO_FORMAT_AAC),
     STRING_TO_ENUM(AUDIO_FORMAT_VORBIS),
-    STRING_TO_ENUM(AUDIO_FORMAT_HE_AAC_V1),
-    STRING_TO_ENUM(AUDIO_FORMAT_HE_AAC_V2),
-    STRING_TO_ENUM(AUDIO_FORMAT_OPUS),
-    STRING_TO_ENUM(AUDIO_FORMAT_AC3),
-    STRING_TO_ENUM(AUDIO_FORMAT_E_AC3),
 };
 
 const struct StringToEnum sOutChannelsNameToEnumTable[] = {
-    STRING_TO_ENUM(AUDIO_CHANNEL_OUT_MONO),
-    STRING_TO_ENUM(AUDIO_CHANNEL_OUT_STEREO),
     STRING_TO_ENUM(AUDIO_CHANNEL_OUT_5POINT1),
     STRING_TO_ENUM(AUDIO_CHANNEL_OUT_7POINT1),
+    STRING_TO_ENUM(AUDIO_CHANNEL_OUT_MONO),
+    STRING_TO_ENUM(AUDIO_CHANNEL_OUT_STEREO),
 };
 
 const struct StringToEnum sInChannelsNameToEnumTable[] = {
+    STRING_TO_ENUM(AUDIO_CHANNEL_IN_FRONT_BACK),
     STRING_TO_ENUM(AUDIO_CHANNEL_IN_MONO),
     STRING_TO_ENUM(AUDIO_CHANNEL_IN_STEREO),
-    STRING_TO_ENUM(AUDIO_CHANNEL_IN_FRONT_BACK),
 };
 
+static bool checkNameTableSorted(const char *tableName, const struct StringToEnum *table,
+                                 size_t size)
+{
+    for (size_t i = 1; i < size; i++) {
+        if (strcmp(table[i - 1].name, table[i].name) >= 0) {
+            ALOGE("%s is not sorted: %s must come before %s", tableName, table[i].name,
+                  table[i - 1].name);
+            return false;
+        }
+    }
+    return true;
+}
+
+#define CHECK_NAME_TABLE_SORTED(table) checkNameTableSorted(#table, table, ARRAY_SIZE(table))
+
+bool AudioPolicyManagerBase::checkConfigNameTables()
+{
+    bool sorted = CHECK_NAME_TABLE_SORTED(sDeviceNameToEnumTable);
+    sorted = CHECK_NAME_TABLE_SORTED(sFlagNameToEnumTable) && sorted;
+    sorted = CHECK_NAME_TABLE_SORTED(sFormatNameToEnumTable) && sorted;
+    sorted = CHECK_NAME_TABLE_SORTED(sOutChannelsNameToEnumTable) && sorted;
+    sorted = CHECK_NAME_TABLE_SORTED(sInChannelsNameToEnumTable) && sorted;
+    return sorted;
+}
 
 uint32_t AudioPolicyManagerBase::stringToEnum(const struct StringToEnum *table,
                                               size_t size,
                                               const char *name)
 {
-    for (size_t i = 0; i < size; i++) {
-        if (strcmp(table[i].name, name) == 0) {
-            ALOGV("stringToEnum() found %s", table[i].name);
-            return table[i].value;
+    size_t low = 0;
+    size_t high = size;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(table[mid].name, name);
+        if (cmp == 0) {
+            ALOGV("stringToEnum() found %s", table[mid].name);
+            return table[mid].value;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
     return 0;
@@ -4307,6 +6243,19 @@ void AudioPolicyManagerBase::loadGlobalConfig(cnode *root)
         } else if (strcmp(SPEAKER_DRC_ENABLED_TAG, node->name) == 0) {
             mSpeakerDrcEnabled = stringToBool((char *)node->value);
             ALOGV("loadGlobalConfig() mSpeakerDrcEnabled = %d", mSpeakerDrcEnabled);
+        } else if (strcmp(EFFECTS_MAX_CPU_LOAD_PER_IO_TAG, node->name) == 0) {
+            mMaxEffectsCpuLoadPerIo = (uint32_t)atoi((char *)node->value);
+            ALOGV("loadGlobalConfig() mMaxEffectsCpuLoadPerIo %u", mMaxEffectsCpuLoadPerIo);
+        } else if (strcmp(EFFECTS_MAX_MEMORY_PER_IO_TAG, node->name) == 0) {
+            mMaxEffectsMemoryPerIo = (uint32_t)atoi((char *)node->value);
+            ALOGV("loadGlobalConfig() mMaxEffectsMemoryPerIo %u", mMaxEffectsMemoryPerIo);
+        } else if (strcmp(EFFECTS_MAX_CPU_LOAD_PER_MODULE_TAG, node->name) == 0) {
+            mMaxEffectsCpuLoadPerModule = (uint32_t)atoi((char *)node->value);
+            ALOGV("loadGlobalConfig() mMaxEffectsCpuLoadPerModule %u",
+                  mMaxEffectsCpuLoadPerModule);
+        } else if (strcmp(EFFECTS_MAX_MEMORY_PER_MODULE_TAG, node->name) == 0) {
+            mMaxEffectsMemoryPerModule = (uint32_t)atoi((char *)node->value);
+            ALOGV("loadGlobalConfig() mMaxEffectsMemoryPerModule %u", mMaxEffectsMemoryPerModule);
         }
         node = node->next;
     }
@@ -4316,11 +6265,23 @@ status_t AudioPolicyManagerBase::loadAudioPolicyConfig(const char *path)
 {
     cnode *root;
     char *data;
+    unsigned int size;
 
-    data = (char *)load_file(path, NULL);
+    data = (char *)load_file(path, &size);
     if (data == NULL) {
         return -ENODEV;
     }
+    // system images often have fixed file dates: validate the cache against the file content.
+    // The cache layout follows the parsing code and enum values of the build that saved it.
+    uint64_t hash = configHash(data, size);
+    uint64_t build = buildHash();
+    String8 cachePath = getConfigCachePath(path);
+    if (loadConfigCache(cachePath.string(), size, hash, build) == NO_ERROR) {
+        ALOGI("loadAudioPolicyConfig() loaded %s from %s\n", path, cachePath.string());
+        free(data);
+        return NO_ERROR;
+    }
+
     root = config_node("", "");
     config_load(root, data);
 
@@ -4333,9 +6294,317 @@ status_t AudioPolicyManagerBase::loadAudioPolicyConfig(const char *path)
 
     ALOGI("loadAudioPolicyConfig() loaded %s\n", path);
 
+    saveConfigCache(cachePath.string(), size, hash, build);
+
     return NO_ERROR;
 }
 
+// --- audio_policy.conf binary cache
+
+// The cache file is made of a ConfigCacheHeader followed by 32 bit words:
+//  - global configuration: attached output devices, default output device,
+//    attached input devices, speaker DRC enabled, has A2DP, has USB, has remote submix,
+//    effects CPU load and memory budgets per io, effects CPU load and memory budgets per module
+//  - number of HW modules, then for each module:
+//      - module name, NUL padded to AUDIO_HARDWARE_MODULE_ID_MAX_LEN bytes
+//      - number of output profiles, number of input profiles, then for each profile:
+//          - supported devices, flags
+//          - number of sampling rates followed by the sampling rates
+//          - number of formats followed by the formats
+//          - number of channel masks followed by the channel masks
+
+#define CONFIG_CACHE_MAGIC 0x43435041 // "APCC"
+#define CONFIG_CACHE_VERSION 4
+#define CONFIG_CACHE_NAME_WORDS (AUDIO_HARDWARE_MODULE_ID_MAX_LEN / sizeof(uint32_t))
+
+struct ConfigCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    int64_t configSize;     // size of the configuration file the cache was built from
+    uint64_t configHash;    // configHash() of the configuration file content
+    uint64_t buildHash;     // buildHash() of the build that saved the cache
+    uint32_t length;        // number of 32 bit words following the header
+    uint32_t checksum;      // checksum of the words following the header
+};
+
+static uint32_t configCacheChecksum(const uint32_t *words, size_t length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint64_t AudioPolicyManagerBase::configHash(const char *data, size_t size)
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t AudioPolicyManagerBase::buildHash()
+{
+    char fingerprint[PROPERTY_VALUE_MAX];
+    int length = property_get("ro.build.fingerprint", fingerprint, "");
+    return configHash(fingerprint, (length > 0) ? length : 0);
+}
+
+void AudioPolicyManagerBase::appendCacheProfile(Vector<uint32_t>& words,
+                                                const IOProfile *profile)
+{
+    words.add(profile->mSupportedDevices);
+    words.add(profile->mFlags);
+    words.add(profile->mSamplingRates.size());
+    for (size_t i = 0; i < profile->mSamplingRates.size(); i++) {
+        words.add(profile->mSamplingRates[i]);
+    }
+    words.add(profile->mFormats.size());
+    for (size_t i = 0; i < profile->mFormats.size(); i++) {
+        words.add(profile->mFormats[i]);
+    }
+    words.add(profile->mChannelMasks.size());
+    for (size_t i = 0; i < profile->mChannelMasks.size(); i++) {
+        words.add(profile->mChannelMasks[i]);
+    }
+}
+
+// reads count words at *pos and advances *pos. Returns NULL if the cache is too short.
+static const uint32_t *readCacheWords(const uint32_t *words, size_t length,
+                                      size_t *pos, size_t count)
+{
+    if (count > length - *pos) {
+        return NULL;
+    }
+    const uint32_t *data = words + *pos;
+    *pos += count;
+    return data;
+}
+
+AudioPolicyManagerBase::IOProfile *AudioPolicyManagerBase::readCacheProfile(const uint32_t *words,
+                                                                             size_t length,
+                                                                             size_t *pos,
+                                                                             HwModule *module)
+{
+    const uint32_t *data = readCacheWords(words, length, pos, 2);
+    if (data == NULL) {
+        return NULL;
+    }
+    IOProfile *profile = new IOProfile(module);
+    profile->mSupportedDevices = (audio_devices_t)data[0];
+    profile->mFlags = (audio_output_flags_t)data[1];
+
+    const uint32_t *count = readCacheWords(words, length, pos, 1);
+    if (count == NULL || (data = readCacheWords(words, length, pos, *count)) == NULL) {
+        goto error;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        profile->mSamplingRates.add(data[i]);
+    }
+    count = readCacheWords(words, length, pos, 1);
+    if (count == NULL || (data = readCacheWords(words, length, pos, *count)) == NULL) {
+        goto error;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        profile->mFormats.add((audio_format_t)data[i]);
+    }
+    count = readCacheWords(words, length, pos, 1);
+    if (count == NULL || (data = readCacheWords(words, length, pos, *count)) == NULL) {
+        goto error;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        profile->mChannelMasks.add((audio_channel_mask_t)data[i]);
+    }
+    return profile;
+
+error:
+    delete profile;
+    return NULL;
+}
+
+String8 AudioPolicyManagerBase::getConfigCachePath(const char *path)
+{
+    // e.g. /system/etc/audio_policy.conf is cached in
+    // AUDIO_POLICY_CONFIG_CACHE_DIR/system_etc_audio_policy.conf.bin
+    String8 cachePath(AUDIO_POLICY_CONFIG_CACHE_DIR "/");
+    while (*path == '/') {
+        path++;
+    }
+    for (; *path != '\0'; path++) {
+        char c = (*path == '/') ? '_' : *path;
+        cachePath.append(&c, 1);
+    }
+    cachePath.append(".bin");
+    return cachePath;
+}
+
+status_t AudioPolicyManagerBase::loadConfigCache(const char *cachePath,
+                                                 size_t configSize,
+                                                 uint64_t hash,
+                                                 uint64_t build)
+{
+    int fd = open(cachePath, O_RDONLY);
+    if (fd < 0) {
+        return NAME_NOT_FOUND;
+    }
+    struct stat cacheStat;
+    if (fstat(fd, &cacheStat) != 0 || cacheStat.st_size < (off_t)sizeof(ConfigCacheHeader)) {
+        close(fd);
+        return BAD_VALUE;
+    }
+    size_t size = cacheStat.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NO_INIT;
+    }
+
+    status_t status = BAD_VALUE;
+    Vector <HwModule *> modules;
+    const uint32_t *global;
+    const uint32_t *numModules;
+    size_t pos = 0;
+    const ConfigCacheHeader *header = (const ConfigCacheHeader *)map;
+    const uint32_t *words = (const uint32_t *)(header + 1);
+    size_t length = (size - sizeof(ConfigCacheHeader)) / sizeof(uint32_t);
+
+    if (header->magic != CONFIG_CACHE_MAGIC || header->version != CONFIG_CACHE_VERSION ||
+            header->length != length ||
+            size != sizeof(ConfigCacheHeader) + length * sizeof(uint32_t)) {
+        ALOGW("loadConfigCache() invalid cache file %s", cachePath);
+        goto exit;
+    }
+    if (header->configSize != (int64_t)configSize || header->configHash != hash ||
+            header->buildHash != build) {
+        ALOGV("loadConfigCache() cache file %s out of date", cachePath);
+        status = INVALID_OPERATION;
+        goto exit;
+    }
+    if (header->checksum != configCacheChecksum(words, length)) {
+        ALOGW("loadConfigCache() corrupted cache file %s", cachePath);
+        goto exit;
+    }
+
+    global = readCacheWords(words, length, &pos, 11);
+    numModules = readCacheWords(words, length, &pos, 1);
+    if (global == NULL || numModules == NULL) {
+        goto exit;
+    }
+    for (size_t i = 0; i < *numModules; i++) {
+        const uint32_t *name = readCacheWords(words, length, &pos, CONFIG_CACHE_NAME_WORDS);
+        const uint32_t *numProfiles = readCacheWords(words, length, &pos, 2);
+        if (name == NULL || numProfiles == NULL) {
+            goto exit;
+        }
+        HwModule *module = new HwModule((const char *)name);
+        modules.add(module);
+        for (size_t j = 0; j < numProfiles[0] + numProfiles[1]; j++) {
+            IOProfile *profile = readCacheProfile(words, length, &pos, module);
+            if (profile == NULL) {
+                goto exit;
+            }
+            if (j < numProfiles[0]) {
+                module->mOutputProfiles.add(profile);
+            } else {
+                module->mInputProfiles.add(profile);
+            }
+        }
+    }
+    if (pos != length) {
+        goto exit;
+    }
+
+    mAttachedOutputDevices = (audio_devices_t)global[0];
+    mDefaultOutputDevice = (audio_devices_t)global[1];
+    mAvailableInputDevices = (audio_devices_t)global[2];
+    mSpeakerDrcEnabled = global[3] != 0;
+    mHasA2dp = global[4] != 0;
+    mHasUsb = global[5] != 0;
+    mHasRemoteSubmix = global[6] != 0;
+    mMaxEffectsCpuLoadPerIo = global[7];
+    mMaxEffectsMemoryPerIo = global[8];
+    mMaxEffectsCpuLoadPerModule = global[9];
+    mMaxEffectsMemoryPerModule = global[10];
+    mHwModules.appendVector(modules);
+    modules.clear();
+    status = NO_ERROR;
+
+exit:
+    for (size_t i = 0; i < modules.size(); i++) {
+        delete modules[i];
+    }
+    munmap(map, size);
+    return status;
+}
+
+void AudioPolicyManagerBase::saveConfigCache(const char *cachePath,
+                                             size_t configSize,
+                                             uint64_t hash,
+                                             uint64_t build)
+{
+    Vector<uint32_t> words;
+
+    words.add(mAttachedOutputDevices);
+    words.add(mDefaultOutputDevice);
+    words.add(mAvailableInputDevices);
+    words.add(mSpeakerDrcEnabled);
+    words.add(mHasA2dp);
+    words.add(mHasUsb);
+    words.add(mHasRemoteSubmix);
+    words.add(mMaxEffectsCpuLoadPerIo);
+    words.add(mMaxEffectsMemoryPerIo);
+    words.add(mMaxEffectsCpuLoadPerModule);
+    words.add(mMaxEffectsMemoryPerModule);
+    words.add(mHwModules.size());
+    for (size_t i = 0; i < mHwModules.size(); i++) {
+        uint32_t name[CONFIG_CACHE_NAME_WORDS];
+        memset(name, 0, sizeof(name));
+        strncpy((char *)name, mHwModules[i]->mName, sizeof(name) - 1);
+        words.appendArray(name, CONFIG_CACHE_NAME_WORDS);
+        words.add(mHwModules[i]->mOutputProfiles.size());
+        words.add(mHwModules[i]->mInputProfiles.size());
+        for (size_t j = 0; j < mHwModules[i]->mOutputProfiles.size(); j++) {
+            appendCacheProfile(words, mHwModules[i]->mOutputProfiles[j]);
+        }
+        for (size_t j = 0; j < mHwModules[i]->mInputProfiles.size(); j++) {
+            appendCacheProfile(words, mHwModules[i]->mInputProfiles[j]);
+        }
+    }
+
+    ConfigCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CONFIG_CACHE_MAGIC;
+    header.version = CONFIG_CACHE_VERSION;
+    header.configSize = configSize;
+    header.configHash = hash;
+    header.buildHash = build;
+    header.length = words.size();
+    header.checksum = configCacheChecksum(words.array(), words.size());
+
+    // write to a temporary file first so that a partially written cache is never loaded
+    String8 tmpPath(cachePath);
+    tmpPath.append(".tmp");
+    int fd = open(tmpPath.string(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ALOGW("saveConfigCache() cannot create %s: %s", tmpPath.string(), strerror(errno));
+        return;
+    }
+    size_t dataSize = words.size() * sizeof(uint32_t);
+    bool written = (write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)) &&
+                   (write(fd, words.array(), dataSize) == (ssize_t)dataSize);
+    close(fd);
+    if (!written || rename(tmpPath.string(), cachePath) != 0) {
+        ALOGW("saveConfigCache() cannot write %s", cachePath);
+        unlink(tmpPath.string());
+        return;
+    }
+    ALOGV("saveConfigCache() saved %s", cachePath);
+}
+
 void AudioPolicyManagerBase::defaultAudioPolicyConfig(void)
 {
     HwModule *module;
@@ -31,5 +31,13 @@ public:
 
         virtual ~AudioPolicyManagerDefault() {}
 
+protected:
+        // getDeviceForStrategy() is not overridden: use the dependencies of the base rules
+        virtual uint32_t getStrategyDependencies(routing_strategy strategy,
+                                                 audio_devices_t *devices)
+        {
+            return getDefaultStrategyDependencies(strategy, devices);
+        }
+
 };
 };
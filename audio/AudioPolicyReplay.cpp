@@ -0,0 +1,870 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// audio_policy_replay: host tool replaying policy event traces against AudioPolicyManagerBase
+// configured by a given audio_policy.conf, with a client recording the commands the policy
+// manager issues instead of an audio HAL. Reports the duration of each policy call and the
+// resulting routing. Exits with status 1 if an event fails or an expected routing is not met.
+//
+// usage: audio_policy_replay [-v] <audio_policy.conf> <trace> [<trace>...]
+//        audio_policy_replay -b <profiles>
+//
+// -b loads a synthetic audio_policy.conf with the given number of output profiles and reports
+// the time taken to load it and to look up its device and flag names.
+// Both modes first check that the audio_policy.conf name tables looked up by binary search
+// are sorted, and exit with status 1 if not.
+//
+// Traces are text files with one policy call per line, as written by the event trace of
+// AudioPolicyManagerBase::dump() (property audio.policy.trace). Text following '#' is ignored.
+//   connect|disconnect <devices> [address]
+//   phone <state>
+//   force <usage> <config>
+//   init <stream> <indexMin> <indexMax>
+//   output <output> <stream> <samplingRate> <format> <channelMask> <flags>
+//   start|stop <output> <stream> <session>
+//   release <output>
+//   input <input> <source> <samplingRate> <format> <channelMask> <acoustics>
+//   start_input|stop_input|release_input <input>
+//   volume <stream> <index> <devices>
+//   effect <id> <io> <strategy> <session> <flags> <cpuLoad> <memoryUsage>
+//   unregister_effect <id>
+//   enable_effect <id> <enabled>
+//   begin|commit
+//   expect <stream> <devices>
+// "expect" checks the devices selected for a stream (getDevicesForStream()) at that point of
+// the replay. The event trace ends with the routing of each stream at dump time when no event
+// was dropped. Devices are numeric or audio_policy.conf device names separated by '|'. Output
+// handles are the ones returned on the recorded device: an "output" line maps the handle to the
+// output returned by getOutput() during the replay, an "input" line maps an input handle the same
+// way. Effects registered on an io unknown to the replay are registered on the primary output.
+
+#define LOG_TAG "AudioPolicyReplay"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/Log.h>
+#include <utils/Timers.h>
+#include <utils/KeyedVector.h>
+#include <media/AudioParameter.h>
+#include <hardware_legacy/AudioPolicyManagerBase.h>
+
+namespace android_audio_legacy {
+
+// latency reported for the outputs opened by the replay client
+#define REPLAY_OUTPUT_LATENCY_MS 20
+
+// records the commands issued by the policy manager. Outputs and inputs always open with the
+// requested configuration, or 44.1kHz 16 bit stereo for unspecified parameters.
+class ReplayClient : public AudioPolicyClientInterface
+{
+public:
+    ReplayClient(bool verbose) :
+        mVerbose(verbose), mNextHandle(1), mRoutingCommands(0), mParameterCommands(0),
+        mVolumeCommands(0), mOtherCommands(0) {}
+    virtual ~ReplayClient() {}
+
+    virtual audio_module_handle_t loadHwModule(const char *name)
+    {
+        log("loadHwModule %s", name);
+        return (audio_module_handle_t)mNextHandle++;
+    }
+    virtual audio_io_handle_t openOutput(audio_module_handle_t module,
+                                         audio_devices_t *pDevices,
+                                         uint32_t *pSamplingRate,
+                                         audio_format_t *pFormat,
+                                         audio_channel_mask_t *pChannelMask,
+                                         uint32_t *pLatencyMs,
+                                         audio_output_flags_t flags,
+                                         const audio_offload_info_t *offloadInfo)
+    {
+        if (*pSamplingRate == 0) {
+            *pSamplingRate = 44100;
+        }
+        if (*pFormat == AUDIO_FORMAT_DEFAULT) {
+            *pFormat = AUDIO_FORMAT_PCM_16_BIT;
+        }
+        if (*pChannelMask == 0) {
+            *pChannelMask = AUDIO_CHANNEL_OUT_STEREO;
+        }
+        *pLatencyMs = REPLAY_OUTPUT_LATENCY_MS;
+        audio_io_handle_t output = (audio_io_handle_t)mNextHandle++;
+        mRouting.add(output, *pDevices);
+        mOtherCommands++;
+        log("openOutput module %d devices %08x flags %x -> %d", module, *pDevices, flags, output);
+        return output;
+    }
+    virtual audio_io_handle_t openDuplicateOutput(audio_io_handle_t output1,
+                                                  audio_io_handle_t output2)
+    {
+        audio_io_handle_t output = (audio_io_handle_t)mNextHandle++;
+        mOtherCommands++;
+        log("openDuplicateOutput %d %d -> %d", output1, output2, output);
+        return output;
+    }
+    virtual status_t closeOutput(audio_io_handle_t output)
+    {
+        mRouting.removeItem(output);
+        mOtherCommands++;
+        log("closeOutput %d", output);
+        return NO_ERROR;
+    }
+    virtual status_t suspendOutput(audio_io_handle_t output)
+    {
+        mOtherCommands++;
+        log("suspendOutput %d", output);
+        return NO_ERROR;
+    }
+    virtual status_t restoreOutput(audio_io_handle_t output)
+    {
+        mOtherCommands++;
+        log("restoreOutput %d", output);
+        return NO_ERROR;
+    }
+    virtual audio_io_handle_t openInput(audio_module_handle_t module,
+                                        audio_devices_t *pDevices,
+                                        uint32_t *pSamplingRate,
+                                        audio_format_t *pFormat,
+                                        audio_channel_mask_t *pChannelMask)
+    {
+        if (*pSamplingRate == 0) {
+            *pSamplingRate = 44100;
+        }
+        if (*pFormat == AUDIO_FORMAT_DEFAULT) {
+            *pFormat = AUDIO_FORMAT_PCM_16_BIT;
+        }
+        if (*pChannelMask == 0) {
+            *pChannelMask = AUDIO_CHANNEL_IN_MONO;
+        }
+        audio_io_handle_t input = (audio_io_handle_t)mNextHandle++;
+        mOtherCommands++;
+        log("openInput module %d devices %08x -> %d", module, *pDevices, input);
+        return input;
+    }
+    virtual status_t closeInput(audio_io_handle_t input)
+    {
+        mOtherCommands++;
+        log("closeInput %d", input);
+        return NO_ERROR;
+    }
+    virtual status_t setStreamVolume(AudioSystem::stream_type stream, float volume,
+                                     audio_io_handle_t output, int delayMs)
+    {
+        mVolumeCommands++;
+        log("setStreamVolume stream %d output %d volume %.3f delay %d",
+            stream, output, volume, delayMs);
+        return NO_ERROR;
+    }
+    virtual status_t invalidateStream(AudioSystem::stream_type stream)
+    {
+        mOtherCommands++;
+        log("invalidateStream %d", stream);
+        return NO_ERROR;
+    }
+    virtual void setParameters(audio_io_handle_t ioHandle, const String8& keyValuePairs,
+                               int delayMs)
+    {
+        AudioParameter param = AudioParameter(keyValuePairs);
+        int device;
+        if (param.getInt(String8(AudioParameter::keyRouting), device) == NO_ERROR) {
+            mRoutingCommands++;
+            mRouting.replaceValueFor(ioHandle, (audio_devices_t)device);
+        } else {
+            mParameterCommands++;
+        }
+        log("setParameters io %d %s delay %d", ioHandle, keyValuePairs.string(), delayMs);
+    }
+    virtual String8 getParameters(audio_io_handle_t ioHandle, const String8& keys)
+    {
+        return String8("");
+    }
+    virtual status_t startTone(ToneGenerator::tone_type tone, AudioSystem::stream_type stream)
+    {
+        mOtherCommands++;
+        log("startTone %d stream %d", tone, stream);
+        return NO_ERROR;
+    }
+    virtual status_t stopTone()
+    {
+        mOtherCommands++;
+        log("stopTone");
+        return NO_ERROR;
+    }
+    virtual status_t setVoiceVolume(float volume, int delayMs)
+    {
+        mVolumeCommands++;
+        log("setVoiceVolume %.3f delay %d", volume, delayMs);
+        return NO_ERROR;
+    }
+    virtual status_t moveEffects(audio_session_t session, audio_io_handle_t srcOutput,
+                                 audio_io_handle_t dstOutput)
+    {
+        mOtherCommands++;
+        log("moveEffects session %d %d -> %d", session, srcOutput, dstOutput);
+        return NO_ERROR;
+    }
+
+    void report()
+    {
+        printf("commands: %u routing, %u parameters, %u volume, %u other\n",
+               mRoutingCommands, mParameterCommands, mVolumeCommands, mOtherCommands);
+        for (size_t i = 0; i < mRouting.size(); i++) {
+            printf("output %d routed to %08x\n", mRouting.keyAt(i), mRouting.valueAt(i));
+        }
+    }
+
+private:
+    void log(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        if (!mVerbose) {
+            return;
+        }
+        va_list args;
+        va_start(args, format);
+        printf("  -> ");
+        vprintf(format, args);
+        printf("\n");
+        va_end(args);
+    }
+
+    bool mVerbose;
+    int mNextHandle;
+    // last routing command received by each open output
+    KeyedVector<audio_io_handle_t, audio_devices_t> mRouting;
+    uint32_t mRoutingCommands;
+    uint32_t mParameterCommands;
+    uint32_t mVolumeCommands;
+    uint32_t mOtherCommands;
+};
+
+class ReplayPolicyManager : public AudioPolicyManagerBase
+{
+public:
+    ReplayPolicyManager(AudioPolicyClientInterface *clientInterface, const char *configFile,
+                        bool verbose) :
+        AudioPolicyManagerBase(clientInterface, configFile), mVerbose(verbose), mFailures(0)
+    {
+        memset(mStats, 0, sizeof(mStats));
+    }
+    virtual ~ReplayPolicyManager() {}
+
+    status_t replay(const char *path);
+    void report();
+    // parses the given device and flag names iterations times, returns the total duration
+    static nsecs_t benchmarkNames(const char *devices, const char *flags, int iterations);
+    // number of invalid, failed or unmet events replayed so far
+    uint32_t failures() const { return mFailures; }
+
+protected:
+    // getDeviceForStrategy() is not overridden: use the dependencies of the base rules
+    virtual uint32_t getStrategyDependencies(routing_strategy strategy,
+                                             audio_devices_t *devices)
+    {
+        return getDefaultStrategyDependencies(strategy, devices);
+    }
+
+private:
+    enum replay_event {
+        EVENT_CONNECT,
+        EVENT_DISCONNECT,
+        EVENT_PHONE,
+        EVENT_FORCE,
+        EVENT_INIT,
+        EVENT_OUTPUT,
+        EVENT_START,
+        EVENT_STOP,
+        EVENT_RELEASE,
+        EVENT_INPUT,
+        EVENT_START_INPUT,
+        EVENT_STOP_INPUT,
+        EVENT_RELEASE_INPUT,
+        EVENT_VOLUME,
+        EVENT_EFFECT,
+        EVENT_UNREGISTER_EFFECT,
+        EVENT_ENABLE_EFFECT,
+        EVENT_BEGIN,
+        EVENT_COMMIT,
+        EVENT_EXPECT,
+        NUM_EVENTS
+    };
+
+    class EventStats
+    {
+    public:
+        uint32_t mCount;
+        uint32_t mErrors;
+        nsecs_t mTotalTime;
+        nsecs_t mMaxTime;
+    };
+
+    static const char * const sEventNames[NUM_EVENTS];
+
+    static audio_devices_t parseDevices(char *devices);
+    // returns the output used during the replay for an output handle of the recorded trace.
+    // Outputs obtained before the first recorded event are requested for the stream with
+    // default parameters.
+    audio_io_handle_t replayOutput(int output, AudioSystem::stream_type stream);
+    // returns the io used during the replay for an io handle of the recorded trace, 0 if unknown
+    audio_io_handle_t replayIo(int io);
+    status_t replayEvent(replay_event event, char **args, size_t numArgs);
+
+    bool mVerbose;
+    uint32_t mFailures;
+    EventStats mStats[NUM_EVENTS];
+    KeyedVector<int, audio_io_handle_t> mOutputMap;  // recorded output -> replayed output
+    KeyedVector<int, audio_io_handle_t> mInputMap;   // recorded input -> replayed input
+};
+
+const char * const ReplayPolicyManager::sEventNames[NUM_EVENTS] = {
+    "connect",
+    "disconnect",
+    "phone",
+    "force",
+    "init",
+    "output",
+    "start",
+    "stop",
+    "release",
+    "input",
+    "start_input",
+    "stop_input",
+    "release_input",
+    "volume",
+    "effect",
+    "unregister_effect",
+    "enable_effect",
+    "begin",
+    "commit",
+    "expect",
+};
+
+// number of arguments required by each event
+static const size_t sEventArgs[] = {
+    1, // connect
+    1, // disconnect
+    1, // phone
+    2, // force
+    3, // init
+    6, // output
+    3, // start
+    3, // stop
+    1, // release
+    6, // input
+    1, // start_input
+    1, // stop_input
+    1, // release_input
+    3, // volume
+    7, // effect
+    1, // unregister_effect
+    2, // enable_effect
+    0, // begin
+    0, // commit
+    2, // expect
+};
+
+audio_devices_t ReplayPolicyManager::parseDevices(char *devices)
+{
+    if (strncmp(devices, "AUDIO_DEVICE_", strlen("AUDIO_DEVICE_")) == 0) {
+        return parseDeviceNames(devices);
+    }
+    return (audio_devices_t)strtoul(devices, NULL, 0);
+}
+
+audio_io_handle_t ReplayPolicyManager::replayOutput(int output, AudioSystem::stream_type stream)
+{
+    ssize_t index = mOutputMap.indexOfKey(output);
+    if (index >= 0) {
+        return mOutputMap.valueAt(index);
+    }
+    if (stream == AudioSystem::DEFAULT) {
+        return 0;
+    }
+    audio_io_handle_t replayed = getOutput(stream, 0, AUDIO_FORMAT_DEFAULT, 0,
+                                           AudioSystem::OUTPUT_FLAG_INDIRECT, NULL);
+    if (replayed != 0) {
+        mOutputMap.add(output, replayed);
+    }
+    return replayed;
+}
+
+audio_io_handle_t ReplayPolicyManager::replayIo(int io)
+{
+    ssize_t index = mOutputMap.indexOfKey(io);
+    if (index >= 0) {
+        return mOutputMap.valueAt(index);
+    }
+    index = mInputMap.indexOfKey(io);
+    if (index >= 0) {
+        return mInputMap.valueAt(index);
+    }
+    return 0;
+}
+
+status_t ReplayPolicyManager::replayEvent(replay_event event, char **args, size_t numArgs)
+{
+    int stream = (numArgs > 0) ? (int)strtol(args[0], NULL, 0) : 0;
+
+    switch (event) {
+    case EVENT_CONNECT:
+    case EVENT_DISCONNECT:
+        return setDeviceConnectionState(parseDevices(args[0]),
+                    (event == EVENT_CONNECT) ? AudioSystem::DEVICE_STATE_AVAILABLE :
+                                               AudioSystem::DEVICE_STATE_UNAVAILABLE,
+                    (numArgs > 1) ? args[1] : "");
+    case EVENT_PHONE:
+        setPhoneState((int)strtol(args[0], NULL, 0));
+        return NO_ERROR;
+    case EVENT_FORCE:
+        setForceUse((AudioSystem::force_use)strtol(args[0], NULL, 0),
+                    (AudioSystem::forced_config)strtol(args[1], NULL, 0));
+        return NO_ERROR;
+    case EVENT_INIT:
+        if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+            return BAD_VALUE;
+        }
+        initStreamVolume((AudioSystem::stream_type)stream,
+                         (int)strtol(args[1], NULL, 0), (int)strtol(args[2], NULL, 0));
+        return NO_ERROR;
+    case EVENT_OUTPUT: {
+        int recorded = (int)strtol(args[0], NULL, 0);
+        stream = (int)strtol(args[1], NULL, 0);
+        if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+            return BAD_VALUE;
+        }
+        audio_io_handle_t output = getOutput((AudioSystem::stream_type)stream,
+                (uint32_t)strtoul(args[2], NULL, 0),
+                (audio_format_t)strtoul(args[3], NULL, 0),
+                (audio_channel_mask_t)strtoul(args[4], NULL, 0),
+                (AudioSystem::output_flags)strtoul(args[5], NULL, 0),
+                NULL);
+        if (recorded != 0) {
+            mOutputMap.replaceValueFor(recorded, output);
+        }
+        // an output is expected if one was returned on the recorded device
+        return ((output == 0) != (recorded == 0)) ? INVALID_OPERATION : NO_ERROR;
+        }
+    case EVENT_START:
+    case EVENT_STOP: {
+        stream = (int)strtol(args[1], NULL, 0);
+        if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+            return BAD_VALUE;
+        }
+        audio_io_handle_t output = replayOutput((int)strtol(args[0], NULL, 0),
+                                                (AudioSystem::stream_type)stream);
+        if (output == 0) {
+            return BAD_VALUE;
+        }
+        audio_session_t session = (audio_session_t)strtol(args[2], NULL, 0);
+        if (event == EVENT_START) {
+            return startOutput(output, (AudioSystem::stream_type)stream, session);
+        }
+        return stopOutput(output, (AudioSystem::stream_type)stream, session);
+        }
+    case EVENT_RELEASE: {
+        int recorded = (int)strtol(args[0], NULL, 0);
+        audio_io_handle_t output = replayOutput(recorded, AudioSystem::DEFAULT);
+        if (output == 0) {
+            return BAD_VALUE;
+        }
+        releaseOutput(output);
+        mOutputMap.removeItem(recorded);
+        return NO_ERROR;
+        }
+    case EVENT_INPUT: {
+        int recorded = (int)strtol(args[0], NULL, 0);
+        audio_io_handle_t input = getInput((int)strtol(args[1], NULL, 0),
+                (uint32_t)strtoul(args[2], NULL, 0),
+                (audio_format_t)strtoul(args[3], NULL, 0),
+                (audio_channel_mask_t)strtoul(args[4], NULL, 0),
+                (AudioSystem::audio_in_acoustics)strtoul(args[5], NULL, 0));
+        if (recorded != 0) {
+            mInputMap.replaceValueFor(recorded, input);
+        }
+        return ((input == 0) != (recorded == 0)) ? INVALID_OPERATION : NO_ERROR;
+        }
+    case EVENT_START_INPUT:
+    case EVENT_STOP_INPUT:
+    case EVENT_RELEASE_INPUT: {
+        int recorded = (int)strtol(args[0], NULL, 0);
+        ssize_t index = mInputMap.indexOfKey(recorded);
+        if (index < 0 || mInputMap.valueAt(index) == 0) {
+            return BAD_VALUE;
+        }
+        audio_io_handle_t input = mInputMap.valueAt(index);
+        if (event == EVENT_START_INPUT) {
+            return startInput(input);
+        } else if (event == EVENT_STOP_INPUT) {
+            return stopInput(input);
+        }
+        releaseInput(input);
+        mInputMap.removeItemsAt(index);
+        return NO_ERROR;
+        }
+    case EVENT_EFFECT: {
+        audio_io_handle_t io = replayIo((int)strtol(args[1], NULL, 0));
+        effect_descriptor_t desc;
+        memset(&desc, 0, sizeof(desc));
+        strncpy(desc.name, "replay", sizeof(desc.name) - 1);
+        desc.flags = (uint32_t)strtoul(args[4], NULL, 0);
+        desc.cpuLoad = (uint16_t)strtoul(args[5], NULL, 0);
+        desc.memoryUsage = (uint16_t)strtoul(args[6], NULL, 0);
+        return registerEffect(&desc, (io != 0) ? io : mPrimaryOutput,
+                              (uint32_t)strtoul(args[2], NULL, 0),
+                              (audio_session_t)strtol(args[3], NULL, 0),
+                              (int)strtol(args[0], NULL, 0));
+        }
+    case EVENT_UNREGISTER_EFFECT:
+        return unregisterEffect((int)strtol(args[0], NULL, 0));
+    case EVENT_ENABLE_EFFECT:
+        return setEffectEnabled((int)strtol(args[0], NULL, 0), strtol(args[1], NULL, 0) != 0);
+    case EVENT_VOLUME:
+        if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+            return BAD_VALUE;
+        }
+        return setStreamVolumeIndex((AudioSystem::stream_type)stream,
+                                    (int)strtol(args[1], NULL, 0), parseDevices(args[2]));
+    case EVENT_BEGIN:
+        beginRoutingTransaction();
+        return NO_ERROR;
+    case EVENT_COMMIT:
+        commitRoutingTransaction();
+        return NO_ERROR;
+    case EVENT_EXPECT: {
+        if (stream < 0 || stream >= AudioSystem::NUM_STREAM_TYPES) {
+            return BAD_VALUE;
+        }
+        audio_devices_t expected = parseDevices(args[1]);
+        audio_devices_t devices = getDevicesForStream((AudioSystem::stream_type)stream);
+        if (devices != expected) {
+            printf("stream %d routed to %08x, expected %08x\n", stream, devices, expected);
+            return INVALID_OPERATION;
+        }
+        return NO_ERROR;
+        }
+    default:
+        return BAD_VALUE;
+    }
+}
+
+status_t ReplayPolicyManager::replay(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not open %s\n", path);
+        return NAME_NOT_FOUND;
+    }
+
+    char line[256];
+    int lineNum = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNum++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *saveptr;
+        char *name = strtok_r(line, " \t\r\n", &saveptr);
+        if (name == NULL) {
+            continue;
+        }
+        char *args[8];
+        size_t numArgs = 0;
+        while (numArgs < sizeof(args) / sizeof(args[0]) &&
+                (args[numArgs] = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+            numArgs++;
+        }
+        int event = 0;
+        while (event < NUM_EVENTS && strcmp(name, sEventNames[event]) != 0) {
+            event++;
+        }
+        if (event == NUM_EVENTS || numArgs < sEventArgs[event]) {
+            fprintf(stderr, "%s:%d: invalid event %s\n", path, lineNum, name);
+            mFailures++;
+            continue;
+        }
+
+        nsecs_t startTime = systemTime();
+        status_t status = replayEvent((replay_event)event, args, numArgs);
+        nsecs_t duration = systemTime() - startTime;
+
+        EventStats& stats = mStats[event];
+        stats.mCount++;
+        stats.mTotalTime += duration;
+        if (duration > stats.mMaxTime) {
+            stats.mMaxTime = duration;
+        }
+        if (status != NO_ERROR) {
+            stats.mErrors++;
+            mFailures++;
+        }
+        if (mVerbose || status != NO_ERROR) {
+            printf("%s:%d: %s status %d took %lld us\n",
+                   path, lineNum, name, status, (long long)ns2us(duration));
+        }
+    }
+    fclose(file);
+    return NO_ERROR;
+}
+
+nsecs_t ReplayPolicyManager::benchmarkNames(const char *devices, const char *flags,
+                                            int iterations)
+{
+    // names are tokenized in place: parse copies
+    char deviceNames[1024];
+    char flagNames[256];
+    uint32_t result = 0;
+
+    nsecs_t startTime = systemTime();
+    for (int i = 0; i < iterations; i++) {
+        snprintf(deviceNames, sizeof(deviceNames), "%s", devices);
+        snprintf(flagNames, sizeof(flagNames), "%s", flags);
+        result ^= parseDeviceNames(deviceNames);
+        result ^= parseFlagNames(flagNames);
+    }
+    nsecs_t duration = systemTime() - startTime;
+    ALOGV("benchmarkNames() result %08x", result);
+    return duration;
+}
+
+void ReplayPolicyManager::report()
+{
+    printf("%-18s %8s %8s %12s %12s %12s\n", "event", "count", "errors", "total (us)",
+           "mean (us)", "max (us)");
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        const EventStats& stats = mStats[i];
+        if (stats.mCount == 0) {
+            continue;
+        }
+        printf("%-18s %8u %8u %12lld %12lld %12lld\n", sEventNames[i], stats.mCount,
+               stats.mErrors, (long long)ns2us(stats.mTotalTime),
+               (long long)ns2us(stats.mTotalTime / stats.mCount),
+               (long long)ns2us(stats.mMaxTime));
+    }
+
+    printf("phone state %d, output devices %08x, input devices %08x\n",
+           mPhoneState, mAvailableOutputDevices, mAvailableInputDevices);
+    for (int i = 0; i < AudioSystem::NUM_FORCE_USE; i++) {
+        printf("force use %d: %d\n", i, mForceUse[i]);
+    }
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        printf("strategy %d device %08x\n", i, getDeviceForStrategy((routing_strategy)i, true));
+    }
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        const AudioOutputDescriptor *desc = mOutputs.valueAt(i);
+        printf("output %d device %08x refCount", mOutputs.keyAt(i), desc->device());
+        for (int j = 0; j < AudioSystem::NUM_STREAM_TYPES; j++) {
+            printf(" %u", desc->mRefCount[j]);
+        }
+        printf("\n");
+    }
+}
+
+// default volume index ranges, as set by AudioService
+static const int sDefaultIndexMax[] = {
+    5,  // VOICE_CALL
+    7,  // SYSTEM
+    7,  // RING
+    15, // MUSIC
+    7,  // ALARM
+    7,  // NOTIFICATION
+    15, // BLUETOOTH_SCO
+    7,  // ENFORCED_AUDIBLE
+    15, // DTMF
+    15, // TTS
+};
+
+}; // namespace android_audio_legacy
+
+using namespace android_audio_legacy;
+
+// names of the synthetic configuration: every profile lists all output devices but the
+// attached speaker so that only the primary output is opened when the configuration is loaded
+#define BENCHMARK_DEVICES "AUDIO_DEVICE_OUT_EARPIECE|AUDIO_DEVICE_OUT_WIRED_HEADSET|" \
+        "AUDIO_DEVICE_OUT_WIRED_HEADPHONE|AUDIO_DEVICE_OUT_ALL_SCO|AUDIO_DEVICE_OUT_ALL_A2DP|" \
+        "AUDIO_DEVICE_OUT_AUX_DIGITAL|AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET|" \
+        "AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET|AUDIO_DEVICE_OUT_ALL_USB|" \
+        "AUDIO_DEVICE_OUT_REMOTE_SUBMIX"
+#define BENCHMARK_FLAGS "AUDIO_OUTPUT_FLAG_DIRECT|AUDIO_OUTPUT_FLAG_DEEP_BUFFER|" \
+        "AUDIO_OUTPUT_FLAG_NON_BLOCKING"
+#define BENCHMARK_FORMATS "AUDIO_FORMAT_PCM_16_BIT|AUDIO_FORMAT_PCM_8_24_BIT|" \
+        "AUDIO_FORMAT_MP3|AUDIO_FORMAT_AAC|AUDIO_FORMAT_HE_AAC_V1|AUDIO_FORMAT_HE_AAC_V2|" \
+        "AUDIO_FORMAT_VORBIS|AUDIO_FORMAT_OPUS|AUDIO_FORMAT_AC3|AUDIO_FORMAT_E_AC3"
+#define BENCHMARK_CHANNELS "AUDIO_CHANNEL_OUT_MONO|AUDIO_CHANNEL_OUT_STEREO|" \
+        "AUDIO_CHANNEL_OUT_5POINT1|AUDIO_CHANNEL_OUT_7POINT1"
+#define BENCHMARK_NAME_ITERATIONS 100000
+
+// writes an audio_policy.conf with a primary output and the given number of extra output
+// profiles to path
+static status_t writeBenchmarkConfig(const char *path, int profiles)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -errno;
+    }
+    fprintf(file, "global_configuration {\n"
+                  "  attached_output_devices AUDIO_DEVICE_OUT_SPEAKER\n"
+                  "  default_output_device AUDIO_DEVICE_OUT_SPEAKER\n"
+                  "  attached_input_devices AUDIO_DEVICE_IN_BUILTIN_MIC\n"
+                  "}\n"
+                  "audio_hw_modules {\n"
+                  "  primary {\n"
+                  "    outputs {\n"
+                  "      primary {\n"
+                  "        sampling_rates 44100\n"
+                  "        channel_masks AUDIO_CHANNEL_OUT_STEREO\n"
+                  "        formats AUDIO_FORMAT_PCM_16_BIT\n"
+                  "        devices AUDIO_DEVICE_OUT_SPEAKER\n"
+                  "        flags AUDIO_OUTPUT_FLAG_PRIMARY\n"
+                  "      }\n");
+    for (int i = 0; i < profiles; i++) {
+        fprintf(file, "      output_%d {\n"
+                      "        sampling_rates 8000|16000|32000|44100|48000|96000\n"
+                      "        channel_masks " BENCHMARK_CHANNELS "\n"
+                      "        formats " BENCHMARK_FORMATS "\n"
+                      "        devices " BENCHMARK_DEVICES "\n"
+                      "        flags " BENCHMARK_FLAGS "\n"
+                      "      }\n", i);
+    }
+    fprintf(file, "    }\n"
+                  "    inputs {\n"
+                  "      primary {\n"
+                  "        sampling_rates 8000|16000|44100\n"
+                  "        channel_masks AUDIO_CHANNEL_IN_MONO|AUDIO_CHANNEL_IN_STEREO\n"
+                  "        formats AUDIO_FORMAT_PCM_16_BIT\n"
+                  "        devices AUDIO_DEVICE_IN_BUILTIN_MIC|AUDIO_DEVICE_IN_WIRED_HEADSET\n"
+                  "      }\n"
+                  "    }\n"
+                  "  }\n"
+                  "}\n");
+    return (fclose(file) == 0) ? NO_ERROR : -errno;
+}
+
+static int benchmark(int profiles)
+{
+    char path[] = "/tmp/audio_policy_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "could not create synthetic configuration: %s\n", strerror(errno));
+        return 1;
+    }
+    close(fd);
+    if (writeBenchmarkConfig(path, profiles) != NO_ERROR) {
+        fprintf(stderr, "could not write synthetic configuration %s\n", path);
+        unlink(path);
+        return 1;
+    }
+
+    ReplayClient *client = new ReplayClient(false);
+    nsecs_t startTime = systemTime();
+    ReplayPolicyManager *manager = new ReplayPolicyManager(client, path, false);
+    nsecs_t loadTime = systemTime() - startTime;
+    int status = 0;
+    if (manager->initCheck() != NO_ERROR) {
+        fprintf(stderr, "could not initialize policy manager with %s\n", path);
+        status = 1;
+    } else {
+        printf("config load: %d output profiles in %lld us\n", profiles + 1,
+               (long long)ns2us(loadTime));
+    }
+    delete manager;
+    delete client;
+    unlink(path);
+
+    nsecs_t namesTime = ReplayPolicyManager::benchmarkNames(BENCHMARK_DEVICES, BENCHMARK_FLAGS,
+                                                            BENCHMARK_NAME_ITERATIONS);
+    printf("name lookups: %d device and flag lists in %lld us, %lld ns per list\n",
+           BENCHMARK_NAME_ITERATIONS, (long long)ns2us(namesTime),
+           (long long)(namesTime / BENCHMARK_NAME_ITERATIONS));
+    return status;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] <audio_policy.conf> <trace> [<trace>...]\n"
+                    "       %s -b <profiles>\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    int profiles = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vb:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'b':
+            profiles = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!AudioPolicyManagerBase::checkConfigNameTables()) {
+        fprintf(stderr, "audio_policy.conf name tables are not sorted\n");
+        return 1;
+    }
+    if (profiles >= 0) {
+        return benchmark(profiles);
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ReplayClient *client = new ReplayClient(verbose);
+    ReplayPolicyManager *manager = new ReplayPolicyManager(client, argv[optind], verbose);
+    if (manager->initCheck() != NO_ERROR) {
+        fprintf(stderr, "could not initialize policy manager with %s\n", argv[optind]);
+        delete manager;
+        delete client;
+        return 1;
+    }
+    // traces recorded with "init" events override these ranges
+    for (int i = 0; i < AudioSystem::NUM_STREAM_TYPES; i++) {
+        manager->initStreamVolume((AudioSystem::stream_type)i,
+                                  (i == AudioSystem::VOICE_CALL ||
+                                   i == AudioSystem::BLUETOOTH_SCO) ? 1 : 0,
+                                  (i < (int)(sizeof(sDefaultIndexMax) / sizeof(int))) ?
+                                          sDefaultIndexMax[i] : 15);
+    }
+
+    int status = 0;
+    for (int i = optind + 1; i < argc; i++) {
+        if (manager->replay(argv[i]) != NO_ERROR) {
+            status = 1;
+        }
+    }
+    manager->report();
+    client->report();
+    if (manager->failures() != 0) {
+        printf("%u events failed\n", manager->failures());
+        status = 1;
+    }
+
+    delete manager;
+    delete client;
+    return status;
+}
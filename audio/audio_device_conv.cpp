@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <system/audio.h>
+
+#include <hardware_legacy/AudioSystemLegacy.h>
+
+#include "audio_device_conv.h"
+
+namespace android_audio_legacy {
+
+const uint32_t audio_device_conv_table[][HAL_API_REV_NUM] =
+{
+    /* output devices */
+    { AudioSystem::DEVICE_OUT_EARPIECE, AUDIO_DEVICE_OUT_EARPIECE },
+    { AudioSystem::DEVICE_OUT_SPEAKER, AUDIO_DEVICE_OUT_SPEAKER },
+    { AudioSystem::DEVICE_OUT_WIRED_HEADSET, AUDIO_DEVICE_OUT_WIRED_HEADSET },
+    { AudioSystem::DEVICE_OUT_WIRED_HEADPHONE, AUDIO_DEVICE_OUT_WIRED_HEADPHONE },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO, AUDIO_DEVICE_OUT_BLUETOOTH_SCO },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET, AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT, AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP, AUDIO_DEVICE_OUT_BLUETOOTH_A2DP },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES, AUDIO_DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER, AUDIO_DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER },
+    { AudioSystem::DEVICE_OUT_AUX_DIGITAL, AUDIO_DEVICE_OUT_AUX_DIGITAL },
+    { AudioSystem::DEVICE_OUT_ANLG_DOCK_HEADSET, AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET },
+    { AudioSystem::DEVICE_OUT_DGTL_DOCK_HEADSET, AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET },
+    { AudioSystem::DEVICE_OUT_DEFAULT, AUDIO_DEVICE_OUT_DEFAULT },
+    /* input devices */
+    { AudioSystem::DEVICE_IN_COMMUNICATION, AUDIO_DEVICE_IN_COMMUNICATION },
+    { AudioSystem::DEVICE_IN_AMBIENT, AUDIO_DEVICE_IN_AMBIENT },
+    { AudioSystem::DEVICE_IN_BUILTIN_MIC, AUDIO_DEVICE_IN_BUILTIN_MIC },
+    { AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET, AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET },
+    { AudioSystem::DEVICE_IN_WIRED_HEADSET, AUDIO_DEVICE_IN_WIRED_HEADSET },
+    { AudioSystem::DEVICE_IN_AUX_DIGITAL, AUDIO_DEVICE_IN_AUX_DIGITAL },
+    { AudioSystem::DEVICE_IN_VOICE_CALL, AUDIO_DEVICE_IN_VOICE_CALL },
+    { AudioSystem::DEVICE_IN_BACK_MIC, AUDIO_DEVICE_IN_BACK_MIC },
+    { AudioSystem::DEVICE_IN_DEFAULT, AUDIO_DEVICE_IN_DEFAULT },
+};
+
+const uint32_t audio_device_conv_table_size =
+        sizeof(audio_device_conv_table)/sizeof(uint32_t)/HAL_API_REV_NUM;
+
+/* Direct-index view of audio_device_conv_table: for each conversion direction and
+ * input/output domain, the converted device for each device bit position.
+ * AUDIO_DEVICE_NONE for bits with no table entry. Built once by
+ * init_audio_device_conv_index(); parity with a linear search of the table is checked
+ * by audio_device_conv_test. */
+static uint32_t audio_device_conv_index[HAL_API_REV_NUM][HAL_API_REV_NUM][2][32];
+
+void init_audio_device_conv_index()
+{
+    /* walk the table in order so that the first entry for a device wins, as with
+     * the linear search */
+    for (uint32_t i = 0; i < audio_device_conv_table_size; i++) {
+        for (int from_rev = 0; from_rev < HAL_API_REV_NUM; from_rev++) {
+            uint32_t device = audio_device_conv_table[i][from_rev];
+            uint32_t in = 0;
+
+            if (from_rev != HAL_API_REV_1_0 && (device & AUDIO_DEVICE_BIT_IN)) {
+                in = 1;
+                device &= ~AUDIO_DEVICE_BIT_IN;
+            }
+            /* entries combining several devices never match a single bit */
+            if (device == 0 || (device & (device - 1)) != 0)
+                continue;
+
+            uint32_t bit = __builtin_ctz(device);
+            for (int to_rev = 0; to_rev < HAL_API_REV_NUM; to_rev++) {
+                uint32_t *entry = &audio_device_conv_index[from_rev][to_rev][in][bit];
+                if (*entry == AUDIO_DEVICE_NONE)
+                    *entry = audio_device_conv_table[i][to_rev];
+            }
+        }
+    }
+}
+
+uint32_t convert_audio_device(uint32_t from_device, int from_rev, int to_rev)
+{
+    uint32_t to_device = AUDIO_DEVICE_NONE;
+    uint32_t in = 0;
+
+    if (from_rev != HAL_API_REV_1_0) {
+        in = (from_device & AUDIO_DEVICE_BIT_IN) != 0;
+        from_device &= ~AUDIO_DEVICE_BIT_IN;
+    }
+
+    const uint32_t *index = audio_device_conv_index[from_rev][to_rev][in];
+    while (from_device) {
+        to_device |= index[__builtin_ctz(from_device)];
+        from_device &= from_device - 1;
+    }
+    return to_device;
+}
+
+}; // namespace android_audio_legacy
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_AUDIO_DEVICE_CONV_H
+#define ANDROID_AUDIO_DEVICE_CONV_H
+
+#include <stdint.h>
+
+namespace android_audio_legacy {
+
+/* Conversion of device masks between the legacy AudioSystem values (HAL_API_REV_1_0)
+ * and the audio.h values (HAL_API_REV_2_0), used by the legacy HAL shim. */
+
+enum hal_api_rev {
+    HAL_API_REV_1_0,
+    HAL_API_REV_2_0,
+    HAL_API_REV_NUM
+};
+
+/* one row per device, one column per HAL API revision */
+extern const uint32_t audio_device_conv_table[][HAL_API_REV_NUM];
+extern const uint32_t audio_device_conv_table_size;
+
+/* Builds the direct-index tables used by convert_audio_device(). Must be called
+ * once before any conversion. */
+void init_audio_device_conv_index();
+
+uint32_t convert_audio_device(uint32_t from_device, int from_rev, int to_rev);
+
+}; // namespace android_audio_legacy
+
+#endif // ANDROID_AUDIO_DEVICE_CONV_H
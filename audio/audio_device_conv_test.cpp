@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host test checking that the direct-index device conversion used by the legacy HAL shim
+// gives the same result as a linear search of audio_device_conv_table, for every device bit
+// and for device masks combining them. Exits with status 1 on any mismatch.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <system/audio.h>
+
+#include "audio_device_conv.h"
+
+using namespace android_audio_legacy;
+
+// reference conversion of a single device bit by linear search of the table
+static uint32_t convert_audio_device_bit_linear(uint32_t cur_device, int from_rev, int to_rev)
+{
+    for (uint32_t i = 0; i < audio_device_conv_table_size; i++) {
+        if (audio_device_conv_table[i][from_rev] == cur_device)
+            return audio_device_conv_table[i][to_rev];
+    }
+    return AUDIO_DEVICE_NONE;
+}
+
+// reference conversion of a device mask, one bit at a time
+static uint32_t convert_audio_device_linear(uint32_t from_device, int from_rev, int to_rev)
+{
+    uint32_t to_device = AUDIO_DEVICE_NONE;
+    uint32_t in_bit = 0;
+
+    if (from_rev != HAL_API_REV_1_0) {
+        in_bit = from_device & AUDIO_DEVICE_BIT_IN;
+        from_device &= ~AUDIO_DEVICE_BIT_IN;
+    }
+    while (from_device) {
+        uint32_t cur_device = (1 << __builtin_ctz(from_device)) | in_bit;
+        to_device |= convert_audio_device_bit_linear(cur_device, from_rev, to_rev);
+        from_device &= from_device - 1;
+    }
+    return to_device;
+}
+
+static int check(uint32_t device, int from_rev, int to_rev)
+{
+    uint32_t expected = convert_audio_device_linear(device, from_rev, to_rev);
+    uint32_t converted = convert_audio_device(device, from_rev, to_rev);
+    if (converted != expected) {
+        fprintf(stderr, "device conversion mismatch rev %d -> %d device %#x: %#x != %#x\n",
+                from_rev, to_rev, device, converted, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+
+    init_audio_device_conv_index();
+
+    for (int from_rev = 0; from_rev < HAL_API_REV_NUM; from_rev++) {
+        for (int to_rev = 0; to_rev < HAL_API_REV_NUM; to_rev++) {
+            for (uint32_t in = 0; in < 2; in++) {
+                if (in && from_rev == HAL_API_REV_1_0)
+                    continue;
+                uint32_t in_bit = in ? AUDIO_DEVICE_BIT_IN : 0;
+                for (uint32_t bit = 0; bit < 32; bit++) {
+                    uint32_t device = (1 << bit) | in_bit;
+                    if (from_rev != HAL_API_REV_1_0 && device == AUDIO_DEVICE_BIT_IN)
+                        continue;
+                    failures += check(device, from_rev, to_rev);
+                }
+                // every table entry combined with its neighbours
+                for (uint32_t i = 0; i < audio_device_conv_table_size; i++) {
+                    uint32_t device = in_bit;
+                    for (uint32_t j = i; j < audio_device_conv_table_size && j < i + 3; j++) {
+                        device |= audio_device_conv_table[j][from_rev];
+                    }
+                    if (from_rev != HAL_API_REV_1_0 &&
+                            (device & AUDIO_DEVICE_BIT_IN) != in_bit) {
+                        continue;
+                    }
+                    failures += check(device, from_rev, to_rev);
+                }
+            }
+        }
+    }
+
+    if (failures != 0) {
+        printf("%d device conversions failed\n", failures);
+        return 1;
+    }
+    printf("device conversion: all passed\n");
+    return 0;
+}
@@ -18,6 +18,8 @@
 //#define LOG_NDEBUG 0
 
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
@@ -26,6 +28,8 @@
 #include <hardware_legacy/AudioHardwareInterface.h>
 #include <hardware_legacy/AudioSystemLegacy.h>
 
+#include "audio_device_conv.h"
+
 namespace android_audio_legacy {
 
 class AudioHardwareInterface;
@@ -46,6 +50,14 @@ struct legacy_stream_out {
     struct audio_stream_out stream;
 
     AudioStreamOut *legacy_out;
+
+    /* write position tracked by the shim, used when the legacy stream cannot
+     * report its own render position or timestamps */
+    mutable pthread_mutex_t lock;
+    uint64_t frames_written;            /* frames written since the stream was opened */
+    uint64_t standby_frames;            /* frames_written when the stream last left standby */
+    uint32_t last_write_frames;         /* frames in the last successful write */
+    struct timespec last_write_time;    /* CLOCK_MONOTONIC end of last write, 0 in standby */
 };
 
 struct legacy_stream_in {
@@ -55,68 +67,6 @@ struct legacy_stream_in {
 };
 
 
-enum {
-    HAL_API_REV_1_0,
-    HAL_API_REV_2_0,
-    HAL_API_REV_NUM
-} hal_api_rev;
-
-static uint32_t audio_device_conv_table[][HAL_API_REV_NUM] =
-{
-    /* output devices */
-    { AudioSystem::DEVICE_OUT_EARPIECE, AUDIO_DEVICE_OUT_EARPIECE },
-    { AudioSystem::DEVICE_OUT_SPEAKER, AUDIO_DEVICE_OUT_SPEAKER },
-    { AudioSystem::DEVICE_OUT_WIRED_HEADSET, AUDIO_DEVICE_OUT_WIRED_HEADSET },
-    { AudioSystem::DEVICE_OUT_WIRED_HEADPHONE, AUDIO_DEVICE_OUT_WIRED_HEADPHONE },
-    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO, AUDIO_DEVICE_OUT_BLUETOOTH_SCO },
-    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET, AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET },
-    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT, AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT },
-    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP, AUDIO_DEVICE_OUT_BLUETOOTH_A2DP },
-    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES, AUDIO_DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES },
-    { AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER, AUDIO_DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER },
-    { AudioSystem::DEVICE_OUT_AUX_DIGITAL, AUDIO_DEVICE_OUT_AUX_DIGITAL },
-    { AudioSystem::DEVICE_OUT_ANLG_DOCK_HEADSET, AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET },
-    { AudioSystem::DEVICE_OUT_DGTL_DOCK_HEADSET, AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET },
-    { AudioSystem::DEVICE_OUT_DEFAULT, AUDIO_DEVICE_OUT_DEFAULT },
-    /* input devices */
-    { AudioSystem::DEVICE_IN_COMMUNICATION, AUDIO_DEVICE_IN_COMMUNICATION },
-    { AudioSystem::DEVICE_IN_AMBIENT, AUDIO_DEVICE_IN_AMBIENT },
-    { AudioSystem::DEVICE_IN_BUILTIN_MIC, AUDIO_DEVICE_IN_BUILTIN_MIC },
-    { AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET, AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET },
-    { AudioSystem::DEVICE_IN_WIRED_HEADSET, AUDIO_DEVICE_IN_WIRED_HEADSET },
-    { AudioSystem::DEVICE_IN_AUX_DIGITAL, AUDIO_DEVICE_IN_AUX_DIGITAL },
-    { AudioSystem::DEVICE_IN_VOICE_CALL, AUDIO_DEVICE_IN_VOICE_CALL },
-    { AudioSystem::DEVICE_IN_BACK_MIC, AUDIO_DEVICE_IN_BACK_MIC },
-    { AudioSystem::DEVICE_IN_DEFAULT, AUDIO_DEVICE_IN_DEFAULT },
-};
-
-static uint32_t convert_audio_device(uint32_t from_device, int from_rev, int to_rev)
-{
-    const uint32_t k_num_devices = sizeof(audio_device_conv_table)/sizeof(uint32_t)/HAL_API_REV_NUM;
-    uint32_t to_device = AUDIO_DEVICE_NONE;
-    uint32_t in_bit = 0;
-
-    if (from_rev != HAL_API_REV_1_0) {
-        in_bit = from_device & AUDIO_DEVICE_BIT_IN;
-        from_device &= ~AUDIO_DEVICE_BIT_IN;
-    }
-
-    while (from_device) {
-        uint32_t i = 31 - __builtin_clz(from_device);
-        uint32_t cur_device = (1 << i) | in_bit;
-
-        for (i = 0; i < k_num_devices; i++) {
-            if (audio_device_conv_table[i][from_rev] == cur_device) {
-                to_device |= audio_device_conv_table[i][to_rev];
-                break;
-            }
-        }
-        from_device &= ~cur_device;
-    }
-    return to_device;
-}
-
-
 /** audio_stream_out implementation **/
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
@@ -170,6 +120,14 @@ static int out_standby(struct audio_stream *stream)
 {
     struct legacy_stream_out *out =
         reinterpret_cast<struct legacy_stream_out *>(stream);
+
+    pthread_mutex_lock(&out->lock);
+    out->standby_frames = out->frames_written;
+    out->last_write_frames = 0;
+    out->last_write_time.tv_sec = 0;
+    out->last_write_time.tv_nsec = 0;
+    pthread_mutex_unlock(&out->lock);
+
     return out->legacy_out->standby();
 }
 
@@ -239,7 +197,56 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 {
     struct legacy_stream_out *out =
         reinterpret_cast<struct legacy_stream_out *>(stream);
-    return out->legacy_out->write(buffer, bytes);
+    ssize_t ret = out->legacy_out->write(buffer, bytes);
+
+    if (ret > 0) {
+        struct timespec now;
+        size_t frame_size = out->legacy_out->frameSize();
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&out->lock);
+        if (frame_size != 0) {
+            out->last_write_frames = ret / frame_size;
+            out->frames_written += out->last_write_frames;
+        }
+        out->last_write_time = now;
+        pthread_mutex_unlock(&out->lock);
+    }
+    return ret;
+}
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Frames presented since the stream was opened, derived from the frames written
+ * and the stream latency: when a write returns, latency() worth of the frames
+ * written since standby are still queued ahead of the DAC. If now is not NULL,
+ * the queued frames are assumed to drain at the sample rate since the last write.
+ * Must be called with out->lock held. Returns false if nothing was written since
+ * standby. */
+static bool out_get_presented_frames_l(const struct legacy_stream_out *out,
+                                       const struct timespec *now, uint64_t *frames)
+{
+    if (out->last_write_time.tv_sec == 0 && out->last_write_time.tv_nsec == 0)
+        return false;
+
+    uint32_t rate = out->legacy_out->sampleRate();
+    uint64_t queued = (uint64_t)out->legacy_out->latency() * rate / 1000;
+    uint64_t since_standby = out->frames_written - out->standby_frames;
+
+    if (queued > since_standby)
+        queued = since_standby;
+    if (now != NULL) {
+        int64_t elapsed = timespec_to_ns(now) - timespec_to_ns(&out->last_write_time);
+        if (elapsed > 0) {
+            uint64_t drained = (uint64_t)elapsed * rate / 1000000000LL;
+            queued = drained < queued ? queued - drained : 0;
+        }
+    }
+    *frames = out->frames_written - queued;
+    return true;
 }
 
 static int out_get_render_position(const struct audio_stream_out *stream,
@@ -247,7 +254,21 @@ static int out_get_render_position(const struct audio_stream_out *stream,
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->getRenderPosition(dsp_frames);
+    struct timespec now;
+    uint64_t frames;
+    int ret = -ENODATA;
+
+    if (out->legacy_out->getRenderPosition(dsp_frames) == NO_ERROR)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&out->lock);
+    if (out_get_presented_frames_l(out, &now, &frames)) {
+        *dsp_frames = (uint32_t)(frames - out->standby_frames);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return ret;
 }
 
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
@@ -255,7 +276,43 @@ static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
 {
     const struct legacy_stream_out *out =
         reinterpret_cast<const struct legacy_stream_out *>(stream);
-    return out->legacy_out->getNextWriteTimestamp(timestamp);
+    int ret = -ENODATA;
+
+    if (out->legacy_out->getNextWriteTimestamp(timestamp) == NO_ERROR)
+        return 0;
+
+    /* the next write is expected once the sink has consumed the last buffer */
+    pthread_mutex_lock(&out->lock);
+    if (out->last_write_time.tv_sec != 0 || out->last_write_time.tv_nsec != 0) {
+        uint32_t rate = out->legacy_out->sampleRate();
+        *timestamp = timespec_to_ns(&out->last_write_time) / 1000;
+        if (rate != 0)
+            *timestamp += (int64_t)out->last_write_frames * 1000000 / rate;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return ret;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    const struct legacy_stream_out *out =
+        reinterpret_cast<const struct legacy_stream_out *>(stream);
+    int ret = -ENODATA;
+
+    if (out->legacy_out->getPresentationPosition(frames, timestamp) == NO_ERROR)
+        return 0;
+
+    /* report the position at the end of the last write so that the frame count and
+     * the timestamp are sampled together */
+    pthread_mutex_lock(&out->lock);
+    if (out_get_presented_frames_l(out, NULL, frames)) {
+        *timestamp = out->last_write_time;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+    return ret;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -530,6 +587,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
+
+    pthread_mutex_init(&out->lock, NULL);
 
     *stream_out = &out->stream;
     return 0;
@@ -547,6 +607,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     struct legacy_stream_out *out = reinterpret_cast<struct legacy_stream_out *>(stream);
 
     ladev->hwif->closeOutputStream(out->legacy_out);
+    pthread_mutex_destroy(&out->lock);
     free(out);
 }
 
@@ -648,6 +709,9 @@ static int legacy_adev_open(const hw_module_t* module, const char* name,
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
         return -EINVAL;
 
+    static pthread_once_t audio_device_conv_once = PTHREAD_ONCE_INIT;
+    pthread_once(&audio_device_conv_once, init_audio_device_conv_index);
+
     ladev = (struct legacy_audio_device *)calloc(1, sizeof(*ladev));
     if (!ladev)
         return -ENOMEM;
@@ -60,6 +60,23 @@ static inline const struct legacy_audio_policy * to_clap(const struct audio_poli
     return reinterpret_cast<const struct legacy_audio_policy *>(pol);
 }
 
+// queues the setParameters() commands issued by the policy manager to the service during a
+// policy call and flushes them, merged, when the call returns. See
+// AudioPolicyCompatClient::beginCommandBatch()
+class CommandBatch {
+public:
+    CommandBatch(struct legacy_audio_policy *lap) : mClient(lap->service_client)
+    {
+        mClient->beginCommandBatch();
+    }
+    ~CommandBatch()
+    {
+        mClient->endCommandBatch();
+    }
+private:
+    AudioPolicyCompatClient *mClient;
+};
+
 
 static int ap_set_device_connection_state(struct audio_policy *pol,
                                           audio_devices_t device,
@@ -67,6 +84,7 @@ static int ap_set_device_connection_state(struct audio_policy *pol,
                                           const char *device_address)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->setDeviceConnectionState(
                     (AudioSystem::audio_devices)device,
                     (AudioSystem::device_connection_state)state,
@@ -87,6 +105,7 @@ static audio_policy_dev_state_t ap_get_device_connection_state(
 static void ap_set_phone_state(struct audio_policy *pol, audio_mode_t state)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     // as this is the legacy API, don't change it to use audio_mode_t instead of int
     lap->apm->setPhoneState((int) state);
 }
@@ -104,6 +123,7 @@ static void ap_set_force_use(struct audio_policy *pol,
                           audio_policy_forced_cfg_t config)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     lap->apm->setForceUse((AudioSystem::force_use)usage,
                           (AudioSystem::forced_config)config);
 }
@@ -142,6 +162,7 @@ static audio_io_handle_t ap_get_output(struct audio_policy *pol,
                                        const audio_offload_info_t *offloadInfo)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
 
     ALOGV("%s: tid %d", __func__, gettid());
     return lap->apm->getOutput((AudioSystem::stream_type)stream,
@@ -154,6 +175,7 @@ static int ap_start_output(struct audio_policy *pol, audio_io_handle_t output,
                            audio_stream_type_t stream, audio_session_t session)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->startOutput(output, (AudioSystem::stream_type)stream,
                                  session);
 }
@@ -162,6 +184,7 @@ static int ap_stop_output(struct audio_policy *pol, audio_io_handle_t output,
                           audio_stream_type_t stream, audio_session_t session)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->stopOutput(output, (AudioSystem::stream_type)stream,
                                 session);
 }
@@ -170,6 +193,7 @@ static void ap_release_output(struct audio_policy *pol,
                               audio_io_handle_t output)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     lap->apm->releaseOutput(output);
 }
 
@@ -180,6 +204,7 @@ static audio_io_handle_t ap_get_input(struct audio_policy *pol, audio_source_t i
                                       audio_in_acoustics_t acoustics)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->getInput((int) inputSource, sampling_rate, format, channelMask,
                               (AudioSystem::audio_in_acoustics)acoustics);
 }
@@ -187,18 +212,21 @@ static audio_io_handle_t ap_get_input(struct audio_policy *pol, audio_source_t i
 static int ap_start_input(struct audio_policy *pol, audio_io_handle_t input)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->startInput(input);
 }
 
 static int ap_stop_input(struct audio_policy *pol, audio_io_handle_t input)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->stopInput(input);
 }
 
 static void ap_release_input(struct audio_policy *pol, audio_io_handle_t input)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     lap->apm->releaseInput(input);
 }
 
@@ -207,6 +235,7 @@ static void ap_init_stream_volume(struct audio_policy *pol,
                                   int index_max)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     lap->apm->initStreamVolume((AudioSystem::stream_type)stream, index_min,
                                index_max);
 }
@@ -216,6 +245,7 @@ static int ap_set_stream_volume_index(struct audio_policy *pol,
                                       int index)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->setStreamVolumeIndex((AudioSystem::stream_type)stream,
                                           index,
                                           AUDIO_DEVICE_OUT_DEFAULT);
@@ -226,9 +256,9 @@ static int ap_get_stream_volume_index(const struct audio_policy *pol,
                                       int *index)
 {
     const struct legacy_audio_policy *lap = to_clap(pol);
-    return lap->apm->getStreamVolumeIndex((AudioSystem::stream_type)stream,
-                                          index,
-                                          AUDIO_DEVICE_OUT_DEFAULT);
+    return lap->apm->getStreamVolumeIndexSnapshot((AudioSystem::stream_type)stream,
+                                                  index,
+                                                  AUDIO_DEVICE_OUT_DEFAULT);
 }
 
 static int ap_set_stream_volume_index_for_device(struct audio_policy *pol,
@@ -237,6 +267,7 @@ static int ap_set_stream_volume_index_for_device(struct audio_policy *pol,
                                       audio_devices_t device)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->setStreamVolumeIndex((AudioSystem::stream_type)stream,
                                           index,
                                           device);
@@ -248,9 +279,9 @@ static int ap_get_stream_volume_index_for_device(const struct audio_policy *pol,
                                       audio_devices_t device)
 {
     const struct legacy_audio_policy *lap = to_clap(pol);
-    return lap->apm->getStreamVolumeIndex((AudioSystem::stream_type)stream,
-                                          index,
-                                          device);
+    return lap->apm->getStreamVolumeIndexSnapshot((AudioSystem::stream_type)stream,
+                                                  index,
+                                                  device);
 }
 
 static uint32_t ap_get_strategy_for_stream(const struct audio_policy *pol,
@@ -264,7 +295,7 @@ static audio_devices_t ap_get_devices_for_stream(const struct audio_policy *pol,
                                        audio_stream_type_t stream)
 {
     const struct legacy_audio_policy *lap = to_clap(pol);
-    return lap->apm->getDevicesForStream((AudioSystem::stream_type)stream);
+    return lap->apm->getDevicesForStreamSnapshot((AudioSystem::stream_type)stream);
 }
 
 static audio_io_handle_t ap_get_output_for_effect(struct audio_policy *pol,
@@ -294,6 +325,7 @@ static int ap_unregister_effect(struct audio_policy *pol, int id)
 static int ap_set_effect_enabled(struct audio_policy *pol, int id, bool enabled)
 {
     struct legacy_audio_policy *lap = to_lap(pol);
+    CommandBatch batch(lap);
     return lap->apm->setEffectEnabled(id, enabled);
 }
 
@@ -301,14 +333,14 @@ static bool ap_is_stream_active(const struct audio_policy *pol, audio_stream_typ
                                 uint32_t in_past_ms)
 {
     const struct legacy_audio_policy *lap = to_clap(pol);
-    return lap->apm->isStreamActive((int) stream, in_past_ms);
+    return lap->apm->isStreamActiveSnapshot((int) stream, in_past_ms);
 }
 
 static bool ap_is_stream_active_remotely(const struct audio_policy *pol, audio_stream_type_t stream,
                                 uint32_t in_past_ms)
 {
     const struct legacy_audio_policy *lap = to_clap(pol);
-    return lap->apm->isStreamActiveRemotely((int) stream, in_past_ms);
+    return lap->apm->isStreamActiveRemotelySnapshot((int) stream, in_past_ms);
 }
 
 static bool ap_is_source_active(const struct audio_policy *pol, audio_source_t source)
@@ -320,7 +352,9 @@ static bool ap_is_source_active(const struct audio_policy *pol, audio_source_t s
 static int ap_dump(const struct audio_policy *pol, int fd)
 {
     const struct legacy_audio_policy *lap = to_clap(pol);
-    return lap->apm->dump(fd);
+    int status = lap->apm->dump(fd);
+    lap->service_client->dump(fd);
+    return status;
 }
 
 static bool ap_is_offload_supported(const struct audio_policy *pol,
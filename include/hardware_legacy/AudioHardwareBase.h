@@ -17,6 +17,10 @@
 #ifndef ANDROID_AUDIO_HARDWARE_BASE_H
 #define ANDROID_AUDIO_HARDWARE_BASE_H
 
+#include <time.h>
+
+#include <utils/threads.h>
+
 #include <hardware_legacy/AudioHardwareInterface.h>
 
 #include <system/audio.h>
@@ -61,6 +65,53 @@ protected:
     int              mMode;
 };
 
+/**
+ * AudioStreamPacer gives simulated streams (stubs, dump, error paths) the timing of a real
+ * device. Buffers are due on an absolute CLOCK_MONOTONIC schedule started by the first
+ * transfer after standby, so time spent by the caller and sleep overshoot do not accumulate.
+ */
+class AudioStreamPacer
+{
+public:
+                        AudioStreamPacer();
+
+    /** accounts for frames transferred at sampleRate and sleeps until they are due */
+            void        wait(size_t frames, uint32_t sampleRate);
+    /** the schedule restarts at the next wait() */
+            void        standby();
+
+    /** frames transferred since the last standby() */
+            uint64_t    framesSinceStandby() const;
+    /** frames transferred since creation */
+            uint64_t    framesTransferred() const;
+    /**
+     * frames transferred since creation that are due at the current time and that time.
+     * Returns INVALID_OPERATION in standby
+     */
+            status_t    getPresentationPosition(uint64_t *frames, struct timespec *timestamp) const;
+    /** CLOCK_MONOTONIC time in microseconds when the next buffer starts. INVALID_OPERATION in standby */
+            status_t    getNextWriteTimestamp(int64_t *timestamp) const;
+
+    /** current CLOCK_MONOTONIC time in nanoseconds */
+    static  int64_t     now();
+
+private:
+    /** CLOCK_MONOTONIC time in nanoseconds at which the frames scheduled so far are due */
+            int64_t     dueTime() const;
+
+    // a caller late by more than this restarts the schedule rather than bursting to catch up
+    static const int64_t MAX_LATENESS_NS = 1000000000LL;
+
+    // the position queries may be called from other threads than the one transferring audio
+    mutable android::Mutex mLock;
+    int64_t             mStartTime;         // 0 in standby
+    uint32_t            mSampleRate;
+    uint64_t            mScheduledFrames;   // frames transferred since mStartTime
+    uint64_t            mFramesSinceStandby;    // unlike mScheduledFrames, not reset by a
+                                                // schedule restart after a late transfer
+    uint64_t            mTotalFrames;
+};
+
 }; // namespace android
 
 #endif // ANDROID_AUDIO_HARDWARE_BASE_H
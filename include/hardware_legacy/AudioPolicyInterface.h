@@ -166,6 +166,33 @@ public:
     virtual status_t    dump(int fd) = 0;
 
     virtual bool isOffloadSupported(const audio_offload_info_t& offloadInfo) = 0;
+
+    // Variants of the query methods above returning the state published by the policy manager at
+    // the end of its last state change. Implementations publishing such a state can be queried
+    // through these methods concurrently with any other method call. The default implementations
+    // read the current state and must be serialized with other calls like the methods they
+    // forward to.
+    virtual bool isStreamActiveSnapshot(int stream, uint32_t inPastMs = 0) const
+    {
+        return isStreamActive(stream, inPastMs);
+    }
+    virtual bool isStreamActiveRemotelySnapshot(int stream, uint32_t inPastMs = 0) const
+    {
+        return isStreamActiveRemotely(stream, inPastMs);
+    }
+    virtual audio_devices_t getDevicesForStreamSnapshot(AudioSystem::stream_type stream)
+    {
+        return getDevicesForStream(stream);
+    }
+    virtual status_t getStreamVolumeIndexSnapshot(AudioSystem::stream_type stream,
+                                                  int *index,
+                                                  audio_devices_t device)
+    {
+        return getStreamVolumeIndex(stream, index, device);
+    }
+
+    // pass key value pairs to the policy manager, e.g. test commands. Ignored by default.
+    virtual void setParameters(const String8& keyValuePairs) {}
 };
 
 
@@ -250,6 +277,10 @@ public:
                                      audio_io_handle_t srcOutput,
                                      audio_io_handle_t dstOutput) = 0;
 
+    // send the commands held back by the client, if any. Called by the policy manager before
+    // waiting for the commands already issued to take effect.
+    virtual void flushCommands() {}
+
 };
 
 extern "C" AudioPolicyInterface* createAudioPolicyManager(AudioPolicyClientInterface *clientInterface);
@@ -17,12 +17,14 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <cutils/config_utils.h>
 #include <cutils/misc.h>
 #include <utils/Timers.h>
 #include <utils/Errors.h>
 #include <utils/KeyedVector.h>
 #include <utils/SortedVector.h>
+#include <utils/threads.h>
 #include <hardware_legacy/AudioPolicyInterface.h>
 
 
@@ -30,6 +32,11 @@ namespace android_audio_legacy {
     using android::KeyedVector;
     using android::DefaultKeyedVector;
     using android::SortedVector;
+    using android::Thread;
+    using android::Mutex;
+    using android::AutoMutex;
+    using android::Condition;
+    using android::sp;
 
 // ----------------------------------------------------------------------------
 
@@ -52,10 +59,16 @@ namespace android_audio_legacy {
 
 #define NUM_VOL_CURVE_KNEES 2
 
+// Max number of per device volume indices published for each stream. See publishSnapshot()
+#define MAX_SNAPSHOT_VOLUME_INDICES 32
+
 // Default minimum length allowed for offloading a compressed track
 // Can be overridden by the audio.offload.min.duration.secs property
 #define OFFLOAD_DEFAULT_MIN_DURATION_SECS 60
 
+// setParameters() key clearing the API call statistics reported by dump()
+#define AUDIO_POLICY_RESET_STATS_KEY "policy_reset_stats"
+
 // ----------------------------------------------------------------------------
 // AudioPolicyManagerBase implements audio policy manager behavior common to all platforms.
 // Each platform must implement an AudioPolicyManager class derived from AudioPolicyManagerBase
@@ -72,7 +85,10 @@ class AudioPolicyManagerBase: public AudioPolicyInterface
 {
 
 public:
-                AudioPolicyManagerBase(AudioPolicyClientInterface *clientInterface);
+                // configFile, if not NULL, is loaded instead of the vendor and system
+                // audio_policy.conf files, e.g. by the audio_policy_replay host tool
+                AudioPolicyManagerBase(AudioPolicyClientInterface *clientInterface,
+                                       const char *configFile = NULL);
         virtual ~AudioPolicyManagerBase();
 
         // AudioPolicyInterface
@@ -148,6 +164,33 @@ public:
 
         virtual bool isOffloadSupported(const audio_offload_info_t& offloadInfo);
 
+        // lock free queries on the state published by publishSnapshot()
+        virtual bool isStreamActiveSnapshot(int stream, uint32_t inPastMs = 0) const;
+        virtual bool isStreamActiveRemotelySnapshot(int stream, uint32_t inPastMs = 0) const;
+        virtual audio_devices_t getDevicesForStreamSnapshot(AudioSystem::stream_type stream);
+        virtual status_t getStreamVolumeIndexSnapshot(AudioSystem::stream_type stream,
+                                                      int *index,
+                                                      audio_devices_t device);
+
+        // Between beginRoutingTransaction() and commitRoutingTransaction(), device connection,
+        // forced usage and phone state changes only update the policy state. Output selection and
+        // routing are then updated once for all changes by commitRoutingTransaction(), issuing at
+        // most one routing command per output. Transactions can be nested.
+        // The audio policy HAL has no entry point for transactions: they are available to policy
+        // managers derived from this class and to tools driving the policy manager directly.
+        void beginRoutingTransaction();
+        void commitRoutingTransaction();
+
+        // AUDIO_POLICY_RESET_STATS_KEY=1 clears the API call statistics. In AUDIO_POLICY_TEST
+        // builds, test commands ("test_cmd_policy=1;...") are queued for threadLoop(). The legacy
+        // audio policy HAL has no set_parameters entry point: only code calling this method
+        // directly can send test commands.
+        virtual void setParameters(const String8& keyValuePairs);
+
+        // returns false and logs the first misplaced entry if one of the name tables looked up
+        // by binary search when parsing audio_policy.conf is not sorted
+        static bool checkConfigNameTables();
+
 protected:
 
         enum routing_strategy {
@@ -160,12 +203,29 @@ protected:
             NUM_STRATEGIES
         };
 
+        // state other than available output devices that the device selected for a strategy
+        // depends on. See getStrategyDependencies()
+        enum strategy_dependency {
+            DEPENDS_ON_PHONE_STATE      = 0x01,
+            DEPENDS_ON_FORCE_COMM       = 0x02,
+            DEPENDS_ON_FORCE_MEDIA      = 0x04,
+            DEPENDS_ON_FORCE_DOCK       = 0x08,
+            DEPENDS_ON_FORCE_SYSTEM     = 0x10,
+            DEPENDS_ON_A2DP_OUTPUT      = 0x20, // A2DP output opened, closed or suspended
+            DEPENDS_ON_STREAM_ACTIVITY  = 0x40, // always recomputed by updateDevicesAndOutputs()
+            DEPENDS_ON_ALL              = 0x7F,
+        };
+
         // 4 points to define the volume attenuation curve, each characterized by the volume
         // index (from 0 to 100) at which they apply, and the attenuation in dB at that index.
         // we use 100 steps to avoid rounding errors when computing the volume in volIndexToAmpl()
 
         enum { VOLMIN = 0, VOLKNEE1 = 1, VOLKNEE2 = 2, VOLMAX = 3, VOLCNT = 4};
 
+        // number of entries in the amplitude tables precomputed from the volume curves:
+        // one per volume curve index from 0 to 100
+        enum { VOL_TABLE_SIZE = 101 };
+
         class VolumeCurvePoint
         {
         public:
@@ -189,6 +249,7 @@ protected:
                     ~HwModule();
 
             void dump(int fd);
+            void dumpJson(String8& result) const;
 
             const char *const mName; // base name of the audio HW module (primary, a2dp ...)
             audio_module_handle_t mHandle;
@@ -214,6 +275,7 @@ protected:
                                      audio_output_flags_t flags) const;
 
             void dump(int fd);
+            void dumpJson(String8& result) const;
             void log();
 
             // by convention, "0' in the first entry in mSamplingRates, mChannelMasks or mFormats
@@ -227,6 +289,148 @@ protected:
             audio_output_flags_t mFlags; // attribute flags (e.g primary output,
                                                 // direct output...). For outputs only.
             HwModule *mModule;                     // audio HW module exposing this I/O stream
+            SortedVector <uint32_t> mSortedSamplingRates; // mSamplingRates sorted for lookups
+                                                // by the profile index. See updateProfileIndex()
+        };
+
+        // key of the profile compatibility index: profiles are indexed under each supported
+        // device and under AUDIO_DEVICE_NONE, for each supported format and channel mask.
+        class ProfileIndexKey
+        {
+        public:
+            ProfileIndexKey(audio_devices_t device, audio_format_t format,
+                            audio_channel_mask_t channelMask)
+                : mDevice(device), mFormat(format), mChannelMask(channelMask) {}
+            ProfileIndexKey()
+                : mDevice(AUDIO_DEVICE_NONE), mFormat(AUDIO_FORMAT_DEFAULT), mChannelMask(0) {}
+
+            bool operator<(const ProfileIndexKey& other) const;
+            bool operator==(const ProfileIndexKey& other) const;
+
+            audio_devices_t mDevice;    // single device bit, AUDIO_DEVICE_BIT_IN excluded
+            audio_format_t mFormat;
+            audio_channel_mask_t mChannelMask;
+        };
+        typedef KeyedVector<ProfileIndexKey, Vector<IOProfile *> > ProfileIndex;
+
+        // implementation of getOutput(), called once the call is timed and before it is traced
+        audio_io_handle_t getOutputInt(AudioSystem::stream_type stream,
+                                       uint32_t samplingRate,
+                                       audio_format_t format,
+                                       audio_channel_mask_t channelMask,
+                                       AudioSystem::output_flags flags,
+                                       const audio_offload_info_t *offloadInfo);
+        // implementation of getInput(), called once the call is timed and before it is traced
+        audio_io_handle_t getInputInt(int inputSource,
+                                      uint32_t samplingRate,
+                                      audio_format_t format,
+                                      audio_channel_mask_t channelMask,
+                                      AudioSystem::audio_in_acoustics acoustics);
+
+        // key of the getOutput() cache: attributes of the requested output
+        class OutputCacheKey
+        {
+        public:
+            OutputCacheKey(AudioSystem::stream_type stream, uint32_t samplingRate,
+                           audio_format_t format, audio_channel_mask_t channelMask,
+                           AudioSystem::output_flags flags)
+                : mStream(stream), mSamplingRate(samplingRate), mFormat(format),
+                  mChannelMask(channelMask), mFlags(flags) {}
+            OutputCacheKey()
+                : mStream(AudioSystem::DEFAULT), mSamplingRate(0), mFormat(AUDIO_FORMAT_DEFAULT),
+                  mChannelMask(0), mFlags(AudioSystem::OUTPUT_FLAG_INDIRECT) {}
+
+            bool operator<(const OutputCacheKey& other) const;
+            bool operator==(const OutputCacheKey& other) const;
+
+            AudioSystem::stream_type mStream;
+            uint32_t mSamplingRate;
+            audio_format_t mFormat;
+            audio_channel_mask_t mChannelMask;
+            AudioSystem::output_flags mFlags;
+        };
+
+        // maximum number of outputs opened at the same time: each open output is assigned a
+        // slot in [0, MAX_OUTPUTS) by addOutput() so that sets of outputs fit in a bit field
+        static const uint32_t MAX_OUTPUTS = 64;
+
+        // set of open outputs identified by their slot (AudioOutputDescriptor::mSlot).
+        // Iterate with: for (uint32_t s = set.first(); s < MAX_OUTPUTS; s = set.next(s))
+        class OutputSet
+        {
+        public:
+            OutputSet() : mSlots(0) {}
+
+            void add(uint32_t slot) { mSlots |= (uint64_t)1 << slot; }
+            void remove(uint32_t slot) { mSlots &= ~((uint64_t)1 << slot); }
+            bool contains(uint32_t slot) const { return (mSlots & ((uint64_t)1 << slot)) != 0; }
+            bool isEmpty() const { return mSlots == 0; }
+            size_t size() const { return __builtin_popcountll(mSlots); }
+            // lowest slot in the set, MAX_OUTPUTS if empty
+            uint32_t first() const { return (mSlots == 0) ? MAX_OUTPUTS : __builtin_ctzll(mSlots); }
+            // lowest slot in the set after the specified slot, MAX_OUTPUTS if none
+            uint32_t next(uint32_t slot) const;
+
+            bool operator==(const OutputSet& other) const { return mSlots == other.mSlots; }
+            bool operator!=(const OutputSet& other) const { return mSlots != other.mSlots; }
+
+            uint64_t mSlots;
+        };
+
+        // fixed capacity storage for descriptors, used instead of the heap as outputs, inputs and
+        // effects are opened and closed frequently (USB/BT reconnections, offload track switches).
+        // Backs the operator new and delete of AudioOutputDescriptor, AudioInputDescriptor and
+        // EffectDescriptor so that descriptors are still created and destroyed with new and delete.
+        // Falls back to the heap when all N (at most 64) entries are in use or for classes
+        // derived from T. Not thread safe: descriptors are created and deleted by the policy
+        // manager under the audio policy service lock.
+        template <class T, uint32_t N>
+        class DescriptorPool
+        {
+        public:
+            DescriptorPool() : mUsed(0), mPeak(0), mOverflows(0) {}
+
+            // returns storage for an object of the specified size
+            void *alloc(size_t size)
+            {
+                uint64_t freeEntries = ~mUsed & ((N == 64) ? ~(uint64_t)0 : (((uint64_t)1 << N) - 1));
+                if (size != sizeof(T) || freeEntries == 0) {
+                    mOverflows++;
+                    return ::operator new(size);
+                }
+                uint32_t entry = __builtin_ctzll(freeEntries);
+                mUsed |= (uint64_t)1 << entry;
+                if (used() > mPeak) {
+                    mPeak = used();
+                }
+                return mStorage[entry];
+            }
+            // releases storage returned by alloc()
+            void release(void *object)
+            {
+                if (object == NULL) {
+                    return;
+                }
+                uint64_t *storage = reinterpret_cast<uint64_t *>(object);
+                if (storage >= mStorage[0] && storage < mStorage[N]) {
+                    mUsed &= ~((uint64_t)1 << ((storage - mStorage[0]) / ENTRY_WORDS));
+                } else {
+                    ::operator delete(object);
+                }
+            }
+
+            uint32_t used() const { return __builtin_popcountll(mUsed); }
+            uint32_t capacity() const { return N; }
+            uint32_t peak() const { return mPeak; }
+            uint32_t overflows() const { return mOverflows; }
+
+        private:
+            static const size_t ENTRY_WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+            uint64_t mUsed;         // bit field of entries in use
+            uint32_t mPeak;         // highest number of entries used at the same time
+            uint32_t mOverflows;    // number of allocations served by the heap
+            uint64_t mStorage[N][ENTRY_WORDS];
         };
 
         // default volume curve
@@ -246,6 +450,94 @@ protected:
         // default volume curves per stream and device category. See initializeVolumeCurves()
         static const VolumeCurvePoint *sVolumeProfiles[AudioSystem::NUM_STREAM_TYPES][DEVICE_CATEGORY_CNT];
 
+        // shape of volume ramps applied by checkAndSetVolume(). See scheduleVolumeRamp()
+        enum volume_ramp_curve {
+            RAMP_CURVE_LINEAR,      // linear in amplitude
+            RAMP_CURVE_DB,          // linear in dB
+            RAMP_CURVE_S_CURVE,     // smoothstep in amplitude: slow start and end
+            NUM_RAMP_CURVES
+        };
+
+        // volume ramp scheduled on one stream of an output
+        class VolumeRamp
+        {
+        public:
+            VolumeRamp() : mStartTime(0), mEndTime(0), mFrom(0), mTo(0) {}
+
+            // volume at the specified time
+            float valueAt(nsecs_t time, volume_ramp_curve curve) const;
+            bool isPending(nsecs_t time) const { return time < mEndTime; }
+
+            nsecs_t mStartTime;     // time at which the ramp starts
+            nsecs_t mEndTime;       // time at which the target volume is reached
+            float mFrom;            // volume before the ramp
+            float mTo;              // target volume
+        };
+
+        // sends the steps of the volume ramps in progress to the client, one volume command per
+        // stream and output every VOLUME_RAMP_STEP_MS. Started by the policy manager when volume
+        // ramps are enabled. Steps are sent with mLock held so that once startRamp() or
+        // cancelRamps() returns, no step of a replaced or cancelled ramp can follow.
+        // sends the steps of volume ramps, and the volumes set directly on streams while ramps
+        // are enabled. Each output stream has a generation, changed whenever a ramp is started
+        // or cancelled or a volume is set directly: ramp steps are sent without mLock held and
+        // a step is dropped if the generation of its stream changed since it was computed.
+        class VolumeRampThread : public Thread
+        {
+        public:
+            VolumeRampThread(AudioPolicyClientInterface *clientInterface,
+                             volume_ramp_curve curve);
+
+            // start a ramp on a stream of an output, replacing the ramp in progress if any
+            void startRamp(int stream, audio_io_handle_t output, const VolumeRamp& ramp);
+            // cancel the ramps in progress on one stream, or on all streams if stream is -1,
+            // of an output. Returns once no step of a cancelled ramp can be sent anymore.
+            void cancelRamps(audio_io_handle_t output, int stream = -1);
+            // cancel the ramp in progress on a stream of an output and send the volume from the
+            // calling thread, after any ramp step being sent for this stream
+            status_t setVolume(int stream, audio_io_handle_t output, float volume, int delayMs);
+            void exit();
+
+        private:
+            class ActiveRamp
+            {
+            public:
+                audio_io_handle_t mOutput;
+                int mStream;
+                VolumeRamp mRamp;
+            };
+
+            class RampStep
+            {
+            public:
+                audio_io_handle_t mOutput;
+                int mStream;
+                float mVolume;
+                uint32_t mGeneration;   // generation of the stream when the step was computed
+            };
+
+            virtual bool threadLoop();
+
+            static int64_t rampKey(audio_io_handle_t output, int stream)
+            {
+                return ((int64_t)output << 32) | (uint32_t)stream;
+            }
+            // give new generations to the streams matching cancelRamps() arguments, remove
+            // their ramps and wait until no step is being sent for them
+            void cancelRamps_l(audio_io_handle_t output, int stream);
+
+            AudioPolicyClientInterface *mpClientInterface;
+            const volume_ramp_curve mCurve;
+            Mutex mLock;
+            Condition mWaitWorkCV;          // signaled when a ramp is started or on exit
+            Condition mSendCV;              // signaled when a ramp step has been sent
+            Vector<ActiveRamp> mRamps;      // ramps in progress
+            KeyedVector<int64_t, uint32_t> mGenerations;    // rampKey() -> generation
+            uint32_t mNextGeneration;
+            bool mSending;                  // true while the step in mSendingKey is sent
+            int64_t mSendingKey;            // rampKey() of the step being sent
+        };
+
         // descriptor for audio outputs. Used to maintain current configuration of each opened audio output
         // and keep track of the usage of this output by each audio stream type.
         class AudioOutputDescriptor
@@ -253,10 +545,17 @@ protected:
         public:
             AudioOutputDescriptor(const IOProfile *profile);
 
+            // allocated from sOutputDescPool
+            static void *operator new(size_t size);
+            static void operator delete(void *ptr);
+
             status_t    dump(int fd);
+            void        dumpJson(String8& result) const;
 
             audio_devices_t device() const;
             void changeRefCount(AudioSystem::stream_type stream, int delta);
+            // record the time at which the last track of a stream was stopped
+            void setStopTime(AudioSystem::stream_type stream, nsecs_t stopTime);
 
             bool isDuplicated() const { return (mOutput1 != NULL && mOutput2 != NULL); }
             audio_devices_t supportedDevices();
@@ -271,6 +570,7 @@ protected:
                              nsecs_t sysTime = 0) const;
 
             audio_io_handle_t mId;              // output handle
+            uint32_t mSlot;                     // slot in OutputSet, MAX_OUTPUTS if none
             uint32_t mSamplingRate;             //
             audio_format_t mFormat;             //
             audio_channel_mask_t mChannelMask;     // output configuration
@@ -278,10 +578,15 @@ protected:
             audio_output_flags_t mFlags;   //
             audio_devices_t mDevice;                   // current device this output is routed to
             uint32_t mRefCount[AudioSystem::NUM_STREAM_TYPES]; // number of streams of each type using this output
-            nsecs_t mStopTime[AudioSystem::NUM_STREAM_TYPES];
+            nsecs_t mStopTime[AudioSystem::NUM_STREAM_TYPES];  // must be updated with setStopTime()
+            uint32_t mActiveStreams;            // bit field of streams with a non zero mRefCount
+            uint32_t mStrategyRefCount[NUM_STRATEGIES]; // sum of mRefCount for streams of each strategy
+            nsecs_t mStrategyStopTime[NUM_STRATEGIES];  // most recent mStopTime for each strategy
+            nsecs_t mLastStopTime;              // most recent mStopTime for all streams
             AudioOutputDescriptor *mOutput1;    // used by duplicated outputs: first output
             AudioOutputDescriptor *mOutput2;    // used by duplicated outputs: second output
             float mCurVolume[AudioSystem::NUM_STREAM_TYPES];   // current stream volume
+            VolumeRamp mVolumeRamp[AudioSystem::NUM_STREAM_TYPES]; // last volume ramp per stream
             int mMuteCount[AudioSystem::NUM_STREAM_TYPES];     // mute request counter
             const IOProfile *mProfile;          // I/O profile this output derives from
             bool mStrategyMutedByDevice[NUM_STRATEGIES]; // strategies muted because of incompatible
@@ -297,7 +602,12 @@ protected:
         public:
             AudioInputDescriptor(const IOProfile *profile);
 
+            // allocated from sInputDescPool
+            static void *operator new(size_t size);
+            static void operator delete(void *ptr);
+
             status_t    dump(int fd);
+            void        dumpJson(String8& result) const;
 
             audio_io_handle_t mId;                      // input handle
             uint32_t mSamplingRate;                     //
@@ -316,7 +626,11 @@ protected:
             StreamDescriptor();
 
             int getVolumeIndex(audio_devices_t device);
+            // set the volume curve for a device category and rebuild the corresponding
+            // amplitude table
+            void setVolumeCurve(device_category deviceCategory, const VolumeCurvePoint *curve);
             void dump(int fd);
+            void dumpJson(String8& result) const;
 
             int mIndexMin;      // min volume index
             int mIndexMax;      // max volume index
@@ -324,20 +638,213 @@ protected:
             bool mCanBeMuted;   // true is the stream can be muted
 
             const VolumeCurvePoint *mVolumeCurve[DEVICE_CATEGORY_CNT];
+            // linear amplitude for each volume curve index, computed from mVolumeCurve
+            float mVolumeAmpl[DEVICE_CATEGORY_CNT][VOL_TABLE_SIZE];
+        };
+
+        // routing, activity and volume state published for lock free queries at the end of each
+        // state change. See publishSnapshot()
+        class StateSnapshot
+        {
+        public:
+            uint32_t mRefCount[AudioSystem::NUM_STREAM_TYPES];  // sum over all outputs
+            nsecs_t mStopTime[AudioSystem::NUM_STREAM_TYPES];   // most recent over all outputs
+            uint32_t mRemoteRefCount[AudioSystem::NUM_STREAM_TYPES]; // same for outputs routed
+            nsecs_t mRemoteStopTime[AudioSystem::NUM_STREAM_TYPES];  // to remote devices
+            audio_devices_t mDeviceForStrategy[NUM_STRATEGIES];
+            size_t mVolumeIndexCount[AudioSystem::NUM_STREAM_TYPES];
+            // copy of StreamDescriptor::mIndexCur
+            audio_devices_t mVolumeDevice[AudioSystem::NUM_STREAM_TYPES][MAX_SNAPSHOT_VOLUME_INDICES];
+            int mVolumeIndex[AudioSystem::NUM_STREAM_TYPES][MAX_SNAPSHOT_VOLUME_INDICES];
         };
 
         // stream descriptor used for volume control
         class EffectDescriptor
         {
         public:
+            // allocated from sEffectDescPool
+            static void *operator new(size_t size);
+            static void operator delete(void *ptr);
 
             status_t dump(int fd);
+            void dumpJson(String8& result) const;
 
             int mIo;                // io the effect is attached to
             routing_strategy mStrategy; // routing strategy the effect is associated to
             audio_session_t mSession;   // audio session the effect is on
             effect_descriptor_t mDesc;  // effect descriptor
             bool mEnabled;              // enabled state: CPU load being used or not
+            audio_module_handle_t mModule; // HW module of mIo when usage was last accounted
+        };
+
+        // resources used by the effects attached to one io or HW module. See updateEffectUsage()
+        class EffectUsage
+        {
+        public:
+            EffectUsage() : mCpuLoad(0), mMemory(0), mNonOffloadableCount(0) {}
+
+            uint32_t mCpuLoad;              // CPU load of enabled effects
+            uint32_t mMemory;               // memory of registered effects
+            uint32_t mNonOffloadableCount;  // number of enabled non offloadable media effects
+        };
+
+        // public API calls timed for dump(). See ApiTimer
+        enum api_id {
+            API_SET_DEVICE_CONNECTION_STATE,
+            API_SET_PHONE_STATE,
+            API_SET_FORCE_USE,
+            API_COMMIT_ROUTING_TRANSACTION,
+            API_GET_OUTPUT,
+            API_START_OUTPUT,
+            API_STOP_OUTPUT,
+            API_RELEASE_OUTPUT,
+            API_GET_INPUT,
+            API_START_INPUT,
+            API_STOP_INPUT,
+            API_RELEASE_INPUT,
+            API_INIT_STREAM_VOLUME,
+            API_SET_STREAM_VOLUME_INDEX,
+            API_GET_OUTPUT_FOR_EFFECT,
+            API_REGISTER_EFFECT,
+            API_UNREGISTER_EFFECT,
+            API_SET_EFFECT_ENABLED,
+            API_IS_OFFLOAD_SUPPORTED,
+
+            NUM_APIS
+        };
+
+        // number of buckets in API call latency histograms: bucket 0 counts calls shorter than
+        // 1 us, bucket n calls between 2^(n-1) and 2^n us and the last bucket all longer calls.
+        static const int NUM_LATENCY_BUCKETS = 16;
+
+        class ApiStats
+        {
+        public:
+            uint32_t mCount;    // number of calls
+            nsecs_t mTotalTime; // cumulated duration of calls
+            nsecs_t mMaxTime;   // duration of the longest call
+            uint32_t mHistogram[NUM_LATENCY_BUCKETS];   // number of calls per duration range
+        };
+
+        // measures the duration of a public API call from construction to destruction and
+        // maintains the nesting level of calls in mApiDepth
+        class ApiTimer
+        {
+        public:
+            ApiTimer(AudioPolicyManagerBase *apm, api_id api);
+            ~ApiTimer();
+
+        private:
+            AudioPolicyManagerBase *mApm;
+            api_id mApi;
+            nsecs_t mStartTime;
+        };
+
+        // policy calls received and commands sent to the client recorded by traceEvent().
+        // Policy calls made by the policy manager itself while handling a call are not recorded.
+        // Queries (getParameters() on the client, policy calls without side effects) are not
+        // recorded either.
+        enum trace_event_type {
+            TRACE_CONNECT,              // device, address
+            TRACE_DISCONNECT,           // device, address
+            TRACE_PHONE_STATE,          // state
+            TRACE_FORCE_USE,            // usage, config
+            TRACE_INIT_STREAM_VOLUME,   // stream, indexMin, indexMax
+            TRACE_GET_OUTPUT,           // output, stream, samplingRate, format, channelMask, flags
+            TRACE_START_OUTPUT,         // output, stream, session
+            TRACE_STOP_OUTPUT,          // output, stream, session
+            TRACE_RELEASE_OUTPUT,       // output
+            TRACE_GET_INPUT,            // input, source, samplingRate, format, channelMask, acoustics
+            TRACE_START_INPUT,          // input
+            TRACE_STOP_INPUT,           // input
+            TRACE_RELEASE_INPUT,        // input
+            TRACE_SET_VOLUME_INDEX,     // stream, index, device
+            TRACE_REGISTER_EFFECT,      // id, io, strategy, session, flags, cpuLoad << 16 | memory
+            TRACE_UNREGISTER_EFFECT,    // id
+            TRACE_SET_EFFECT_ENABLED,   // id, enabled
+            TRACE_BEGIN_TRANSACTION,
+            TRACE_COMMIT_TRANSACTION,
+            // commands sent to the client, recorded by TraceClient
+            TRACE_CMD_LOAD_HW_MODULE,   // module, name
+            TRACE_CMD_OPEN_OUTPUT,      // output, module, devices, samplingRate, format, flags
+            TRACE_CMD_OPEN_DUPLICATE_OUTPUT,    // output, output1, output2
+            TRACE_CMD_CLOSE_OUTPUT,     // output
+            TRACE_CMD_SUSPEND_OUTPUT,   // output
+            TRACE_CMD_RESTORE_OUTPUT,   // output
+            TRACE_CMD_OPEN_INPUT,       // input, module, devices, samplingRate, format, channelMask
+            TRACE_CMD_CLOSE_INPUT,      // input
+            TRACE_CMD_ROUTING,          // io, device, delayMs
+            TRACE_CMD_PARAMETERS,       // io, delayMs, key value pairs
+            TRACE_CMD_VOLUME,           // stream, output, volume x 1000, delayMs
+            TRACE_CMD_VOICE_VOLUME,     // volume x 1000, delayMs
+            TRACE_CMD_INVALIDATE_STREAM,    // stream
+            TRACE_CMD_START_TONE,       // tone, stream
+            TRACE_CMD_STOP_TONE,
+            TRACE_CMD_MOVE_EFFECTS,     // session, srcOutput, dstOutput
+        };
+
+        // length of the string recorded with an event, including the terminating NUL
+        static const size_t TRACE_STRING_LEN = 64;
+
+        class TraceEvent
+        {
+        public:
+            nsecs_t mTime;
+            trace_event_type mType;
+            int32_t mArgs[6];
+            char mString[TRACE_STRING_LEN];  // device address, module name or parameters
+        };
+
+        // number of events kept in the trace ring buffer
+        static const uint32_t TRACE_SIZE = 512;
+
+        // client interface used by the policy manager when tracing is enabled: records the
+        // commands sent to the client and forwards them
+        class TraceClient : public AudioPolicyClientInterface
+        {
+        public:
+            TraceClient(AudioPolicyManagerBase *apm, AudioPolicyClientInterface *client)
+                : mApm(apm), mClient(client) {}
+            virtual ~TraceClient() {}
+
+            virtual audio_module_handle_t loadHwModule(const char *name);
+            virtual audio_io_handle_t openOutput(audio_module_handle_t module,
+                                                 audio_devices_t *pDevices,
+                                                 uint32_t *pSamplingRate,
+                                                 audio_format_t *pFormat,
+                                                 audio_channel_mask_t *pChannelMask,
+                                                 uint32_t *pLatencyMs,
+                                                 audio_output_flags_t flags,
+                                                 const audio_offload_info_t *offloadInfo);
+            virtual audio_io_handle_t openDuplicateOutput(audio_io_handle_t output1,
+                                                          audio_io_handle_t output2);
+            virtual status_t closeOutput(audio_io_handle_t output);
+            virtual status_t suspendOutput(audio_io_handle_t output);
+            virtual status_t restoreOutput(audio_io_handle_t output);
+            virtual audio_io_handle_t openInput(audio_module_handle_t module,
+                                                audio_devices_t *pDevices,
+                                                uint32_t *pSamplingRate,
+                                                audio_format_t *pFormat,
+                                                audio_channel_mask_t *pChannelMask);
+            virtual status_t closeInput(audio_io_handle_t input);
+            virtual status_t setStreamVolume(AudioSystem::stream_type stream, float volume,
+                                             audio_io_handle_t output, int delayMs);
+            virtual status_t invalidateStream(AudioSystem::stream_type stream);
+            virtual void setParameters(audio_io_handle_t ioHandle, const String8& keyValuePairs,
+                                       int delayMs);
+            virtual String8 getParameters(audio_io_handle_t ioHandle, const String8& keys);
+            virtual status_t startTone(ToneGenerator::tone_type tone,
+                                       AudioSystem::stream_type stream);
+            virtual status_t stopTone();
+            virtual status_t setVoiceVolume(float volume, int delayMs);
+            virtual status_t moveEffects(audio_session_t session,
+                                         audio_io_handle_t srcOutput,
+                                         audio_io_handle_t dstOutput);
+            virtual void flushCommands();
+
+        private:
+            AudioPolicyManagerBase *mApm;
+            AudioPolicyClientInterface *mClient;
         };
 
         void addOutput(audio_io_handle_t id, AudioOutputDescriptor *outputDesc);
@@ -360,6 +867,18 @@ protected:
         virtual audio_devices_t getDeviceForStrategy(routing_strategy strategy,
                                                      bool fromCache);
 
+        // return the state read by getDeviceForStrategy() for the specified strategy as a
+        // combination of strategy_dependency flags, and in devices the output devices it can select.
+        // updateDevicesAndOutputs() only recomputes strategies for which this state has changed.
+        // The default implementation reports that every strategy depends on all state, which
+        // disables the cache: policy managers using the getDeviceForStrategy() implementation of
+        // this class opt in by returning getDefaultStrategyDependencies().
+        virtual uint32_t getStrategyDependencies(routing_strategy strategy,
+                                                 audio_devices_t *devices);
+        // dependencies of the rules implemented by AudioPolicyManagerBase::getDeviceForStrategy()
+        uint32_t getDefaultStrategyDependencies(routing_strategy strategy,
+                                                audio_devices_t *devices);
+
         // change the route of the specified output. Returns the number of ms we have slept to
         // allow new routing to take effect in certain cases.
         uint32_t setOutputDevice(audio_io_handle_t output,
@@ -385,6 +904,13 @@ protected:
         // check that volume change is permitted, compute and send new volume to audio hardware
         status_t checkAndSetVolume(int stream, int index, audio_io_handle_t output, audio_devices_t device, int delayMs = 0, bool force = false);
 
+        // ramp the volume of an active stream from its current volume to the target volume. The
+        // steps are sent by mVolumeRampThread, which replaces a ramp still in progress on the
+        // same stream and output.
+        void scheduleVolumeRamp(int stream, float from, float volume, audio_io_handle_t output,
+                                int delayMs);
+        static volume_ramp_curve parseVolumeRampCurve(const char *name);
+
         // apply all stream volumes to the specified output and device
         void applyStreamVolumes(audio_io_handle_t output, audio_devices_t device, int delayMs = 0, bool force = false);
 
@@ -460,6 +986,46 @@ protected:
 
         void updateDevicesAndOutputs();
 
+        // mute media and sonification strategies on all outputs when entering a call and return
+        // the delay to apply to the device switch. Called by setPhoneState()
+        int muteStrategiesForCall();
+
+        // record an event in the trace ring buffer if enabled by property audio.policy.trace.
+        // Can be called without the policy service lock, e.g. by the volume ramp thread.
+        void traceEvent(trace_event_type type,
+                        int32_t arg0 = 0, int32_t arg1 = 0, int32_t arg2 = 0,
+                        int32_t arg3 = 0, int32_t arg4 = 0, int32_t arg5 = 0);
+        // same as traceEvent() with a string truncated to TRACE_STRING_LEN - 1 characters
+        void traceStringEvent(trace_event_type type, const char *string,
+                              int32_t arg0 = 0, int32_t arg1 = 0, int32_t arg2 = 0,
+                              int32_t arg3 = 0, int32_t arg4 = 0, int32_t arg5 = 0);
+        // dump recorded events, oldest first, in the format read by the audio_policy_replay
+        // host tool with client commands and timestamps as comments
+        void dumpTrace(int fd);
+
+        // dump the state in JSON format. Selected by dump() when property
+        // audio.policy.dump.format is "json"
+        status_t dumpJson(int fd);
+        // clear API call statistics. Done by setParameters() and by dump() when property
+        // audio.policy.dump.reset changes
+        void resetApiStats();
+        // append a JSON string literal for str to result
+        static void appendJsonString(String8& result, const char *str);
+
+        // copy current state to mSnapshot. Must be called at the end of each public method
+        // changing routing, stream activity or volume indices.
+        void publishSnapshot();
+        // returns true if stream was active in the past inPastMs given the published refCount and
+        // stopTime
+        static bool isSnapshotStreamActive(uint32_t refCount, nsecs_t stopTime, uint32_t inPastMs);
+
+        // force recomputation of all strategies at next updateDevicesAndOutputs(). Must be called
+        // when a condition not covered by getStrategyDependencies() changes
+        void invalidateDevicesForStrategies() { mDeviceForStrategyValid = false; }
+        // must be called when outputs are opened or closed or when a change of state can modify
+        // the output selected by getOutput()
+        void invalidateOutputCache() { mOutputCache.clear(); }
+
         virtual uint32_t getMaxEffectsCpuLoad();
         virtual uint32_t getMaxEffectsMemory();
 #ifdef AUDIO_POLICY_TEST
@@ -476,10 +1042,10 @@ protected:
         // extract one device relevant for volume control from multiple device selection
         static audio_devices_t getDeviceForVolume(audio_devices_t device);
 
-        SortedVector<audio_io_handle_t> getOutputsForDevice(audio_devices_t device,
-                        DefaultKeyedVector<audio_io_handle_t, AudioOutputDescriptor *> openOutputs);
-        bool vectorsEqual(SortedVector<audio_io_handle_t>& outputs1,
-                                           SortedVector<audio_io_handle_t>& outputs2);
+        // returns the subset of outputs supporting all the specified devices
+        OutputSet getOutputsForDevice(audio_devices_t device, const OutputSet& outputs);
+        // removes an output from mOutputs and releases its slot. Does not delete the descriptor
+        void removeOutput(audio_io_handle_t id);
 
         // mute/unmute strategies using an incompatible device combination
         // if muting, wait for the audio in pcm buffer to be drained before proceeding
@@ -489,7 +1055,7 @@ protected:
                                             audio_devices_t prevDevice,
                                             uint32_t delayMs);
 
-        audio_io_handle_t selectOutput(const SortedVector<audio_io_handle_t>& outputs,
+        audio_io_handle_t selectOutput(const OutputSet& outputs,
                                        AudioSystem::output_flags flags);
         IOProfile *getInputProfile(audio_devices_t device,
                                    uint32_t samplingRate,
@@ -501,9 +1067,36 @@ protected:
                                                        audio_channel_mask_t channelMask,
                                                        audio_output_flags_t flags);
 
-        audio_io_handle_t selectOutputForEffects(const SortedVector<audio_io_handle_t>& outputs);
-
-        bool isNonOffloadableEffectEnabled();
+        // rebuild the output and input profile indices from profiles of loaded HW modules.
+        // Must be called when HW modules are loaded or when profile parameters are updated.
+        void updateProfileIndex();
+        static void addProfileToIndex(ProfileIndex& index, IOProfile *profile);
+        // return the first profile in index compatible with the specified parameters as defined
+        // by IOProfile::isCompatibleProfile() and supporting one of availableDevices
+        IOProfile *findIndexedProfile(const ProfileIndex& index,
+                                      audio_devices_t device,
+                                      uint32_t samplingRate,
+                                      audio_format_t format,
+                                      audio_channel_mask_t channelMask,
+                                      audio_output_flags_t flags,
+                                      audio_devices_t availableDevices);
+
+        audio_io_handle_t selectOutputForEffects(const OutputSet& outputs);
+
+        // returns true if a non offloadable effect is enabled on the media strategy
+        bool isNonOffloadableEffectEnabled() const { return mNonOffloadableEffectsEnabled != 0; }
+        // adds or removes the contribution of an effect in its current state (io, enabled) to
+        // mEffectUsage, mModuleEffectUsage, mNonOffloadableEffectsPerSession and
+        // mNonOffloadableEffectsEnabled
+        void updateEffectUsage(EffectDescriptor *pDesc, bool add);
+        static void updateEffectUsage(EffectUsage& usage, const EffectDescriptor *pDesc, bool add);
+        // returns the HW module an output or input is opened on, AUDIO_MODULE_HANDLE_NONE if
+        // unknown or for duplicated outputs
+        audio_module_handle_t getModuleForIo(audio_io_handle_t io) const;
+        // returns true if adding the specified CPU load and memory to the effects on io does not
+        // exceed the per io and per HW module budgets
+        bool checkEffectBudgets(audio_io_handle_t io, uint32_t cpuLoad, uint32_t memory) const;
+        static bool isNonOffloadableEffect(const EffectDescriptor *pDesc);
 
         //
         // Audio policy configuration file parsing (audio_policy.conf)
@@ -525,15 +1118,31 @@ protected:
         void loadGlobalConfig(cnode *root);
         status_t loadAudioPolicyConfig(const char *path);
         void defaultAudioPolicyConfig(void);
+        // binary snapshot of the global configuration and HW modules loaded from a configuration
+        // file, used instead of parsing the file again as long as its size and content hash and
+        // the build it was saved by are unchanged
+        static String8 getConfigCachePath(const char *path);
+        static uint64_t configHash(const char *data, size_t size);
+        static uint64_t buildHash();
+        status_t loadConfigCache(const char *cachePath, size_t configSize, uint64_t hash,
+                                 uint64_t build);
+        void saveConfigCache(const char *cachePath, size_t configSize, uint64_t hash,
+                             uint64_t build);
+        static void appendCacheProfile(Vector<uint32_t>& words, const IOProfile *profile);
+        static IOProfile *readCacheProfile(const uint32_t *words, size_t length, size_t *pos,
+                                           HwModule *module);
 
 
         AudioPolicyClientInterface *mpClientInterface;  // audio policy client interface
         audio_io_handle_t mPrimaryOutput;              // primary output handle
         // list of descriptors for outputs currently opened
         DefaultKeyedVector<audio_io_handle_t, AudioOutputDescriptor *> mOutputs;
-        // copy of mOutputs before setDeviceConnectionState() opens new outputs
-        // reset to mOutputs when updateDevicesAndOutputs() is called.
-        DefaultKeyedVector<audio_io_handle_t, AudioOutputDescriptor *> mPreviousOutputs;
+        // descriptors of outputs in mOutputs indexed by slot
+        AudioOutputDescriptor *mOutputSlots[MAX_OUTPUTS];
+        OutputSet mOpenOutputs;     // slots of outputs in mOutputs
+        // mOpenOutputs before setDeviceConnectionState() opens new outputs
+        // reset to mOpenOutputs when updateDevicesAndOutputs() is called.
+        OutputSet mPreviousOutputs;
 
         // list of input descriptors currently opened
         DefaultKeyedVector<audio_io_handle_t, AudioInputDescriptor *> mInputs;
@@ -552,6 +1161,14 @@ protected:
                                                                             // card=<card_number>;device=<><device_number>
         bool    mLimitRingtoneVolume;                                       // limit ringtone volume to music volume if headset connected
         audio_devices_t mDeviceForStrategy[NUM_STRATEGIES];
+        // state used by the last updateDevicesAndOutputs() to compute mDeviceForStrategy[]
+        bool mDeviceForStrategyValid;              // false if all strategies must be recomputed
+        audio_devices_t mCachedAvailableOutputDevices;
+        int mCachedPhoneState;
+        AudioSystem::forced_config mCachedForceUse[AudioSystem::NUM_FORCE_USE];
+        bool mCachedA2dpOutput;                    // true if A2DP output was open and not suspended
+        uint32_t mDeviceForStrategyHits;           // strategies not affected by an update
+        uint32_t mDeviceForStrategyRecomputes;     // strategies recomputed by an update
         float   mLastVoiceVolume;                                           // last voice volume value sent to audio HAL
 
         // Maximum CPU load allocated to audio effects in 0.1 MIPS (ARMv5TE, 0 WS memory) units
@@ -560,6 +1177,16 @@ protected:
         static const uint32_t MAX_EFFECTS_MEMORY = 512;
         uint32_t mTotalEffectsCpuLoad; // current CPU load used by effects
         uint32_t mTotalEffectsMemory;  // current memory used by effects
+        KeyedVector<audio_io_handle_t, EffectUsage> mEffectUsage;  // usage of effects per io
+        KeyedVector<audio_module_handle_t, EffectUsage> mModuleEffectUsage; // per HW module
+        // budgets from audio_policy.conf global_configuration, 0 if not limited
+        uint32_t mMaxEffectsCpuLoadPerIo;
+        uint32_t mMaxEffectsMemoryPerIo;
+        uint32_t mMaxEffectsCpuLoadPerModule;
+        uint32_t mMaxEffectsMemoryPerModule;
+        // number of enabled non offloadable media effects per session and in total
+        KeyedVector<audio_session_t, uint32_t> mNonOffloadableEffectsPerSession;
+        uint32_t mNonOffloadableEffectsEnabled;
         KeyedVector<int, EffectDescriptor *> mEffects;  // list of registered audio effects
         bool    mA2dpSuspended;  // true if A2DP output is suspended
         bool mHasA2dp; // true on platforms with support for bluetooth A2DP
@@ -573,9 +1200,69 @@ protected:
 
         Vector <HwModule *> mHwModules;
 
+        ProfileIndex mOutputProfileIndex;   // output profiles of loaded HW modules
+        ProfileIndex mInputProfileIndex;    // input profiles of loaded HW modules
+        bool mProfileIndexValid;            // false if the profile indices must be rebuilt
+
+        // max number of entries in mOutputCache
+        static const size_t MAX_OUTPUT_CACHE_SIZE = 32;
+        // mixer outputs selected by getOutput() for attributes not requiring a direct output
+        KeyedVector<OutputCacheKey, audio_io_handle_t> mOutputCache;
+        uint32_t mOutputCacheHits;
+        uint32_t mOutputCacheMisses;
+
+        static const uint32_t INPUT_DESCRIPTOR_POOL_SIZE = 16;
+        static const uint32_t EFFECT_DESCRIPTOR_POOL_SIZE = 32;
+        // shared by all policy manager instances as descriptors are allocated by operator new
+        static DescriptorPool<AudioOutputDescriptor, MAX_OUTPUTS> sOutputDescPool;
+        static DescriptorPool<AudioInputDescriptor, INPUT_DESCRIPTOR_POOL_SIZE> sInputDescPool;
+        static DescriptorPool<EffectDescriptor, EFFECT_DESCRIPTOR_POOL_SIZE> sEffectDescPool;
+
+        // changes deferred by a routing transaction. See beginRoutingTransaction()
+        enum {
+            ROUTING_CHANGE_DEVICE_CONNECTION = 0x1,
+            ROUTING_CHANGE_FORCE_USE = 0x2,
+            ROUTING_CHANGE_FORCE_VOLUME = 0x4,  // stream volumes must be applied to new devices
+            ROUTING_CHANGE_PHONE_STATE = 0x8,
+        };
+        uint32_t mRoutingTransactionDepth;       // nesting level of current routing transaction
+        uint32_t mRoutingTransactionChanges;     // changes to apply when committing
+        int mRoutingTransactionPhoneState;       // phone state when the transaction started
+        // outputs opened or left unused by device connection changes during the transaction
+        SortedVector<audio_io_handle_t> mRoutingTransactionOutputs;
+        uint32_t mRoutingTransactionCount;       // committed transactions with deferred changes
+        uint32_t mRoutingTransactionDeferred;    // changes deferred by committed transactions
+
+        // volume ramps, configured by audio.policy.volume_ramp_ms and audio.policy.volume_ramp_curve
+        static const uint32_t VOLUME_RAMP_STEP_MS = 5;  // duration of one ramp step
+        static const uint32_t MAX_VOLUME_RAMP_STEPS = 8;
+        static const char * const sVolumeRampCurveNames[NUM_RAMP_CURVES];
+        uint32_t mVolumeRampMs;                  // ramp duration, 0 if ramps are disabled
+        volume_ramp_curve mVolumeRampCurve;
+        uint32_t mVolumeRampCount;               // ramps scheduled
+        uint32_t mVolumeRampSuperseded;          // ramps started while the previous one was pending
+        sp<VolumeRampThread> mVolumeRampThread;  // NULL if ramps are disabled
+
+        Mutex mTraceLock;                   // protects mTrace and mTraceCount
+        uint32_t mTraceCount;               // events recorded since start
+        // ring buffer indexed by mTraceCount % TRACE_SIZE, NULL if tracing is disabled
+        TraceEvent *mTrace;
+        uint32_t mApiDepth;                 // nesting level of timed policy calls
+
+        ApiStats mApiStats[NUM_APIS];
+        static const char * const sApiNames[NUM_APIS];
+        String8 mApiStatsResetToken;        // last value of property audio.policy.dump.reset
+
+        // state published for lock free queries. Written under the policy service lock by
+        // publishSnapshot() and read without lock: mSnapshotSeq is odd while mSnapshot is
+        // being written and readers retry if it changed while they were reading.
+        StateSnapshot mSnapshot;
+        volatile int32_t mSnapshotSeq;
+
 #ifdef AUDIO_POLICY_TEST
         Mutex   mLock;
-        Condition mWaitWorkCV;
+        Condition mWaitWorkCV;      // signaled when a test command is queued or on exit
+        Vector<String8> mTestCommands;  // test commands queued by setParameters()
 
         int             mCurOutput;
         bool            mDirectOutput;
@@ -591,6 +1278,9 @@ protected:
 private:
         static float volIndexToAmpl(audio_devices_t device, const StreamDescriptor& streamDesc,
                 int indexInUi);
+        // interpolate the attenuation for a volume curve index and convert it to an amplitude.
+        //    Only used to fill the StreamDescriptor amplitude tables.
+        static float curveIndexToAmpl(const VolumeCurvePoint *curve, int volIdx);
         // updates device caching and output for streams that can influence the
         //    routing of notifications
         void handleNotificationRoutingForStream(AudioSystem::stream_type stream);
@@ -28,6 +28,10 @@
 #define AUDIO_POLICY_CONFIG_FILE "/system/etc/audio_policy.conf"
 #define AUDIO_POLICY_VENDOR_CONFIG_FILE "/vendor/etc/audio_policy.conf"
 
+// directory where binary snapshots of the parsed configuration files are stored.
+// See AudioPolicyManagerBase::loadAudioPolicyConfig()
+#define AUDIO_POLICY_CONFIG_CACHE_DIR "/data/misc/audio"
+
 // global configuration
 #define GLOBAL_CONFIG_TAG "global_configuration"
 
@@ -35,6 +39,12 @@
 #define DEFAULT_OUTPUT_DEVICE_TAG "default_output_device"
 #define ATTACHED_INPUT_DEVICES_TAG "attached_input_devices"
 #define SPEAKER_DRC_ENABLED_TAG "speaker_drc_enabled"
+// maximum CPU load (0.1 MIPS units) and memory (KB) of audio effects on each output or input
+// and on all outputs and inputs of a HW module. 0 or absent: only the global limits apply.
+#define EFFECTS_MAX_CPU_LOAD_PER_IO_TAG "effects_max_cpu_load_per_io"
+#define EFFECTS_MAX_MEMORY_PER_IO_TAG "effects_max_memory_per_io"
+#define EFFECTS_MAX_CPU_LOAD_PER_MODULE_TAG "effects_max_cpu_load_per_module"
+#define EFFECTS_MAX_MEMORY_PER_MODULE_TAG "effects_max_memory_per_module"
 
 // hw modules descriptions
 #define AUDIO_HW_MODULE_TAG "audio_hw_modules"